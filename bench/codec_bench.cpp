@@ -0,0 +1,168 @@
+#include <new>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+#include "../src/communication.h"
+
+/*
+ * Compares encoding and decoding of every command with message_view and commands built up to their sent bytes
+ * against the previous codec. That one filled the whole 64 KiB data array when building a command, and received
+ * into a cleared temporary that was then copied into a wrapper and from it into a local variable.
+ * Both decoders start with copying the datagram into their buffer, which stands for recvfrom.
+ * Usage: netstore-codec-bench [repetitions]
+ */
+
+struct codec_case {
+
+    std::string name;
+    std::string cmd;
+    bool complex;
+    std::string data;
+};
+
+static volatile uint64_t sink;
+
+static std::vector<codec_case> cases() {
+
+    std::string file = "holiday_photo_2024.jpg";
+    std::string trailer(2 * sizeof(uint64_t), '\1');
+    std::string list;
+    for (int i = 0; list.length() < 1000; i++) {
+        list += (i > 0 ? "\n" : "") + std::to_string(i) + "_" + file;
+    }
+    return {
+            {"HELLO", HELLO_REQUEST, false, ""},
+            {"GOOD_DAY", HELLO_RESPONSE, true, "239.10.11.12"},
+            {"LIST", LIST_REQUEST, false, "photo"},
+            {"MY_LIST 1 KiB", LIST_RESPONSE, false, list},
+            {"GET", GET_REQUEST, false, file},
+            {"GET_RANGE", GET_RANGE_REQUEST, true, file + '\0' + trailer},
+            {"CONNECT_ME", GET_RESPONSE, true, file + '\0' + trailer.substr(sizeof(uint64_t))},
+            {"ADD", ADD_REQUEST, true, file + '\0' + trailer.substr(sizeof(uint64_t))},
+            {"DEL", DELETE_REQUEST, false, file},
+    };
+}
+
+/*
+ * Builds a command the way handlers do, with the constructor followed by whatever comes after the '\0' of data.
+ */
+static size_t encode(const codec_case &test, cmplx_cmd *complex, simpl_cmd *simple) {
+
+    size_t name_length = strlen(test.data.c_str());
+    if (test.complex) {
+        new (complex) cmplx_cmd(test.cmd.c_str(), 1, 2, test.data.c_str());
+        memcpy(complex->data + name_length, test.data.data() + name_length, test.data.length() - name_length);
+        return EMPTY_CMPLX_CMD_LENGTH + test.data.length();
+    }
+    new (simple) simpl_cmd(test.cmd.c_str(), 1, test.data.c_str());
+    return EMPTY_SIMPL_CMD_LENGTH + test.data.length();
+}
+
+static size_t legacy_encode(const codec_case &test, cmplx_cmd *complex, simpl_cmd *simple) {
+
+    size_t name_length = strlen(test.data.c_str());
+    if (test.complex) {
+        memset(complex->cmd, 0, CMD_MAX_LENGTH);
+        memcpy(complex->cmd, test.cmd.data(), test.cmd.length());
+        complex->cmd_seq = 1;
+        complex->param = 2;
+        strncpy(complex->data, test.data.c_str(), CMPLX_CMD_MAX_DATA_LENGTH);
+        memcpy(complex->data + name_length, test.data.data() + name_length, test.data.length() - name_length);
+        return EMPTY_CMPLX_CMD_LENGTH + test.data.length();
+    }
+    memset(simple->cmd, 0, CMD_MAX_LENGTH);
+    memcpy(simple->cmd, test.cmd.data(), test.cmd.length());
+    simple->cmd_seq = 1;
+    strncpy(simple->data, test.data.c_str(), SIMPL_CMD_MAX_DATA_LENGTH);
+    return EMPTY_SIMPL_CMD_LENGTH + test.data.length();
+}
+
+/*
+ * Reads the fields a handler reads: the command, cmd_seq, param of complex commands and the name in data.
+ */
+static uint64_t decode(const char *datagram, size_t length, bool complex, message_buffer *buffer) {
+
+    memcpy(buffer->bytes, datagram, length);
+    buffer->bytes[length] = '\0';
+    message_view message{buffer->bytes, length, {}};
+    uint64_t result = message.cmd()[0] + message.cmd_seq();
+    if (complex) {
+        result += message.param() + std::string(message.cmplx_data()).length();
+    } else {
+        result += std::string(message.simpl_data()).length();
+    }
+    return result;
+}
+
+static uint64_t legacy_decode(const char *datagram, size_t length, bool complex, cmplx_cmd *temporary,
+                              cmplx_cmd *wrapper, cmplx_cmd *local) {
+
+    memset((void*)temporary, 0, sizeof(cmplx_cmd));
+    memcpy((void*)temporary, datagram, length);
+    memcpy((void*)wrapper, temporary, sizeof(cmplx_cmd));
+    memcpy((void*)local, wrapper, sizeof(cmplx_cmd));
+    uint64_t result = local->cmd[0] + be64toh(local->cmd_seq);
+    if (complex) {
+        result += be64toh(local->param) + std::string(local->data).length();
+    } else {
+        result += std::string(((simpl_cmd*)local)->data).length();
+    }
+    return result;
+}
+
+template<typename F>
+static double average_nanoseconds(size_t repetitions, F f) {
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repetitions; i++) {
+        f();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t repetitions = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    std::unique_ptr<cmplx_cmd> complex(new cmplx_cmd);
+    std::unique_ptr<simpl_cmd> simple(new simpl_cmd);
+    std::unique_ptr<cmplx_cmd> temporary(new cmplx_cmd);
+    std::unique_ptr<cmplx_cmd> wrapper(new cmplx_cmd);
+    std::unique_ptr<cmplx_cmd> local(new cmplx_cmd);
+    std::unique_ptr<message_buffer> buffer(new message_buffer);
+
+    std::cout << std::left << std::setw(16) << "command" << std::setw(8) << "bytes"
+              << std::setw(16) << "encode [ns]" << std::setw(16) << "legacy [ns]"
+              << std::setw(16) << "decode [ns]" << std::setw(16) << "legacy [ns]" << std::endl;
+    for (const codec_case &test : cases()) {
+        size_t length = encode(test, complex.get(), simple.get());
+        std::string datagram(test.complex ? (const char*)complex.get() : (const char*)simple.get(), length);
+        legacy_encode(test, complex.get(), simple.get());
+        if (datagram != std::string(test.complex ? (const char*)complex.get() : (const char*)simple.get(), length) ||
+            decode(datagram.data(), length, test.complex, buffer.get()) !=
+            legacy_decode(datagram.data(), length, test.complex, temporary.get(), wrapper.get(), local.get())) {
+            std::cerr << "Codecs disagree on " << test.name << std::endl;
+            return 1;
+        }
+
+        double encoded = average_nanoseconds(repetitions, [&] {
+            sink = sink + encode(test, complex.get(), simple.get()); });
+        double legacy_encoded = average_nanoseconds(repetitions, [&] {
+            sink = sink + legacy_encode(test, complex.get(), simple.get()); });
+        double decoded = average_nanoseconds(repetitions, [&] {
+            sink = sink + decode(datagram.data(), length, test.complex, buffer.get()); });
+        double legacy_decoded = average_nanoseconds(repetitions, [&] {
+            sink = sink + legacy_decode(datagram.data(), length, test.complex, temporary.get(), wrapper.get(),
+                                        local.get()); });
+        std::cout << std::setw(16) << test.name << std::setw(8) << length << std::fixed << std::setprecision(1)
+                  << std::setw(16) << encoded << std::setw(16) << legacy_encoded
+                  << std::setw(16) << decoded << std::setw(16) << legacy_decoded << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include "../src/file_index.h"
+#include "../src/communication.h"
+
+/*
+ * Compares LIST pattern matching through file_index_snapshot with the linear scan over a std::set of all names
+ * that the server used before. Usage: netstore-index-bench [number_of_files] [repetitions]
+ */
+
+static const std::vector<std::string> WORDS = {
+        "photo", "backup", "report", "invoice", "draft", "config", "server", "holiday", "summary", "notes",
+        "budget", "archive", "thesis", "video", "scan", "log", "export", "final", "copy", "music"
+};
+static const std::vector<std::string> EXTENSIONS = {".jpg", ".txt", ".pdf", ".tar.gz", ".log", ".csv", ".mp4"};
+
+static std::vector<std::string> generate_names(size_t count) {
+
+    std::mt19937_64 generator(42);
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        names.push_back(WORDS[generator() % WORDS.size()] + "_" + WORDS[generator() % WORDS.size()] + "_" +
+                        std::to_string(i) + EXTENSIONS[generator() % EXTENSIONS.size()]);
+    }
+    return names;
+}
+
+static size_t linear_list(const std::set<std::string> &names, const std::string &pattern) {
+
+    std::vector<std::string> responses;
+    for (const std::string &name : names) {
+        if (name.find(pattern) == std::string::npos) {
+            continue;
+        }
+        if (responses.empty() || responses.back().length() + 1 + name.length() > SIMPL_CMD_MAX_DATA_LENGTH) {
+            responses.emplace_back();
+        } else {
+            responses.back() += '\n';
+        }
+        responses.back() += name;
+    }
+    size_t matches = 0;
+    for (const std::string &response : responses) {
+        matches += std::count(response.begin(), response.end(), '\n') + 1;
+    }
+    return matches;
+}
+
+static size_t indexed_list(const file_index_snapshot &snapshot, const std::string &pattern) {
+
+    size_t matches = 0;
+    std::shared_ptr<const std::vector<std::string>> responses = snapshot.list(pattern);
+    for (const std::string &response : *responses) {
+        matches += std::count(response.begin(), response.end(), '\n') + 1;
+    }
+    return matches;
+}
+
+template<typename F>
+static double average_microseconds(size_t repetitions, F f) {
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repetitions; i++) {
+        f();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t count = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t repetitions = (argc > 2) ? std::strtoull(argv[2], nullptr, 10) : 10;
+    std::vector<std::string> names = generate_names(count);
+    std::set<std::string> names_set(names.begin(), names.end());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<file_entry> entries;
+    for (const std::string &name : names) {
+        entries.push_back({name, 0});
+    }
+    std::shared_ptr<const file_index_snapshot> snapshot = file_index_snapshot::build(entries);
+    std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - start;
+    std::cout << "files: " << count << ", index build: " << std::fixed << std::setprecision(1)
+              << build_time.count() << " ms" << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(20) << "pattern" << std::setw(12) << "matches"
+              << std::setw(16) << "linear [us]" << std::setw(16) << "indexed [us]" << "speedup" << std::endl;
+    for (const std::string &pattern : {std::string("ph"), std::string("log"), std::string("summary"),
+                                       std::string("invoice_thesis"), std::string("_123456."),
+                                       std::string("no_such_name")}) {
+        size_t expected = linear_list(names_set, pattern);
+        size_t found = indexed_list(*snapshot, pattern);
+        if (expected != found) {
+            std::cerr << "Mismatch for pattern " << pattern << ": " << expected << " vs " << found << std::endl;
+            return 1;
+        }
+        double linear = average_microseconds(repetitions, [&] { linear_list(names_set, pattern); });
+        double indexed = average_microseconds(repetitions, [&] { indexed_list(*snapshot, pattern); });
+        std::cout << std::setw(20) << pattern << std::setw(12) << found << std::setw(16) << linear
+                  << std::setw(16) << indexed << std::setprecision(1) << linear / indexed << "x" << std::endl;
+    }
+
+    double add = average_microseconds(repetitions, [&] { snapshot->with_file("new_file_for_benchmark.txt", 0); });
+    double del = average_microseconds(repetitions, [&] { snapshot->without_file(names[0]); });
+    std::cout << std::endl << "publishing a version with one file added: " << add << " us, removed: " << del
+              << " us" << std::endl;
+    return 0;
+}
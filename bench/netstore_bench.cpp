@@ -0,0 +1,564 @@
+#include <array>
+#include <memory>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <arpa/inet.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include "../src/server.h"
+#include "../src/metrics.h"
+#include "../src/communication.h"
+#include "../src/commands.h"
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+
+/*
+ * Load generator for whole servers. Starts --servers servers in child processes, each with its own temporary shared
+ * folder holding --files files of --file-size bytes, then runs --clients simulated clients that speak the protocol
+ * directly and pick commands by the weights in --mix. Prints throughput and latency of every command as JSON.
+ *
+ * All servers join the same multicast group, but each on its own command port, since servers on one host sharing a
+ * port couldn't be told apart by unicast. HELLO, LIST and DEL go to the group on a server's port like a real client
+ * sends them, GET and ADD go to 127.0.0.1. Commands use no transfer flags, so every transfer opens its own port.
+ * With the same seed every client draws the same sequence of commands and servers.
+ */
+
+enum class bench_command {
+    HELLO,
+    LIST,
+    GET,
+    ADD,
+    DEL,
+    COUNT
+};
+
+constexpr size_t BENCH_COMMANDS = (size_t)bench_command::COUNT;
+static const char *COMMAND_NAMES[BENCH_COMMANDS] = {"HELLO", "LIST", "GET", "ADD", "DEL"};
+constexpr size_t TRANSFER_BUFFER_SIZE = 65536;
+constexpr std::chrono::seconds SERVER_START_TIMEOUT(10);
+
+struct bench_options {
+
+    uint32_t servers;
+    uint32_t clients;
+    uint32_t duration;
+    uint64_t requests;
+    std::string mix;
+    uint64_t files;
+    uint64_t file_size;
+    uint64_t upload_size;
+    uint64_t seed;
+    uint32_t timeout_ms;
+    std::string mcast_addr;
+    in_port_t first_port;
+    uint64_t max_space;
+    std::vector<std::string> server_args;
+    std::vector<double> weights;
+
+    void fill_from_arguments(int argc, const char *argv[]);
+};
+
+struct command_result {
+
+    uint64_t operations = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    histogram_snapshot latency;
+
+    void add(const command_result &other);
+};
+
+/*
+ * State of one simulated client. Files it uploaded are deleted by its DEL commands, newest first.
+ */
+struct bench_client {
+
+    const bench_options &options;
+    std::mt19937_64 generator;
+    UDP_socket socket;
+    std::unique_ptr<message_buffer> received_buffer = std::make_unique<message_buffer>();
+    message_view received;
+    std::vector<char> buffer = std::vector<char>(TRANSFER_BUFFER_SIZE);
+    std::vector<std::pair<uint32_t, std::string>> uploaded;
+    uint32_t id;
+    uint64_t uploads = 0;
+    std::array<command_result, BENCH_COMMANDS> results;
+
+    bench_client(const bench_options &options, uint32_t id);
+
+    bool send_to_server(const cmplx_cmd &command, uint32_t server, uint16_t data_len);
+    /*
+     * Waits for a datagram answering cmd_seq, older answers that arrived late are skipped.
+     */
+    bool receive_answer(uint64_t cmd_seq, std::chrono::steady_clock::time_point deadline);
+    /*
+     * Sends a command to every server and waits until each of them answered once.
+     */
+    bool ask_all(const char *cmd, const std::string &data);
+    bool get(uint64_t *bytes);
+    bool add(uint64_t *bytes);
+    bool del();
+    void run(std::chrono::steady_clock::time_point end);
+};
+
+void bench_options::fill_from_arguments(int argc, const char **argv) {
+
+    po::options_description description("Benchmark options");
+    description.add_options()
+            ("help,h", "Print this help")
+            ("servers", po::value<uint32_t>(&(this->servers))->default_value(2), "Number of servers")
+            ("clients", po::value<uint32_t>(&(this->clients))->default_value(8), "Number of concurrent clients")
+            ("duration", po::value<uint32_t>(&(this->duration))->default_value(10), "Seconds of load")
+            ("requests", po::value<uint64_t>(&(this->requests))->default_value(0),
+                    "Commands sent by every client, overrides duration if not 0")
+            ("mix", po::value<std::string>(&(this->mix))->default_value("hello=1,list=1,get=6,add=1,del=1"),
+                    "Weights of commands, names are hello, list, get, add and del")
+            ("files", po::value<uint64_t>(&(this->files))->default_value(100), "Files in every server's folder")
+            ("file-size", po::value<uint64_t>(&(this->file_size))->default_value(65536),
+                    "Size of the files fetched by GET")
+            ("upload-size", po::value<uint64_t>(&(this->upload_size))->default_value(65536),
+                    "Size of the files uploaded by ADD")
+            ("seed", po::value<uint64_t>(&(this->seed))->default_value(1), "Seed of the clients' random choices")
+            ("timeout-ms", po::value<uint32_t>(&(this->timeout_ms))->default_value(2000),
+                    "Time after which a command counts as failed")
+            ("mcast-addr", po::value<std::string>(&(this->mcast_addr))->default_value("239.10.11.12"),
+                    "Multicast address of the servers")
+            ("port", po::value<in_port_t>(&(this->first_port))->default_value(10200),
+                    "Command port of the first server, the others use the following ones")
+            ("max-space", po::value<uint64_t>(&(this->max_space))->default_value(1073741824),
+                    "Max space of every server")
+            ("server-arg", po::value<std::vector<std::string>>(&(this->server_args))->composing(),
+                    "Option passed to every server, e.g. --server-arg=--cache-size=0, may be repeated")
+            ;
+    po::variables_map var_map;
+    try {
+        po::store(po::parse_command_line(argc, argv, description), var_map);
+        if (var_map.count("help")) {
+            std::cerr << description << std::endl;
+            exit(0);
+        }
+        po::notify(var_map);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl << description << std::endl;
+        exit(1);
+    }
+
+    this->weights.assign(BENCH_COMMANDS, 0);
+    std::stringstream mix(this->mix);
+    std::string part;
+    while (std::getline(mix, part, ',')) {
+        size_t equals = part.find('=');
+        size_t command = BENCH_COMMANDS;
+        for (size_t i = 0; i < BENCH_COMMANDS && equals != std::string::npos; i++) {
+            if (strcasecmp(part.substr(0, equals).c_str(), COMMAND_NAMES[i]) == 0) {
+                command = i;
+            }
+        }
+        if (command == BENCH_COMMANDS) {
+            std::cerr << "Invalid mix entry: " << part << std::endl;
+            exit(1);
+        }
+        this->weights[command] = strtod(part.c_str() + equals + 1, nullptr);
+    }
+    bool any = false;
+    for (double weight : this->weights) {
+        any |= weight > 0;
+    }
+    if (!any || this->servers == 0 || this->clients == 0) {
+        std::cerr << "Nothing to benchmark" << std::endl;
+        exit(1);
+    }
+    if (this->files == 0 && (this->weights[(size_t)bench_command::GET] > 0 ||
+                             this->weights[(size_t)bench_command::LIST] > 0)) {
+        std::cerr << "GET and LIST need files" << std::endl;
+        exit(1);
+    }
+    if (this->weights[(size_t)bench_command::DEL] > 0 && this->weights[(size_t)bench_command::ADD] == 0) {
+        std::cerr << "DEL needs ADD, clients delete only files they uploaded" << std::endl;
+        exit(1);
+    }
+}
+
+void command_result::add(const command_result &other) {
+
+    this->operations += other.operations;
+    this->errors += other.errors;
+    this->bytes += other.bytes;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        this->latency.buckets[bucket] += other.latency.buckets[bucket];
+    }
+    this->latency.count += other.latency.count;
+    this->latency.sum += other.latency.sum;
+}
+
+static std::string file_name(uint64_t number) {
+    return "bench_" + std::to_string(number) + ".bin";
+}
+
+static sockaddr_in address(const std::string &ip, in_port_t port) {
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_aton(ip.c_str(), &addr.sin_addr);
+    return addr;
+}
+
+static bool write_all(int32_t fd, const char *data, size_t length) {
+
+    while (length > 0) {
+        ssize_t len = write(fd, data, length);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return false;
+        }
+        data += len;
+        length -= len;
+    }
+    return true;
+}
+
+bench_client::bench_client(const bench_options &options, uint32_t id) :
+        options(options), generator(options.seed * 1000003 + id), id(id) {
+
+    std::mt19937_64 contents(id);
+    for (char &byte : this->buffer) {
+        byte = (char)contents();
+    }
+}
+
+bool bench_client::send_to_server(const cmplx_cmd &command, uint32_t server, uint16_t data_len) {
+    return this->socket.send_cmplx_cmd(command, address("127.0.0.1", this->options.first_port + server), data_len);
+}
+
+bool bench_client::receive_answer(uint64_t cmd_seq, std::chrono::steady_clock::time_point deadline) {
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (!this->socket.receive_message(this->received_buffer.get(), &this->received)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (this->received.length >= (size_t)EMPTY_SIMPL_CMD_LENGTH && this->received.cmd_seq() == cmd_seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bench_client::ask_all(const char *cmd, const std::string &data) {
+
+    uint64_t cmd_seq = this->generator();
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(this->options.timeout_ms);
+    for (uint32_t server = 0; server < this->options.servers; server++) {
+        simpl_cmd command(cmd, htobe64(cmd_seq), data.c_str());
+        if (!this->socket.send_simpl_cmd(command, address(this->options.mcast_addr, this->options.first_port + server),
+                                         data.length())) {
+            return false;
+        }
+    }
+    /* Every server answers from its own port, LIST answers split into many datagrams count once. */
+    std::vector<bool> answered(this->options.servers, false);
+    uint32_t left = this->options.servers;
+    while (left > 0) {
+        if (!this->receive_answer(cmd_seq, deadline)) {
+            return false;
+        }
+        uint32_t server = ntohs(this->received.address.sin_port) - this->options.first_port;
+        if (server < this->options.servers && !answered[server]) {
+            answered[server] = true;
+            left--;
+        }
+    }
+    return true;
+}
+
+bool bench_client::get(uint64_t *bytes) {
+
+    uint32_t server = this->generator() % this->options.servers;
+    std::string file = file_name(this->generator() % this->options.files);
+    uint64_t cmd_seq = this->generator();
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(this->options.timeout_ms);
+    simpl_cmd command(GET_REQUEST, htobe64(cmd_seq), file.c_str());
+    if (!this->socket.send_simpl_cmd_by_ip(command, "127.0.0.1", htons(this->options.first_port + server),
+                                           file.length()) ||
+        !this->receive_answer(cmd_seq, deadline) ||
+        identify_command(this->received) != command_id::CONNECT_ME) {
+        return false;
+    }
+    in_port_t port = this->received.param() & TRANSFER_PORT_MASK;
+    TCP_socket connection;
+    if (!connection.init_socket() || !connection.connect_to_socket("127.0.0.1", htons(port))) {
+        return false;
+    }
+    ssize_t len;
+    while ((len = read(connection.socket_number, this->buffer.data(), this->buffer.size())) != 0) {
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            return false;
+        }
+        (*bytes) += len;
+    }
+    return (*bytes) == this->options.file_size;
+}
+
+bool bench_client::add(uint64_t *bytes) {
+
+    uint32_t server = this->generator() % this->options.servers;
+    std::string file = "upload_" + std::to_string(this->id) + "_" + std::to_string(this->uploads++) + ".bin";
+    uint64_t cmd_seq = this->generator();
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(this->options.timeout_ms);
+    cmplx_cmd command(ADD_REQUEST, htobe64(cmd_seq), htobe64(this->options.upload_size), file.c_str());
+    if (!this->send_to_server(command, server, file.length()) || !this->receive_answer(cmd_seq, deadline) ||
+        identify_command(this->received) != command_id::CAN_ADD) {
+        return false;
+    }
+    in_port_t port = this->received.param() & TRANSFER_PORT_MASK;
+    TCP_socket connection;
+    if (!connection.init_socket() || !connection.connect_to_socket("127.0.0.1", htons(port))) {
+        return false;
+    }
+    uint64_t left = this->options.upload_size;
+    while (left > 0) {
+        size_t chunk = std::min<uint64_t>(left, this->buffer.size());
+        if (!write_all(connection.socket_number, this->buffer.data(), chunk)) {
+            return false;
+        }
+        left -= chunk;
+    }
+    /* The server closes the connection once it has the whole file. */
+    shutdown(connection.socket_number, SHUT_WR);
+    while (read(connection.socket_number, this->buffer.data(), this->buffer.size()) > 0) {}
+    (*bytes) += this->options.upload_size;
+    this->uploaded.emplace_back(server, file);
+    return true;
+}
+
+bool bench_client::del() {
+
+    std::pair<uint32_t, std::string> file = this->uploaded.back();
+    this->uploaded.pop_back();
+    simpl_cmd command(DELETE_REQUEST, htobe64(this->generator()), file.second.c_str());
+    return this->socket.send_simpl_cmd(
+            command, address(this->options.mcast_addr, this->options.first_port + file.first), file.second.length());
+}
+
+void bench_client::run(std::chrono::steady_clock::time_point end) {
+
+    if (!this->socket.init_multicast_socket() || !this->socket.set_timeout(100000000)) {
+        std::cerr << "Error while creating client socket" << std::endl;
+        exit(1);
+    }
+    std::discrete_distribution<size_t> mix(this->options.weights.begin(), this->options.weights.end());
+    for (uint64_t done = 0; this->options.requests > 0 ? done < this->options.requests
+                                                       : std::chrono::steady_clock::now() < end; done++) {
+        bench_command command = (bench_command)mix(this->generator);
+        if (command == bench_command::DEL && this->uploaded.empty()) {
+            /* Nothing to delete yet, a client deletes only its own uploads. */
+            done--;
+            continue;
+        }
+        uint64_t bytes = 0;
+        bool success = false;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        switch (command) {
+            case bench_command::HELLO:
+                success = this->ask_all(HELLO_REQUEST, "");
+                break;
+            case bench_command::LIST:
+                success = this->ask_all(LIST_REQUEST, "");
+                break;
+            case bench_command::GET:
+                success = this->get(&bytes);
+                break;
+            case bench_command::ADD:
+                success = this->add(&bytes);
+                break;
+            default:
+                success = this->del();
+                break;
+        }
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        command_result &result = this->results[(size_t)command];
+        result.operations++;
+        if (!success) {
+            result.errors++;
+            continue;
+        }
+        result.bytes += bytes;
+        result.latency.buckets[histogram_bucket(elapsed)]++;
+        result.latency.count++;
+        result.latency.sum += elapsed;
+    }
+}
+
+/*
+ * Runs a server in a child process that dies with the benchmark. Its output goes to stderr, away from the results.
+ */
+static pid_t start_server(const bench_options &options, uint32_t number, const std::string &folder) {
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    std::vector<std::string> arguments = {"netstore-server", "-g", options.mcast_addr,
+                                          "-p", std::to_string(options.first_port + number),
+                                          "-f", folder, "-b", std::to_string(options.max_space)};
+    arguments.insert(arguments.end(), options.server_args.begin(), options.server_args.end());
+    std::vector<const char*> argv;
+    for (const std::string &argument : arguments) {
+        argv.push_back(argument.c_str());
+    }
+    server_options server_options;
+    server_options.fill_from_arguments(argv.size(), argv.data());
+    Server server(server_options);
+    server.run();
+    _exit(0);
+}
+
+static void fill_folder(const bench_options &options, const std::string &folder) {
+
+    fs::create_directories(folder);
+    std::mt19937_64 generator(options.seed);
+    std::string contents(options.file_size, '\0');
+    for (char &byte : contents) {
+        byte = (char)generator();
+    }
+    for (uint64_t i = 0; i < options.files; i++) {
+        std::ofstream file(folder + "/" + file_name(i), std::ios::binary);
+        file.write(contents.data(), contents.size());
+    }
+}
+
+static double milliseconds(uint64_t nanoseconds) {
+    return nanoseconds / 1e6;
+}
+
+static void print_result(const command_result &result, double seconds, const std::string &indent) {
+
+    char text[512];
+    snprintf(text, sizeof(text),
+             "%s\"operations\": %lu,\n%s\"errors\": %lu,\n%s\"ops_per_sec\": %.1f,\n%s\"mb_per_sec\": %.2f,\n"
+             "%s\"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}\n",
+             indent.c_str(), result.operations, indent.c_str(), result.errors, indent.c_str(),
+             (result.operations - result.errors) / seconds, indent.c_str(), result.bytes / 1e6 / seconds,
+             indent.c_str(), result.latency.count ? milliseconds(result.latency.sum / result.latency.count) : 0.0,
+             milliseconds(result.latency.quantile(0.5)), milliseconds(result.latency.quantile(0.99)),
+             milliseconds(result.latency.quantile(0.999)));
+    std::cout << text;
+}
+
+int main(int argc, const char *argv[]) {
+
+    bench_options options;
+    options.fill_from_arguments(argc, argv);
+
+    char root_template[] = "/tmp/netstore-bench-XXXXXX";
+    if (mkdtemp(root_template) == nullptr) {
+        std::cerr << "Error while creating temporary folder" << std::endl;
+        return 1;
+    }
+    std::string root(root_template);
+    std::vector<pid_t> servers;
+    for (uint32_t i = 0; i < options.servers; i++) {
+        std::string folder = root + "/server_" + std::to_string(i);
+        fill_folder(options, folder);
+        servers.push_back(start_server(options, i, folder));
+    }
+
+    /* Servers are ready once all of them answer HELLO. */
+    bench_client probe(options, options.clients);
+    probe.socket.init_multicast_socket();
+    probe.socket.set_timeout(100000000);
+    std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now() + SERVER_START_TIMEOUT;
+    bool ready = false;
+    while (!ready && std::chrono::steady_clock::now() < give_up) {
+        ready = probe.ask_all(HELLO_REQUEST, "");
+    }
+
+    std::vector<std::unique_ptr<bench_client>> clients;
+    std::chrono::duration<double> elapsed(0);
+    if (ready) {
+        for (uint32_t i = 0; i < options.clients; i++) {
+            clients.push_back(std::make_unique<bench_client>(options, i));
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point end = start + std::chrono::seconds(options.duration);
+        std::vector<std::thread> threads;
+        for (std::unique_ptr<bench_client> &client : clients) {
+            threads.emplace_back(&bench_client::run, client.get(), end);
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    for (pid_t pid : servers) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    fs::remove_all(root);
+    if (!ready) {
+        std::cerr << "Servers didn't answer HELLO within " << SERVER_START_TIMEOUT.count() << " s" << std::endl;
+        return 1;
+    }
+
+    std::array<command_result, BENCH_COMMANDS> results;
+    command_result total;
+    for (const std::unique_ptr<bench_client> &client : clients) {
+        for (size_t i = 0; i < BENCH_COMMANDS; i++) {
+            results[i].add(client->results[i]);
+            total.add(client->results[i]);
+        }
+    }
+    double seconds = elapsed.count();
+    std::cout << "{\n  \"config\": {\"servers\": " << options.servers << ", \"clients\": " << options.clients
+              << ", \"duration_s\": " << seconds << ", \"requests\": " << options.requests << ", \"mix\": \""
+              << options.mix << "\", \"files\": " << options.files << ", \"file_size\": " << options.file_size
+              << ", \"upload_size\": " << options.upload_size << ", \"seed\": " << options.seed
+              << ", \"server_args\": [";
+    for (size_t i = 0; i < options.server_args.size(); i++) {
+        std::cout << (i > 0 ? ", " : "") << "\"" << options.server_args[i] << "\"";
+    }
+    std::cout << "]},\n  \"total\": {\n";
+    print_result(total, seconds, "    ");
+    std::cout << "  },\n  \"commands\": {";
+    bool first = true;
+    for (size_t i = 0; i < BENCH_COMMANDS; i++) {
+        if (options.weights[i] == 0) {
+            continue;
+        }
+        std::cout << (first ? "\n" : ",\n") << "    \"" << COMMAND_NAMES[i] << "\": {\n";
+        print_result(results[i], seconds, "      ");
+        std::cout << "    }";
+        first = false;
+    }
+    std::cout << "\n  }\n}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "blob_store.h"
+
+Content_hash::Content_hash() {
+
+    this->context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(this->context, EVP_sha256(), nullptr);
+}
+
+Content_hash::~Content_hash() {
+    EVP_MD_CTX_free(this->context);
+}
+
+void Content_hash::update(const char *data, size_t len) {
+    EVP_DigestUpdate(this->context, data, len);
+}
+
+std::string Content_hash::hex_digest() {
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_DigestFinal_ex(this->context, digest, &digest_length);
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    std::string hex(2 * digest_length, '0');
+    for (unsigned int i = 0; i < digest_length; i++) {
+        hex[2 * i] = HEX_DIGITS[digest[i] >> 4];
+        hex[2 * i + 1] = HEX_DIGITS[digest[i] & 0xf];
+    }
+    return hex;
+}
+
+
+bool Blob_store::init(const std::string &folder) {
+
+    this->folder = folder;
+    this->blobs.clear();
+    this->inodes.clear();
+    unlink((folder + BLOB_LINK_TMP_FILE).c_str());
+    std::string blobs_folder = folder + BLOBS_FOLDER;
+    if (mkdir(blobs_folder.c_str(), 0777) < 0 && errno != EEXIST) {
+        return false;
+    }
+    DIR *directory = opendir(blobs_folder.c_str());
+    if (directory == nullptr) {
+        return false;
+    }
+    dirent *entry;
+    while ((entry = readdir(directory)) != nullptr) {
+        struct stat blob_stat{};
+        if (fstatat(dirfd(directory), entry->d_name, &blob_stat, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(blob_stat.st_mode)) {
+            continue;
+        }
+        if (blob_stat.st_nlink < 2) {
+            unlinkat(dirfd(directory), entry->d_name, 0);
+            continue;
+        }
+        this->blobs[blob_stat.st_ino] = {entry->d_name, (uint64_t)blob_stat.st_size, blob_stat.st_nlink - 1};
+        this->inodes[entry->d_name] = blob_stat.st_ino;
+    }
+    closedir(directory);
+    return true;
+}
+
+uint64_t Blob_store::duplicated_bytes() const {
+
+    uint64_t duplicated = 0;
+    for (const auto &blob : this->blobs) {
+        duplicated += blob.second.size * (blob.second.references - 1);
+    }
+    return duplicated;
+}
+
+bool Blob_store::store(const std::string &file, const std::string &id) {
+
+    std::string path = this->folder + file;
+    auto existing = this->inodes.find(id);
+    if (existing != this->inodes.end()) {
+        /* Link next to the file and rename over it, so the name never disappears. */
+        std::string link_path = this->folder + BLOB_LINK_TMP_FILE;
+        if (link((this->folder + BLOBS_FOLDER + id).c_str(), link_path.c_str()) < 0) {
+            return false;
+        }
+        if (rename(link_path.c_str(), path.c_str()) < 0) {
+            unlink(link_path.c_str());
+            return false;
+        }
+        this->blobs[existing->second].references++;
+        return true;
+    }
+    struct stat file_stat{};
+    if (stat(path.c_str(), &file_stat) < 0 || link(path.c_str(), (this->folder + BLOBS_FOLDER + id).c_str()) < 0) {
+        return false;
+    }
+    this->blobs[file_stat.st_ino] = {id, (uint64_t)file_stat.st_size, 1};
+    this->inodes[id] = file_stat.st_ino;
+    return false;
+}
+
+uint64_t Blob_store::release(const std::string &file, uint64_t size) {
+
+    struct stat file_stat{};
+    if (stat((this->folder + file).c_str(), &file_stat) < 0) {
+        return size;
+    }
+    auto blob = this->blobs.find(file_stat.st_ino);
+    if (blob == this->blobs.end()) {
+        return size;
+    }
+    if (--blob->second.references > 0) {
+        return 0;
+    }
+    unlink((this->folder + BLOBS_FOLDER + blob->second.id).c_str());
+    this->inodes.erase(blob->second.id);
+    this->blobs.erase(blob);
+    return size;
+}
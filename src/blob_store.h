@@ -0,0 +1,81 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+struct evp_md_ctx_st;
+
+/*
+ * Blobs live in a subfolder of the shared folder, named by the SHA-256 of their contents. Every stored file with
+ * the same contents is a hard link to its blob, so GET keeps reading files by name and the file system keeps the
+ * reference counts: a blob is referenced by st_nlink - 1 files.
+ */
+const std::string BLOBS_FOLDER = ".netstore-blobs/";
+const std::string BLOB_LINK_TMP_FILE = ".netstore-link.tmp";
+
+/*
+ * SHA-256 of data fed to it in order, computed while an upload streams in.
+ */
+class Content_hash {
+
+private:
+
+    evp_md_ctx_st *context;
+
+public:
+
+    Content_hash();
+    ~Content_hash();
+
+    Content_hash(const Content_hash &) = delete;
+    Content_hash &operator=(const Content_hash &) = delete;
+
+    void update(const char *data, size_t len);
+    /*
+     * Finishes the hash and returns it as lowercase hex, can be called only once.
+     */
+    std::string hex_digest();
+};
+
+struct blob_info {
+
+    std::string id;
+    uint64_t size;
+    uint64_t references;
+};
+
+/*
+ * Content addressed storage of a folder. Not thread safe, callers serialize all operations.
+ */
+class Blob_store {
+
+private:
+
+    std::string folder;
+    std::unordered_map<ino_t, blob_info> blobs;
+    std::unordered_map<std::string, ino_t> inodes;
+
+public:
+
+    /*
+     * Reads the blobs of the folder and removes the ones no file links to anymore.
+     */
+    bool init(const std::string &folder);
+    /*
+     * Returns how many bytes of the sizes of all files are shared with other files.
+     */
+    uint64_t duplicated_bytes() const;
+    /*
+     * Stores an uploaded file with contents identified by id. If a blob with the same contents already exists the
+     * file is replaced with a link to it and true is returned, as the file doesn't take any space of its own.
+     */
+    bool store(const std::string &file, const std::string &id);
+    /*
+     * Called before a file is removed from the folder, returns how many bytes of space removing it frees.
+     */
+    uint64_t release(const std::string &file, uint64_t size);
+};
+
+#endif //BLOB_STORE_H
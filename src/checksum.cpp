@@ -0,0 +1,110 @@
+#include <cstring>
+#include <endian.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "checksum.h"
+
+constexpr uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+typedef uint32_t (*crc_function)(uint32_t, const char*, size_t);
+
+/*
+ * tables[k][b] is the CRC of byte b followed by k zero bytes, so 8 bytes can be folded in with 8 independent lookups.
+ */
+struct slicing_tables {
+
+    uint32_t tables[8][256];
+
+    slicing_tables() {
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+            }
+            tables[0][byte] = crc;
+        }
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            for (int k = 1; k < 8; k++) {
+                tables[k][byte] = (tables[k - 1][byte] >> 8) ^ tables[0][tables[k - 1][byte] & 0xFF];
+            }
+        }
+    }
+};
+
+static uint32_t crc32c_software(uint32_t crc, const char *data, size_t len) {
+
+    static const slicing_tables slicing;
+    const uint32_t (&t)[8][256] = slicing.tables;
+    const unsigned char *bytes = (const unsigned char*)data;
+    while (len >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low = htole32(low) ^ crc;
+        high = htole32(high);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        bytes += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *bytes) & 0xFF];
+        bytes++;
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const char *data, size_t len) {
+
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, (unsigned char)*data);
+        data++;
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static crc_function choose_implementation() {
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_hardware;
+    }
+#endif
+    return crc32c_software;
+}
+
+void Crc32c::update(const char *data, size_t len) {
+
+    static const crc_function implementation = choose_implementation();
+    this->state = implementation(this->state, data, len);
+}
+
+void put_checksum(char *out, uint32_t checksum) {
+
+    checksum = htobe32(checksum);
+    memcpy(out, &checksum, sizeof(checksum));
+}
+
+uint32_t get_checksum(const char *in) {
+
+    uint32_t checksum;
+    memcpy(&checksum, in, sizeof(checksum));
+    return be32toh(checksum);
+}
@@ -0,0 +1,38 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Transfers with TRANSFER_FLAG_CHECKSUM end with the CRC32C of all data bytes, CHECKSUM_LENGTH bytes big endian.
+ */
+constexpr size_t CHECKSUM_LENGTH = sizeof(uint32_t);
+/*
+ * Value of a 64-bit checksum field when the checksum of a file isn't known.
+ */
+constexpr uint64_t NO_CHECKSUM = UINT64_MAX;
+
+/*
+ * CRC32C (Castagnoli) of data fed to it in order. Uses the SSE4.2 crc32 instruction when the CPU has it and
+ * a slicing-by-8 table otherwise, so it can run inside copy loops without a second pass over the data.
+ */
+class Crc32c {
+
+private:
+
+    uint32_t state = 0xFFFFFFFF;
+
+public:
+
+    void update(const char *data, size_t len);
+    uint32_t value() const {
+        return ~state;
+    }
+};
+
+void put_checksum(char *out, uint32_t checksum);
+uint32_t get_checksum(const char *in);
+
+#endif //CHECKSUM_H
@@ -1,38 +1,46 @@
 #include <random>
+#include <cstring>
 #include <chrono>
 #include <fstream>
 #include <thread>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <csignal>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
 #include "client.h"
 #include "communication.h"
+#include "commands.h"
+#include "compression.h"
+#include "checksum.h"
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 
-uint64_t Client::generate_cmd_seq() {
-    return uniform_distribution(generator);
+/*
+ * Thread safe replacement of inet_ntoa, used by code running in parallel download and upload streams.
+ */
+static std::string ip_of(const sockaddr_in &addr) {
+
+    char ip[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)) != nullptr ? ip : "";
 }
 
-static bool compare_cmd(const std::string &expected_cmd, const char *cmd) {
+uint64_t Client::generate_cmd_seq() {
 
-    uint16_t i;
-    for (i = 0; i < CMD_MAX_LENGTH && i < expected_cmd.length(); i++) {
-        if (expected_cmd[i] != cmd[i]) {
-            return false;
-        }
-    }
-    while (i < CMD_MAX_LENGTH) {
-        if (cmd[i] != '\0') {
-            return false;
-        }
-        i++;
-    }
-    return true;
+    std::lock_guard<std::mutex> lock(this->generator_mutex);
+    return uniform_distribution(generator);
 }
 
 static bool compare_data(const std::string &expected_data, const char *data, size_t len) {
@@ -48,58 +56,29 @@ static bool compare_data(const std::string &expected_data, const char *data, siz
     return true;
 }
 
-static std::string is_valid_simpl_cmd(simpl_cmd &command, const std::string &cmd, uint64_t cmd_seq, ssize_t len, const std::string &data) {
+static const std::string NO_DATA;
 
-    if (len < EMPTY_SIMPL_CMD_LENGTH) {
-        return "Message too small";
-    } if (cmd_seq != be64toh(command.cmd_seq)) {
-        return "Wrong cmd_seq";
-    } if (!compare_cmd(cmd, command.cmd)) {
-        return "Wrong cmd";
-    } if (!compare_data(data, command.data, len - EMPTY_SIMPL_CMD_LENGTH)) {
-        return "Wrong data";
-    }
-    return "OK";
-}
-
-static std::string is_valid_simpl_cmd(simpl_cmd &command, const std::string &cmd, uint64_t cmd_seq, ssize_t len) {
+/*
+ * Checks a response against the command expected in it, data is compared only if it's given.
+ */
+static std::string is_valid_response(const message_view &command, command_id expected, uint64_t cmd_seq,
+                                     const std::string *data = nullptr) {
 
-    if (len < EMPTY_SIMPL_CMD_LENGTH) {
+    command_layout layout = COMMANDS[(size_t)expected].layout;
+    if (command.length < command_header_length(layout)) {
         return "Message too small";
-    } if (cmd_seq != be64toh(command.cmd_seq)) {
+    } if (cmd_seq != command.cmd_seq()) {
         return "Wrong cmd_seq";
-    } if (!compare_cmd(cmd, command.cmd)) {
+    } if (identify_command(command) != expected) {
         return "Wrong cmd";
-    }
-    return "OK";
-}
-
-static std::string is_valid_cmplx_cmd(cmplx_cmd &command, const std::string &cmd, uint64_t cmd_seq, ssize_t len, const std::string &data) {
-
-    if (len < EMPTY_CMPLX_CMD_LENGTH) {
-        return "Message too small";
-    } if (cmd_seq != be64toh(command.cmd_seq)) {
-        return "Wrong cmd_seq";
-    } if (!compare_cmd(cmd, command.cmd)) {
-        return "Wrong cmd";
-    } if (!compare_data(data, command.data, len - EMPTY_CMPLX_CMD_LENGTH)) {
+    } if (data != nullptr && (layout == command_layout::COMPLEX ?
+            !compare_data(*data, command.cmplx_data(), command.cmplx_data_length()) :
+            !compare_data(*data, command.simpl_data(), command.simpl_data_length()))) {
         return "Wrong data";
     }
     return "OK";
 }
 
-static std::string is_valid_cmplx_cmd(cmplx_cmd &command, const std::string &cmd, uint64_t cmd_seq, ssize_t len) {
-
-    if (len < EMPTY_CMPLX_CMD_LENGTH) {
-        return "Message too small";
-    } if (cmd_seq != be64toh(command.cmd_seq)) {
-        return "Wrong cmd_seq";
-    } if (!compare_cmd(cmd, command.cmd)) {
-        return "Wrong cmd";
-    }
-    return "OK";
-}
-
 void Client::package_skipping(const std::string &ip, uint16_t port, std::string &additional_message) {
     this->output_mutex.lock();
     std::cerr << "[PCKG ERROR]  Skipping invalid package from " << ip << ":" << port << ". "
@@ -108,71 +87,212 @@ void Client::package_skipping(const std::string &ip, uint16_t port, std::string
 }
 
 
-bool Client::send_discover_request(uint64_t *cmd_seq) {
+bool Client::send_discover_request(UDP_socket &socket, uint64_t *cmd_seq) {
 
     (*cmd_seq) = this->generate_cmd_seq();
     struct simpl_cmd command(HELLO_REQUEST, htobe64(*cmd_seq), "");
-    return this->multicast_socket.send_simpl_cmd_by_ip(command, this->options.mcast_addr, htobe16(this->options.cmd_port),0);
+    return socket.send_simpl_cmd_by_ip(command, this->options.mcast_addr, htobe16(this->options.cmd_port),0);
 }
 
-std::multimap<uint64_t, sockaddr_in> Client::receive_discover_responses(uint64_t generated_cmd_seq, bool print) {
+std::multimap<uint64_t, sockaddr_in> Client::receive_discover_responses(UDP_socket &socket, uint64_t generated_cmd_seq,
+                                                                        bool print, bool early_exit) {
 
     std::multimap<uint64_t, sockaddr_in> servers_list;
-    cmplx_cmd_wrapper wrapper;
+    /* Without the cache every round waits for answers for the whole timeout, as no member is known. */
+    bool cached = this->options.membership_ttl > 0;
+    std::set<membership_cache::endpoint> expected;
+    if (cached) {
+        expected = this->membership.known();
+    }
+    std::set<membership_cache::endpoint> answered;
+    Message_buffer_pool::buffer_ptr buffer = this->message_buffers.acquire();
+    message_view command;
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     while (std::chrono::steady_clock::now() - start <= std::chrono::seconds(this->options.timeout)) {
-        if (this->multicast_socket.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
-            && this->multicast_socket.receive_cmplx_cmd(&wrapper)) {
-            cmplx_cmd command = wrapper.command;
-            ssize_t len = wrapper.length;
-            struct sockaddr_in addr = wrapper.address;
+        if (early_exit && !expected.empty() && std::includes(answered.begin(), answered.end(),
+                                                             expected.begin(), expected.end())) {
+            return servers_list;
+        }
+        if (socket.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
+            && socket.receive_message(buffer.get(), &command)) {
+            const sockaddr_in &addr = command.address;
             std::string message;
-            if ((message = is_valid_cmplx_cmd(command, HELLO_RESPONSE, generated_cmd_seq, len)) != "OK") {
+            if ((message = is_valid_response(command, command_id::GOOD_DAY, generated_cmd_seq)) != "OK") {
                 this->package_skipping(inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), message);
                 continue;
             }
-            servers_list.insert({be64toh(command.param), addr});
+            servers_list.insert({command.param(), addr});
+            answered.insert({addr.sin_addr.s_addr, addr.sin_port});
+            if (cached) {
+                this->membership.answered(addr, command.param());
+            }
             if (print) {
                 this->output_mutex.lock();
-                std::cout << "Found " << inet_ntoa(addr.sin_addr) << " (" << command.data
-                          << ") with free space " << be64toh(command.param) << std::endl;
+                std::cout << "Found " << inet_ntoa(addr.sin_addr) << " (" << command.cmplx_data()
+                          << ") with free space " << command.param() << std::endl;
                 this->output_mutex.unlock();
             }
         }
     }
+    if (cached) {
+        this->membership.keep_only(answered);
+    }
     return servers_list;
 }
 
 void Client::discover() {
 
     uint64_t cmd_seq;
-    if (this->send_discover_request(&cmd_seq)) {
-        this->receive_discover_responses(cmd_seq, true);
+    if (this->send_discover_request(this->multicast_socket, &cmd_seq)) {
+        this->receive_discover_responses(this->multicast_socket, cmd_seq, true, false);
+    }
+}
+
+std::multimap<uint64_t, sockaddr_in> Client::discover_servers(bool early_exit) {
+
+    UDP_socket socket;
+    uint64_t cmd_seq;
+    if (!socket.init_multicast_socket() || !this->send_discover_request(socket, &cmd_seq)) {
+        return {};
+    }
+    return this->receive_discover_responses(socket, cmd_seq, false, early_exit);
+}
+
+void Client::keep_membership_fresh() {
+
+    std::chrono::seconds interval = std::max(std::chrono::seconds(1), this->membership.ttl / 3);
+    for (;;) {
+        if (this->membership.begin_refresh()) {
+            this->discover_servers(false);
+            this->membership.refresh_finished();
+        }
+        std::this_thread::sleep_for(interval);
+    }
+}
+
+std::multimap<uint64_t, sockaddr_in> Client::upload_candidates() {
+
+    if (this->options.membership_ttl == 0) {
+        return this->discover_servers(false);
+    }
+    bool refresh = false;
+    std::multimap<uint64_t, sockaddr_in> servers_list = this->membership.usable_servers(&refresh);
+    if (refresh) {
+        servers_list = this->discover_servers(true);
+        this->membership.refresh_finished();
+    }
+    return servers_list;
+}
+
+
+std::set<membership_cache::endpoint> membership_cache::known() {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::set<endpoint> endpoints;
+    for (const auto &entry : this->members) {
+        endpoints.insert(entry.first);
+    }
+    return endpoints;
+}
+
+void membership_cache::answered(sockaddr_in addr, uint64_t free_space) {
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->members[{addr.sin_addr.s_addr, addr.sin_port}] = {addr, free_space, std::chrono::steady_clock::now()};
+    }
+    this->changed.notify_all();
+}
+
+void membership_cache::keep_only(const std::set<endpoint> &answered) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto it = this->members.begin(); it != this->members.end();) {
+        it = answered.count(it->first) > 0 ? std::next(it) : this->members.erase(it);
+    }
+}
+
+std::multimap<uint64_t, sockaddr_in> membership_cache::usable_servers(bool *refresh) {
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    bool waited = false;
+    bool any_known = !this->members.empty();
+    for (;;) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::multimap<uint64_t, sockaddr_in> servers_list;
+        for (const auto &entry : this->members) {
+            if (now - entry.second.seen < this->ttl) {
+                servers_list.insert({entry.second.free_space, entry.second.addr});
+            }
+        }
+        /* Waiting for a round ends once every known member has answered it, without any it's the whole round. */
+        bool complete = any_known && servers_list.size() == this->members.size();
+        if (waited ? (complete || !this->refreshing) : !servers_list.empty()) {
+            return servers_list;
+        }
+        if (!this->refreshing) {
+            this->refreshing = true;
+            (*refresh) = true;
+            return {};
+        }
+        this->changed.wait(lock);
+        waited = true;
+    }
+}
+
+bool membership_cache::begin_refresh() {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->refreshing) {
+        return false;
+    }
+    this->refreshing = true;
+    return true;
+}
+
+void membership_cache::refresh_finished() {
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->refreshing = false;
+    }
+    this->changed.notify_all();
+}
+
+void membership_cache::consume(sockaddr_in addr, uint64_t bytes) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->members.find({addr.sin_addr.s_addr, addr.sin_port});
+    if (it != this->members.end()) {
+        it->second.free_space -= std::min(bytes, it->second.free_space);
     }
 }
 
 
 void Client::receive_search_responses(uint64_t generated_cmd_seq) {
 
-    simpl_cmd_wrapper wrapper;
+    Message_buffer_pool::buffer_ptr buffer = this->message_buffers.acquire();
+    message_view command;
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     while (std::chrono::steady_clock::now() - start <= std::chrono::seconds(this->options.timeout)) {
         if (this->multicast_socket.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
-            && this->multicast_socket.receive_simpl_cmd(&wrapper)) {
-            simpl_cmd command = wrapper.command;
-            ssize_t len = wrapper.length;
-            struct sockaddr_in addr = wrapper.address;
+            && this->multicast_socket.receive_message(buffer.get(), &command)) {
+            const sockaddr_in &addr = command.address;
             std::string message;
-            if ((message = is_valid_simpl_cmd(command, LIST_RESPONSE, generated_cmd_seq, len)) != "OK") {
+            if ((message = is_valid_response(command, command_id::MY_LIST, generated_cmd_seq)) != "OK") {
                 this->package_skipping(inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), message);
                 continue;
             }
             std::vector<std::string> new_files;
-            boost::split(new_files, command.data, boost::is_any_of("\n"));
+            boost::split(new_files, command.simpl_data(), boost::is_any_of("\n"));
             this->output_mutex.lock();
             for (auto &file : new_files) {
                 std::cout << file << " (" << inet_ntoa(addr.sin_addr) << ")" << std::endl;
-                this->files_list.insert({file, addr});
+                std::vector<sockaddr_in> &servers = this->files_list[file];
+                if (std::none_of(servers.begin(), servers.end(), [&addr](const sockaddr_in &server) {
+                        return server.sin_addr.s_addr == addr.sin_addr.s_addr && server.sin_port == addr.sin_port; })) {
+                    servers.push_back(addr);
+                }
             }
             this->output_mutex.unlock();
         }
@@ -209,11 +329,38 @@ void Client::print_fetch_success(const std::string &file, const std::string &ip,
     this->output_mutex.unlock();
 }
 
-bool Client::send_fetch_request(struct UDP_socket &socket, const std::string &file, sockaddr_in addr, uint64_t *cmd_seq) {
+uint64_t Client::requested_flags() {
+    return (this->options.compression ? TRANSFER_FLAG_COMPRESSION : 0) |
+           (this->options.checksum ? TRANSFER_FLAG_CHECKSUM | TRANSFER_FLAG_FILE_CHECKSUM : 0) |
+           TRANSFER_FLAG_SHARED_PORT |
+           (this->options.inline_transfers ? TRANSFER_FLAG_INLINE : 0);
+}
+
+static bool write_all(int32_t fd, const char *data, size_t len) {
+
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool Client::send_fetch_request(struct UDP_socket &socket, const std::string &file, uint64_t offset, uint64_t length,
+                                sockaddr_in addr, uint64_t *cmd_seq) {
 
     (*cmd_seq) = this->generate_cmd_seq();
-    struct simpl_cmd command(GET_REQUEST, htobe64(*cmd_seq), file.c_str());
-    if (socket.init_standard_socket() && socket.send_simpl_cmd_by_ip(command, inet_ntoa(addr.sin_addr), htobe16(this->options.cmd_port), file.length())) {
+    struct cmplx_cmd command(GET_RANGE_REQUEST, htobe64(*cmd_seq), htobe64(offset), file.c_str());
+    uint64_t trailer[2] = {htobe64(length), htobe64(this->requested_flags())};
+    memcpy(command.data + file.length() + 1, trailer, sizeof(trailer));
+    if (socket.init_standard_socket() && socket.send_cmplx_cmd_by_ip(command, ip_of(addr), htobe16(this->options.cmd_port),
+                                                                     file.length() + 1 + sizeof(trailer))) {
         return true;
     }
     this->output_mutex.lock();
@@ -222,55 +369,234 @@ bool Client::send_fetch_request(struct UDP_socket &socket, const std::string &fi
     return false;
 }
 
-in_port_t Client::receive_fetch_response(struct UDP_socket &socket, const std::string &file, uint64_t cmd_seq, sockaddr_in addr) {
+bool Client::receive_fetch_response(struct UDP_socket &socket, const std::string &file, uint64_t cmd_seq,
+                                    sockaddr_in addr, in_port_t *port, uint64_t *file_size, uint64_t *file_checksum,
+                                    uint64_t *flags, uint64_t *token, std::string *contents) {
 
-    struct cmplx_cmd_wrapper wrapper;
+    Message_buffer_pool::buffer_ptr buffer = this->message_buffers.acquire();
+    message_view command;
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     while (std::chrono::steady_clock::now() - start <= std::chrono::seconds(this->options.timeout)) {
         if (socket.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
-            && socket.receive_cmplx_cmd(&wrapper)) {
-            struct cmplx_cmd command = wrapper.command;
-            ssize_t len = wrapper.length;
+            && socket.receive_message(buffer.get(), &command)) {
+            ssize_t len = command.length;
             std::string message;
-            if ((message = is_valid_cmplx_cmd(command, GET_RESPONSE, cmd_seq, len, file)) != "OK") {
-                this->package_skipping(inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), message);
+            if ((message = is_valid_response(command, command_id::CONNECT_ME, cmd_seq)) != "OK") {
+                this->package_skipping(ip_of(addr), ntohs(addr.sin_port), message);
+                continue;
+            }
+            (*flags) = command.param() >> TRANSFER_FLAGS_SHIFT;
+            size_t file_checksum_length = (*flags & TRANSFER_FLAG_FILE_CHECKSUM) ? sizeof(*file_checksum) : 0;
+            size_t header_length = EMPTY_CMPLX_CMD_LENGTH + file.length() + 1 + sizeof(*file_size) +
+                                   file_checksum_length;
+            size_t token_length = (*flags & TRANSFER_FLAG_SHARED_PORT) ? sizeof(*token) : 0;
+            size_t checksum_length = (*flags & TRANSFER_FLAG_CHECKSUM) ? CHECKSUM_LENGTH : 0;
+            bool inline_data = *flags & TRANSFER_FLAG_INLINE;
+            if ((inline_data ? len < (ssize_t)(header_length + checksum_length)
+                             : len != (ssize_t)(header_length + token_length)) ||
+                !compare_data(file, command.cmplx_data(), strnlen(command.cmplx_data(), file.length() + 1))) {
+                message = "Wrong data";
+                this->package_skipping(ip_of(addr), ntohs(addr.sin_port), message);
                 continue;
             }
-            return be64toh(command.param);
+            memcpy(file_size, command.cmplx_data() + file.length() + 1, sizeof(*file_size));
+            (*file_size) = be64toh(*file_size);
+            const char *after_size = command.cmplx_data() + file.length() + 1 + sizeof(*file_size);
+            (*file_checksum) = NO_CHECKSUM;
+            if (file_checksum_length > 0) {
+                memcpy(file_checksum, after_size, sizeof(*file_checksum));
+                (*file_checksum) = be64toh(*file_checksum);
+            }
+            (*token) = 0;
+            if (token_length > 0 && !inline_data) {
+                memcpy(token, after_size + file_checksum_length, sizeof(*token));
+                (*token) = be64toh(*token);
+            }
+            (*port) = command.param() & TRANSFER_PORT_MASK;
+            contents->clear();
+            if (inline_data) {
+                const char *data = after_size + file_checksum_length;
+                size_t data_length = len - header_length - checksum_length;
+                Crc32c crc;
+                crc.update(data, data_length);
+                if (checksum_length == 0 || get_checksum(data + data_length) == crc.value()) {
+                    contents->assign(data, data_length);
+                }
+            }
+            return true;
         }
     }
     this->output_mutex.lock();
     std::cout << "File " << file << " downloading failed (:) Timeout" << std::endl;
     this->output_mutex.unlock();
-    return 0;
+    return false;
 }
 
-void Client::download_file(const std::string &file, in_port_t port, sockaddr_in addr) {
+int32_t Client::connect_for_transfer(sockaddr_in addr, in_port_t port, uint64_t token, bool reuse, bool *reused) {
 
-    struct TCP_socket socket;
-    if (!socket.init_socket()) {
-        this->print_fetch_failure(file, inet_ntoa(addr.sin_addr), port, "Error creating TCP socket");
-        return;
+    int32_t connection = (token != 0 && reuse) ? this->connections.take(addr, port) : -1;
+    (*reused) = connection >= 0;
+    if (connection < 0) {
+        struct TCP_socket socket;
+        if (!socket.init_socket() || !socket.connect_to_socket(ip_of(addr), htobe16(port))) {
+            return -1;
+        }
+        connection = socket.release();
     }
-    if (!socket.connect_to_socket(inet_ntoa(addr.sin_addr), htobe16(port))) {
-        this->print_fetch_failure(file, inet_ntoa(addr.sin_addr), port, "Error connecting to TCP socket");
+    if (token == 0) {
+        return connection;
     }
-    fs::ofstream file_stream(this->options.out_fldr + file, std::ofstream::binary);
-    if (file_stream.is_open()) {
-        char buffer[BUFFER_SIZE];
-        ssize_t len;
-        while ((len = read(socket.socket_number, buffer, sizeof(buffer))) > 0) {
-            file_stream.write(buffer, len);
+    /* The token and the first request of a transfer are small writes that shouldn't wait for acknowledgements. */
+    int one = 1;
+    uint64_t token_be = htobe64(token);
+    if (setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ||
+        !write_all(connection, (const char*)&token_be, sizeof(token_be))) {
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+/*
+ * Receives a range into file_fd like Client::download_range, *complete is set if the whole range and its checksum
+ * were received and nothing of the stream is left on the connection.
+ */
+static uint64_t receive_range(int32_t connection, int32_t file_fd, uint64_t offset, uint64_t length, uint64_t flags,
+                              bool *complete) {
+
+    (*complete) = false;
+    char buffer[BUFFER_SIZE];
+    uint64_t written = 0;
+    ssize_t len;
+    bool checksum = flags & TRANSFER_FLAG_CHECKSUM;
+    Crc32c crc;
+    if (flags & TRANSFER_FLAG_COMPRESSION) {
+        Frame_decoder decoder;
+        auto output = [file_fd, offset, length, checksum, &written, &crc](const char *data, size_t data_len) {
+            if (data_len > length - written || pwrite(file_fd, data, data_len, offset + written) != (ssize_t)data_len) {
+                return false;
+            }
+            if (checksum) {
+                crc.update(data, data_len);
+            }
+            written += data_len;
+            return true;
+        };
+        while ((written < length || (checksum && !decoder.has_checksum())) &&
+               (len = read(connection, buffer, sizeof(buffer))) > 0 && decoder.feed(buffer, len, output)) {}
+        if (checksum && written == length && (!decoder.has_checksum() || decoder.checksum() != crc.value())) {
+            return 0;
+        }
+        (*complete) = written == length && decoder.at_frame_boundary();
+        return written;
+    }
+    while (written < length &&
+           (len = read(connection, buffer, std::min<uint64_t>(sizeof(buffer), length - written))) > 0) {
+        if (pwrite(file_fd, buffer, len, offset + written) != len) {
+            break;
         }
-        if (len < 0) {
-            this->print_fetch_failure(file, inet_ntoa(addr.sin_addr), port, "Read error");
+        if (checksum) {
+            crc.update(buffer, len);
+        }
+        written += len;
+    }
+    if (checksum && written == length) {
+        size_t received = 0;
+        while (received < CHECKSUM_LENGTH &&
+               (len = read(connection, buffer + received, CHECKSUM_LENGTH - received)) > 0) {
+            received += len;
+        }
+        if (received < CHECKSUM_LENGTH || get_checksum(buffer) != crc.value()) {
+            return 0;
+        }
+    }
+    (*complete) = written == length;
+    return written;
+}
+
+/*
+ * Returns the CRC32C of the first size bytes of file_fd, or NO_CHECKSUM if they can't be read.
+ */
+static uint64_t checksum_of(int32_t file_fd, uint64_t size) {
+
+    char buffer[BUFFER_SIZE];
+    Crc32c crc;
+    uint64_t position = 0;
+    while (position < size) {
+        ssize_t len = pread(file_fd, buffer, std::min<uint64_t>(sizeof(buffer), size - position), position);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return NO_CHECKSUM;
+        }
+        crc.update(buffer, len);
+        position += len;
+    }
+    return crc.value();
+}
+
+/*
+ * Writes a range received inline at offset in file_fd, returns how many bytes of it were written.
+ */
+static uint64_t write_inline(int32_t file_fd, uint64_t offset, uint64_t length, const std::string &contents) {
+
+    uint64_t len = std::min<uint64_t>(length, contents.size());
+    return (pwrite(file_fd, contents.data(), len, offset) == (ssize_t)len) ? len : 0;
+}
+
+uint64_t Client::download_range(int32_t file_fd, in_port_t port, uint64_t token, sockaddr_in addr, uint64_t offset,
+                                uint64_t length, uint64_t flags, bool keep_unverified) {
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused, complete;
+        int32_t connection = this->connect_for_transfer(addr, port, token, attempt == 0, &reused);
+        if (connection < 0) {
+            return 0;
+        }
+        uint64_t written = receive_range(connection, file_fd, offset, length, flags, &complete);
+        if (complete && token != 0) {
+            this->connections.give_back(addr, port, connection);
+        } else {
+            close(connection);
+        }
+        /* A kept connection may have been closed by the server just before the token reached it. */
+        if (written > 0 || complete || !reused) {
+            return (complete || keep_unverified || !(flags & TRANSFER_FLAG_CHECKSUM)) ? written : 0;
+        }
+    }
+    return 0;
+}
+
+void Client::download_stripes(const std::string &file, sockaddr_in addr, int32_t file_fd, stripe_queue *queue) {
+
+    std::pair<uint64_t, uint64_t> range;
+    while (queue->take(&range)) {
+        struct UDP_socket socket;
+        in_port_t port;
+        uint64_t cmd_seq, file_size, file_checksum, flags, token;
+        std::string contents;
+        if (!this->send_fetch_request(socket, file, range.first, range.second, addr, &cmd_seq)
+            || !this->receive_fetch_response(socket, file, cmd_seq, addr, &port, &file_size, &file_checksum, &flags,
+                                             &token, &contents)) {
+            queue->give_back(range.first, range.second);
+            return;
+        }
+        /* A server holding another version of the file doesn't get to send parts of it. */
+        if (file_checksum != NO_CHECKSUM && queue->file_checksum != NO_CHECKSUM &&
+            file_checksum != queue->file_checksum) {
+            queue->give_back(range.first, range.second);
+            return;
+        }
+        uint64_t written = (flags & TRANSFER_FLAG_INLINE)
+                           ? write_inline(file_fd, range.first, range.second, contents)
+                           : this->download_range(file_fd, port, token, addr, range.first, range.second, flags,
+                                                  queue->file_checksum != NO_CHECKSUM);
+        if (written < range.second) {
+            queue->give_back(range.first + written, range.second - written);
             return;
         }
-    } else {
-        this->print_fetch_failure(file, inet_ntoa(addr.sin_addr), port, "Failed to open file");
-        return;
     }
-    this->print_fetch_success(file, inet_ntoa(addr.sin_addr), port);
 }
 
 void Client::fetch(const std::string &file) {
@@ -281,13 +607,164 @@ void Client::fetch(const std::string &file) {
         this->output_mutex.unlock();
         return;
     }
-    struct UDP_socket socket;
-    in_port_t port;
-    uint64_t cmd_seq;
-    if (this->send_fetch_request(socket, file, this->files_list[file], &cmd_seq)
-        && (port = this->receive_fetch_response(socket, file, cmd_seq, this->files_list[file])) != 0) {
-        this->download_file(file, port, this->files_list[file]);
+    std::vector<sockaddr_in> servers = this->files_list[file];
+    std::string partial_path = this->options.out_fldr + file + PARTIAL_DOWNLOAD_SUFFIX;
+    int32_t file_fd = open(partial_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    struct stat file_stat{};
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
+        this->print_fetch_failure(file, ip_of(servers[0]), 0, "Failed to open file");
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return;
+    }
+    /* With more servers only the first stripe is asked for, the rest is split once the size of the file is known. */
+    uint64_t offset = file_stat.st_size;
+    uint64_t first_length = servers.size() > 1 ? STRIPE_SIZE : UINT64_MAX;
+    in_port_t port = 0;
+    uint64_t file_size = 0, file_checksum = NO_CHECKSUM, flags = 0, token = 0;
+    std::string contents;
+    bool resumable = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct UDP_socket socket;
+        uint64_t cmd_seq;
+        if (!this->send_fetch_request(socket, file, offset, first_length, servers[0], &cmd_seq)
+            || !this->receive_fetch_response(socket, file, cmd_seq, servers[0], &port, &file_size, &file_checksum,
+                                             &flags, &token, &contents)) {
+            close(file_fd);
+            return;
+        }
+        /*
+         * A partial download longer than the file belongs to a file that was replaced. One that can't be checked
+         * against the checksum of the file once it's complete may belong to an older version too, so it isn't kept.
+         */
+        resumable = file_size >= offset &&
+                    (offset == 0 || !(flags & TRANSFER_FLAG_CHECKSUM) || file_checksum != NO_CHECKSUM);
+        if (resumable || ftruncate(file_fd, 0) < 0) {
+            break;
+        }
+        offset = 0;
     }
+    if (!resumable) {
+        close(file_fd);
+        this->print_fetch_failure(file, ip_of(servers[0]), port, "Failed to truncate partial download");
+        return;
+    }
+
+    if (flags & TRANSFER_FLAG_INLINE) {
+        /* Nothing was connected to, messages name the command port the data came from. */
+        port = ntohs(servers[0].sin_port);
+    }
+    stripe_queue queue;
+    queue.file_checksum = file_checksum;
+    uint64_t length = std::min(first_length, file_size - offset);
+    uint64_t written = (flags & TRANSFER_FLAG_INLINE) ? write_inline(file_fd, offset, length, contents)
+                                                      : this->download_range(file_fd, port, token, servers[0], offset,
+                                                                             length, flags,
+                                                                             file_checksum != NO_CHECKSUM);
+    if (written < length) {
+        queue.give_back(offset + written, length - written);
+    }
+    for (uint64_t next = offset + length; next < file_size; next += STRIPE_SIZE) {
+        queue.give_back(next, std::min(STRIPE_SIZE, file_size - next));
+    }
+    if (!queue.ranges.empty()) {
+        std::vector<std::thread> streams;
+        for (const sockaddr_in &server : servers) {
+            streams.emplace_back(&Client::download_stripes, this, file, server, file_fd, &queue);
+        }
+        for (auto &stream : streams) {
+            stream.join();
+        }
+    }
+    uint64_t prefix = queue.downloaded_prefix(file_size);
+    if (prefix < file_size) {
+        /* Only the part without holes can be resumed from, so everything after it is dropped. */
+        if (ftruncate(file_fd, prefix) < 0) {
+            unlink(partial_path.c_str());
+        }
+        close(file_fd);
+        this->print_fetch_failure(file, ip_of(servers[0]), port,
+                                  "Connection closed early or data damaged, FETCH again to resume");
+        return;
+    }
+    /* A file received as one range from its start was already checked against the same checksum. */
+    bool verified = offset == 0 && written == file_size && (flags & TRANSFER_FLAG_CHECKSUM);
+    if (!verified && file_checksum != NO_CHECKSUM && file_checksum != checksum_of(file_fd, file_size)) {
+        close(file_fd);
+        unlink(partial_path.c_str());
+        this->print_fetch_failure(file, ip_of(servers[0]), port, "Downloaded file doesn't match its checksum");
+        return;
+    }
+    close(file_fd);
+    boost::system::error_code error;
+    fs::rename(partial_path, this->options.out_fldr + file, error);
+    if (error) {
+        this->print_fetch_failure(file, ip_of(servers[0]), port, "Failed to rename downloaded file");
+        return;
+    }
+    this->print_fetch_success(file, ip_of(servers[0]), port);
+}
+
+
+bool stripe_queue::take(std::pair<uint64_t, uint64_t> *range) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->ranges.empty()) {
+        return false;
+    }
+    (*range) = this->ranges.front();
+    this->ranges.pop_front();
+    return true;
+}
+
+void stripe_queue::give_back(uint64_t offset, uint64_t length) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ranges.emplace_back(offset, length);
+}
+
+uint64_t stripe_queue::downloaded_prefix(uint64_t file_size) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    uint64_t prefix = file_size;
+    for (const auto &range : this->ranges) {
+        prefix = std::min(prefix, range.first);
+    }
+    return prefix;
+}
+
+
+connection_pool::~connection_pool() {
+
+    for (auto &entry : this->connections) {
+        close(entry.second.first);
+    }
+}
+
+int32_t connection_pool::take(sockaddr_in addr, in_port_t port) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto range = this->connections.equal_range({addr.sin_addr.s_addr, port});
+    for (auto it = range.first; it != range.second;) {
+        int32_t fd = it->second.first;
+        bool expired = std::chrono::steady_clock::now() - it->second.second > POOLED_CONNECTION_LIFETIME;
+        it = this->connections.erase(it);
+        /* An idle connection has nothing to read, so anything else means the server closed it. */
+        char byte;
+        if (!expired && recv(fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+void connection_pool::give_back(sockaddr_in addr, in_port_t port, int32_t fd) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->connections.insert({{addr.sin_addr.s_addr, port}, {fd, std::chrono::steady_clock::now()}});
 }
 
 
@@ -303,97 +780,187 @@ void Client::print_upload_success(const std::string &file, const std::string &ip
     this->output_mutex.unlock();
 }
 
-bool Client::send_upload_request(UDP_socket &sock, uint64_t file_size, std::string &file, sockaddr_in &addr, uint64_t *cmd_seq) {
+bool Client::send_upload_request(UDP_socket &sock, uint64_t file_size, std::string &file, sockaddr_in &addr, uint64_t *cmd_seq,
+                                 const std::string *contents) {
 
     (*cmd_seq) = this->generate_cmd_seq();
     cmplx_cmd command(ADD_REQUEST, htobe64(*cmd_seq), htobe64(file_size), file.c_str());
-    return sock.send_cmplx_cmd_by_ip(command, inet_ntoa(addr.sin_addr), htobe16(this->options.cmd_port), file.length());
+    uint64_t requested = this->requested_flags() & ~TRANSFER_FLAG_FILE_CHECKSUM;
+    if (contents == nullptr) {
+        requested &= ~TRANSFER_FLAG_INLINE;
+    }
+    uint64_t flags = htobe64(requested);
+    memcpy(command.data + file.length() + 1, &flags, sizeof(flags));
+    size_t data_len = file.length() + 1 + sizeof(flags);
+    if (contents != nullptr) {
+        memcpy(command.data + data_len, contents->data(), contents->size());
+        data_len += contents->size();
+        if (requested & TRANSFER_FLAG_CHECKSUM) {
+            Crc32c crc;
+            crc.update(contents->data(), contents->size());
+            put_checksum(command.data + data_len, crc.value());
+            data_len += CHECKSUM_LENGTH;
+        }
+    }
+    return sock.send_cmplx_cmd_by_ip(command, ip_of(addr), htobe16(this->options.cmd_port), data_len);
 }
 
-static bool is_accept_response(const char *cmd) {
-
-    for (int i = 0; i < CMD_MAX_LENGTH; i++) {
-        if (cmd[i] != ADD_ACCEPTED_RESPONSE[i]) {
-            return false;
+enum class upload_answer {
+    ACCEPTED,
+    DENIED,
+    INVALID
+};
+
+/*
+ * Reads a response to the ADD request of filename with cmd_seq. ACCEPTED comes with the port, transfer flags and
+ * token filled, INVALID with the message telling what is wrong with the response.
+ */
+static upload_answer read_upload_response(const message_view &command, uint64_t cmd_seq, const std::string &filename,
+                                          in_port_t *port, uint64_t *flags, uint64_t *token, std::string *message) {
+
+    if (identify_command(command) == command_id::CAN_ADD) {
+        (*flags) = command.param() >> TRANSFER_FLAGS_SHIFT;
+        (*token) = 0;
+        if (*flags & TRANSFER_FLAG_SHARED_PORT) {
+            /* The token follows an empty file name. */
+            if (((*message) = is_valid_response(command, command_id::CAN_ADD, cmd_seq)) != "OK" ||
+                command.length != EMPTY_CMPLX_CMD_LENGTH + 1 + sizeof(*token) || command.cmplx_data()[0] != '\0') {
+                (*message) = ((*message) == "OK") ? "Wrong data" : (*message);
+                return upload_answer::INVALID;
+            }
+            memcpy(token, command.cmplx_data() + 1, sizeof(*token));
+            (*token) = be64toh(*token);
+        } else if (((*message) = is_valid_response(command, command_id::CAN_ADD, cmd_seq, &NO_DATA)) != "OK") {
+            return upload_answer::INVALID;
         }
+        (*port) = command.param() & TRANSFER_PORT_MASK;
+        return upload_answer::ACCEPTED;
     }
-    return true;
+    if (((*message) = is_valid_response(command, command_id::NO_WAY, cmd_seq, &filename)) != "OK") {
+        return upload_answer::INVALID;
+    }
+    return upload_answer::DENIED;
 }
 
-bool Client::receive_upload_response(UDP_socket &sock, in_port_t *port, uint64_t cmd_seq, std::string &filename) {
+bool Client::receive_upload_response(UDP_socket &sock, in_port_t *port, uint64_t *flags, uint64_t *token,
+                                     uint64_t cmd_seq, std::string &filename, std::string *failure) {
 
-    cmplx_cmd_wrapper wrapper;
+    Message_buffer_pool::buffer_ptr buffer = this->message_buffers.acquire();
+    message_view command;
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     while (std::chrono::steady_clock::now() - start <= std::chrono::seconds(this->options.timeout)) {
         if (sock.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
-            && sock.receive_cmplx_cmd(&wrapper)) {
-            struct cmplx_cmd command = wrapper.command;
-            ssize_t len = wrapper.length;
-            struct sockaddr_in addr = wrapper.address;
-            std::string message = "";
-            if (is_accept_response(command.cmd)) {
-                if ((message = is_valid_cmplx_cmd(command, ADD_ACCEPTED_RESPONSE, cmd_seq, len, "")) !=
-                    "OK") {
-                    this->package_skipping(inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), message);
-                    continue;
-                }
-                (*port) = be64toh(command.param);
-                return true;
-            } else {
-                simpl_cmd *simpl_command = (simpl_cmd *) &command;
-                if ((message = is_valid_simpl_cmd(*simpl_command, ADD_DENIED_RESPONSE, cmd_seq, len, filename)) !=
-                    "OK") {
-                    this->package_skipping(inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), message);
-                    continue;
-                }
-                return false;
+            && sock.receive_message(buffer.get(), &command)) {
+            const sockaddr_in &addr = command.address;
+            std::string message;
+            upload_answer answer = read_upload_response(command, cmd_seq, filename, port, flags, token, &message);
+            if (answer == upload_answer::INVALID) {
+                this->package_skipping(ip_of(addr), ntohs(addr.sin_port), message);
+                continue;
             }
+            (*failure) = "Refused by server";
+            return answer == upload_answer::ACCEPTED;
         }
     }
+    (*failure) = "No answer from server";
     return false;
 }
 
-void Client::send_file(fs::path &file, uint64_t file_size, in_port_t port, sockaddr_in addr) {
+std::string Client::write_file(int32_t connection, fs::path &file, uint64_t file_size, uint64_t flags) {
 
-    std::string filename = file.filename().string();
-    ssize_t len;
+    if (flags & TRANSFER_FLAG_COMPRESSION) {
+        int32_t file_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_fd < 0) {
+            return "Error opening file";
+        }
+        bool sent = true;
+        {
+            Compressing_reader reader(file_fd, 0, file_size, flags & TRANSFER_FLAG_CHECKSUM);
+            std::string frame;
+            while (sent && reader.next(&frame)) {
+                sent = write_all(connection, frame.data(), frame.length());
+            }
+            sent = sent && !reader.has_failed();
+        }
+        close(file_fd);
+        return sent ? "" : "Error while writing to socket";
+    }
+    std::ifstream file_stream(file.c_str(), std::ios::binary);
+    if (!file_stream.is_open()) {
+        return "Error opening file";
+    }
+    char buffer[BUFFER_SIZE];
     uint64_t to_upload = file_size;
-    TCP_socket sock;
-    if (!sock.init_socket()) {
-        this->print_upload_failure(filename, inet_ntoa(addr.sin_addr), port, "Error creating TCP socket");
-        return;
+    Crc32c crc;
+    while (file_stream) {
+        file_stream.read(buffer, BUFFER_SIZE);
+        ssize_t len = file_stream.gcount();
+        to_upload -= len;
+        crc.update(buffer, len);
+        if (!write_all(connection, buffer, len)) {
+            return "Error while writing to socket";
+        }
     }
-    if (!sock.connect_to_socket(inet_ntoa(addr.sin_addr), htobe16(port))) {
-        this->print_upload_failure(filename, inet_ntoa(addr.sin_addr), port, "Error connecting to socket");
-        return;
+    if (to_upload != 0) {
+        return "Didn't finish uploading";
     }
-    std::ifstream file_stream(file.c_str(), std::ios::binary);
-    if (file_stream.is_open()) {
-        char buffer[BUFFER_SIZE];
-        while (file_stream) {
-            file_stream.read(buffer, BUFFER_SIZE);
-            len = file_stream.gcount();
-            to_upload -= len;
-            if (write(sock.socket_number, buffer, len) != len) {
-                this->print_upload_failure(filename, inet_ntoa(addr.sin_addr), port, "Error while writing to socket");
-                return;
-            }
+    if (flags & TRANSFER_FLAG_CHECKSUM) {
+        put_checksum(buffer, crc.value());
+        if (!write_all(connection, buffer, CHECKSUM_LENGTH)) {
+            return "Error while writing to socket";
         }
-        if (to_upload != 0) {
-            this->print_upload_failure(filename, inet_ntoa(addr.sin_addr), port, "Didn't finish uploading");
-            return;
+    }
+    return "";
+}
+
+bool Client::send_file(fs::path &file, uint64_t file_size, in_port_t port, uint64_t token, uint64_t flags,
+                       sockaddr_in addr) {
+
+    std::string filename = file.filename().string();
+    std::string error;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        int32_t connection = this->connect_for_transfer(addr, port, token, attempt == 0, &reused);
+        if (connection < 0) {
+            this->print_upload_failure(filename, ip_of(addr), port, "Error connecting to socket");
+            return false;
+        }
+        error = this->write_file(connection, file, file_size, flags);
+        if (error.empty() && token != 0) {
+            this->connections.give_back(addr, port, connection);
+        } else {
+            close(connection);
+        }
+        /* A kept connection may have been closed by the server just before the token reached it. */
+        if (error.empty() || !reused) {
+            break;
         }
-    } else {
-        this->print_upload_failure(filename, inet_ntoa(addr.sin_addr), port, "Error opening file");
-        return;
     }
-    sock.close_socket();
-    this->print_upload_success(filename, inet_ntoa(addr.sin_addr), port);
+    if (!error.empty()) {
+        this->print_upload_failure(filename, ip_of(addr), port, error);
+        return false;
+    }
+    this->print_upload_success(filename, ip_of(addr), port);
+    return true;
+}
+
+/*
+ * Reads a whole file that is small enough to be sent inside the ADD request.
+ */
+static bool read_inline_contents(const fs::path &path, uint64_t file_size, std::string *contents) {
+
+    std::ifstream file_stream(path.c_str(), std::ios::binary);
+    contents->resize(file_size);
+    return file_stream.read(&(*contents)[0], file_size) && file_stream.gcount() == (ssize_t)file_size;
 }
 
 void Client::upload(const std::string &file) {
 
     fs::path filepath = file;
+    if (fs::is_directory(filepath) || filepath.filename().string().find_first_of("*?[") != std::string::npos) {
+        this->upload_many(file);
+        return;
+    }
     if (!fs::exists(filepath) || !fs::is_regular_file(filepath)) {
         this->output_mutex.lock();
         std::cout << "File " << filepath.filename().string() << " does not exist" << std::endl;
@@ -401,11 +968,10 @@ void Client::upload(const std::string &file) {
         return;
     }
     in_port_t port;
-    uint64_t cmd_seq;
+    uint64_t cmd_seq, flags, token;
     uintmax_t file_size = fs::file_size(filepath);
     std::string filename = filepath.filename().string();
-    this->send_discover_request(&cmd_seq);
-    std::multimap<uint64_t, sockaddr_in> servers_list = this->receive_discover_responses(cmd_seq, false);
+    std::multimap<uint64_t, sockaddr_in> servers_list = this->upload_candidates();
     std::multimap<uint64_t, sockaddr_in>::reverse_iterator rit = servers_list.rbegin();
     if (servers_list.begin() == servers_list.end() || rit->first < file_size) {
         this->output_mutex.lock();
@@ -420,14 +986,272 @@ void Client::upload(const std::string &file) {
         this->output_mutex.unlock();
         return;
     }
+    /* Files that fit in the request are sent inside it, servers that don't take them ask for TCP as usual. */
+    std::string contents;
+    bool inline_upload = false;
+    if (this->options.inline_transfers && file_size <= inline_capacity(filename.length())) {
+        inline_upload = read_inline_contents(filepath, file_size, &contents);
+    }
+    std::string failure;
+    sockaddr_in last_tried = rit->second;
     for (; rit != servers_list.rend() && rit->first >= file_size; rit++) {
-        this->send_upload_request(sock, file_size, filename, rit->second, &cmd_seq);
-        if (this->receive_upload_response(sock, &port, cmd_seq, filename)) {
-            this->send_file(filepath, file_size, port, rit->second);
+        last_tried = rit->second;
+        if (!this->send_upload_request(sock, file_size, filename, rit->second, &cmd_seq,
+                                       inline_upload ? &contents : nullptr)) {
+            failure = "Error while sending request";
+            continue;
+        }
+        if (this->receive_upload_response(sock, &port, &flags, &token, cmd_seq, filename, &failure)) {
+            this->membership.consume(rit->second, file_size);
+            if (flags & TRANSFER_FLAG_INLINE) {
+                this->print_upload_success(filename, ip_of(rit->second), ntohs(rit->second.sin_port));
+            } else {
+                this->send_file(filepath, file_size, port, token, flags, rit->second);
+            }
+            return;
+        }
+    }
+    this->print_upload_failure(filename, ip_of(last_tried), ntohs(last_tried.sin_port), failure);
+}
+
+void Client::upload_stream(bulk_upload *upload) {
+
+    UDP_socket sock;
+    if (!sock.init_standard_socket()) {
+        /* The files stay queued for the other streams, upload_many fails those no stream could take. */
+        this->output_mutex.lock();
+        std::cout << "Upload stream failed (:) Error while creating UDP socket" << std::endl;
+        this->output_mutex.unlock();
+        return;
+    }
+    Message_buffer_pool::buffer_ptr buffer = this->message_buffers.acquire();
+    message_view command;
+    for (;;) {
+        /* Files sent inside their requests are negotiated ahead, a file going over TCP is negotiated alone. */
+        std::map<uint64_t, bulk_upload::job> waiting;
+        uint64_t inline_bytes = 0;
+        bulk_upload::job next;
+        while (waiting.size() < UPLOAD_PIPELINE_DEPTH &&
+               upload->take(&next, !waiting.empty(), UPLOAD_PIPELINE_BYTES - std::min(inline_bytes,
+                                                                                      UPLOAD_PIPELINE_BYTES))) {
+            if (!next.reserved) {
+                if (next.failure.empty()) {
+                    this->output_mutex.lock();
+                    std::cout << "File " << next.name << " too big" << std::endl;
+                    this->output_mutex.unlock();
+                } else {
+                    this->print_upload_failure(next.name, ip_of(next.server), ntohs(next.server.sin_port),
+                                               next.failure);
+                }
+                upload->finished(next, false);
+                continue;
+            }
+            std::string contents;
+            if (next.inline_upload && !read_inline_contents(next.path, next.size, &contents)) {
+                this->print_upload_failure(next.name, ip_of(next.server), ntohs(next.server.sin_port),
+                                           "Error opening file");
+                upload->finished(next, false);
+                continue;
+            }
+            uint64_t cmd_seq;
+            if (!this->send_upload_request(sock, next.size, next.name, next.server, &cmd_seq,
+                                           next.inline_upload ? &contents : nullptr)) {
+                upload->retry(std::move(next), "Error while sending request");
+                continue;
+            }
+            bool tcp_upload = !next.inline_upload;
+            inline_bytes += next.inline_upload ? next.size : 0;
+            waiting.emplace(cmd_seq, std::move(next));
+            if (tcp_upload) {
+                break;
+            }
+        }
+        if (waiting.empty()) {
             return;
         }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (!waiting.empty() && std::chrono::steady_clock::now() - start <= std::chrono::seconds(this->options.timeout)) {
+            if (!sock.set_timeout(this->options.timeout * 1e9 - (std::chrono::steady_clock::now() - start).count())
+                || !sock.receive_message(buffer.get(), &command)) {
+                continue;
+            }
+            const sockaddr_in &addr = command.address;
+            std::string message = "Wrong cmd_seq";
+            auto it = command.length < EMPTY_SIMPL_CMD_LENGTH ? waiting.end() : waiting.find(command.cmd_seq());
+            in_port_t port;
+            uint64_t flags, token;
+            upload_answer answer = (it == waiting.end()) ? upload_answer::INVALID :
+                    read_upload_response(command, it->first, it->second.name, &port, &flags, &token, &message);
+            if (answer == upload_answer::INVALID) {
+                this->package_skipping(ip_of(addr), ntohs(addr.sin_port), message);
+                continue;
+            }
+            bulk_upload::job job = std::move(it->second);
+            waiting.erase(it);
+            if (answer == upload_answer::DENIED) {
+                upload->retry(std::move(job), "Refused by server");
+                continue;
+            }
+            this->membership.consume(job.server, job.size);
+            if (flags & TRANSFER_FLAG_INLINE) {
+                this->print_upload_success(job.name, ip_of(job.server), ntohs(job.server.sin_port));
+                upload->finished(job, true);
+                continue;
+            }
+            /* The server waits for the connection only for its timeout, the other answers wait in the socket. */
+            std::chrono::steady_clock::time_point transfer_start = std::chrono::steady_clock::now();
+            bool sent = this->send_file(job.path, job.size, port, token, flags, job.server);
+            upload->finished(job, sent);
+            start += std::chrono::steady_clock::now() - transfer_start;
+        }
+        for (auto &unanswered : waiting) {
+            upload->retry(std::move(unanswered.second), "No answer from server");
+        }
     }
-    std::cout << "File " << filename << " too big" << std::endl;
+}
+
+void Client::upload_many(const std::string &pattern) {
+
+    std::vector<fs::path> paths;
+    boost::system::error_code error;
+    if (fs::is_directory(pattern)) {
+        for (fs::directory_iterator it(pattern, error); !error && it != fs::directory_iterator(); it.increment(error)) {
+            if (fs::is_regular_file(it->path())) {
+                paths.push_back(it->path());
+            }
+        }
+    } else {
+        glob_t matches;
+        if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                if (fs::is_regular_file(matches.gl_pathv[i])) {
+                    paths.emplace_back(matches.gl_pathv[i]);
+                }
+            }
+        }
+        globfree(&matches);
+    }
+    if (paths.empty()) {
+        this->output_mutex.lock();
+        std::cout << "No files to upload in " << pattern << std::endl;
+        this->output_mutex.unlock();
+        return;
+    }
+
+    bulk_upload upload;
+    for (const auto &server : this->upload_candidates()) {
+        upload.servers.emplace_back(server.second, server.first);
+    }
+    std::vector<bulk_upload::job> jobs;
+    for (const fs::path &path : paths) {
+        bulk_upload::job job;
+        job.path = path;
+        job.name = path.filename().string();
+        job.size = fs::file_size(path, error);
+        if (error) {
+            this->output_mutex.lock();
+            std::cout << "File " << job.name << " uploading failed (:) Error reading file size" << std::endl;
+            this->output_mutex.unlock();
+            upload.failed_files++;
+            continue;
+        }
+        job.inline_upload = this->options.inline_transfers && job.size <= inline_capacity(job.name.length());
+        job.reserved = false;
+        jobs.push_back(std::move(job));
+    }
+    /* Placing the largest files first leaves the small ones to fill what is left on servers. */
+    std::sort(jobs.begin(), jobs.end(), [](const bulk_upload::job &a, const bulk_upload::job &b) {
+        return a.size > b.size; });
+    upload.pending.assign(std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> streams;
+    for (size_t i = 0; i < std::max<size_t>(1, this->options.upload_streams) && i < jobs.size(); i++) {
+        streams.emplace_back(&Client::upload_stream, this, &upload);
+    }
+    for (std::thread &stream : streams) {
+        stream.join();
+    }
+    bulk_upload::job left;
+    while (upload.take(&left, false, 0)) {
+        this->output_mutex.lock();
+        std::cout << "File " << left.name << " uploading failed (:) Error while creating UDP socket" << std::endl;
+        this->output_mutex.unlock();
+        upload.finished(left, false);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::ostringstream summary;
+    summary << std::fixed << std::setprecision(2) << "Uploaded " << upload.uploaded_files << " of " << paths.size()
+            << " files (" << upload.uploaded_bytes << " bytes, " << upload.failed_files << " failed) in "
+            << elapsed.count() << " s, "
+            << upload.uploaded_bytes / elapsed.count() / (1024 * 1024) << " MiB/s, "
+            << upload.uploaded_files / elapsed.count() << " files/s";
+    this->output_mutex.lock();
+    std::cout << summary.str() << std::endl;
+    this->output_mutex.unlock();
+}
+
+
+bool bulk_upload::take(job *next, bool only_inline, uint64_t inline_budget) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->pending.empty() ||
+        (only_inline && (!this->pending.front().inline_upload || this->pending.front().size > inline_budget))) {
+        return false;
+    }
+    (*next) = std::move(this->pending.front());
+    this->pending.pop_front();
+    std::pair<sockaddr_in, uint64_t> *best = nullptr;
+    for (auto &server : this->servers) {
+        if (server.second >= next->size && next->tried.count({server.first.sin_addr.s_addr, server.first.sin_port}) == 0
+            && (best == nullptr || server.second > best->second)) {
+            best = &server;
+        }
+    }
+    next->reserved = (best != nullptr);
+    if (next->reserved) {
+        best->second -= next->size;
+        next->server = best->first;
+    }
+    return true;
+}
+
+/*
+ * Returns the space of a file to its server, must be called with the mutex held.
+ */
+static void give_back_space(std::vector<std::pair<sockaddr_in, uint64_t>> &servers, const bulk_upload::job &job) {
+
+    for (auto &server : servers) {
+        if (server.first.sin_addr.s_addr == job.server.sin_addr.s_addr && server.first.sin_port == job.server.sin_port) {
+            server.second += job.size;
+            return;
+        }
+    }
+}
+
+void bulk_upload::retry(job refused, const std::string &failure) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    give_back_space(this->servers, refused);
+    refused.tried.insert({refused.server.sin_addr.s_addr, refused.server.sin_port});
+    refused.reserved = false;
+    refused.failure = failure;
+    this->pending.push_front(std::move(refused));
+}
+
+void bulk_upload::finished(const job &done, bool success) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (success) {
+        this->uploaded_files++;
+        this->uploaded_bytes += done.size;
+        return;
+    }
+    if (done.reserved) {
+        give_back_space(this->servers, done);
+    }
+    this->failed_files++;
 }
 
 
@@ -456,7 +1280,18 @@ void client_options::fill_from_arguments(int argc, const char **argv) {
                     std::cerr << "TIMEOUT option has to be less or equal to 300" << std::endl;
                     exit(1);
                 }
-            }), "Client timeout");
+            }), "Client timeout")
+            ("compression", po::value<bool>(&(this->compression))->default_value(true),
+                    "Ask servers to compress file transfers")
+            ("checksum", po::value<bool>(&(this->checksum))->default_value(true),
+                    "Ask servers to end file transfers with a CRC32C of the data")
+            ("inline", po::value<bool>(&(this->inline_transfers))->default_value(true),
+                    "Send and receive files that fit in a single datagram inside the UDP commands")
+            ("membership-ttl", po::value<uint16_t>(&(this->membership_ttl))->default_value(DEFAULT_MEMBERSHIP_TTL),
+                    "Seconds for which servers found by discovery are used by uploads without asking them again, "
+                    "0 disables the cache")
+            ("upload-streams", po::value<uint16_t>(&(this->upload_streams))->default_value(DEFAULT_UPLOAD_STREAMS),
+                    "Number of files of a directory or glob upload sent at once");
     po::variables_map var_map;
     try {
         po::store(po::parse_command_line(argc, argv, description), var_map);
@@ -538,4 +1373,10 @@ Client::Client(client_options options) : options(options) {
         std::cerr << "Failed to create multicast socket" << std::endl;
         exit(1);
     }
+    /* Writing to a kept connection the server has closed must fail instead of killing the client. */
+    signal(SIGPIPE, SIG_IGN);
+    this->membership.ttl = std::chrono::seconds(this->options.membership_ttl);
+    if (this->options.membership_ttl > 0) {
+        std::thread(&Client::keep_membership_fresh, this).detach();
+    }
 }
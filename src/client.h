@@ -3,15 +3,49 @@
 
 #include <unordered_map>
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
 #include <random>
+#include <chrono>
 #include <netinet/in.h>
 #include <boost/filesystem/path.hpp>
 
 #include "communication.h"
+#include "checksum.h"
 
 constexpr uint16_t CLIENT_DEFAULT_TIMEOUT_VALUE = 5;
 constexpr uint16_t CLIENT_MAX_TIMEOUT_VALUE = 300;
+/*
+ * Files are downloaded under this suffix and renamed once complete, so a later FETCH can resume them.
+ */
+const std::string PARTIAL_DOWNLOAD_SUFFIX = ".part";
+/*
+ * Size of a range fetched by one request when a file is downloaded from several servers at once.
+ */
+constexpr uint64_t STRIPE_SIZE = 4 * 1024 * 1024;
+/*
+ * How long a connection to a server's data port is kept for reuse, well below the server's idle timeout.
+ */
+constexpr std::chrono::seconds POOLED_CONNECTION_LIFETIME(30);
+/*
+ * How long the free space a server reported in its last answer to HELLO is trusted by uploads.
+ */
+constexpr uint16_t DEFAULT_MEMBERSHIP_TTL = 30;
+/*
+ * Number of files of a bulk upload that are sent to servers at once.
+ */
+constexpr uint16_t DEFAULT_UPLOAD_STREAMS = 4;
+/*
+ * Most ADD requests a stream of a bulk upload sends before it waits for their answers, and most bytes of files inside
+ * them, which keeps the streams from overflowing the receive buffer of a server. Only files sent inside the request
+ * are negotiated ahead, a file going over TCP is negotiated alone and sent as soon as it's accepted, before the server
+ * gives up waiting for the connection.
+ */
+constexpr size_t UPLOAD_PIPELINE_DEPTH = 16;
+constexpr uint64_t UPLOAD_PIPELINE_BYTES = 16 * 1024;
 
 struct client_options {
 
@@ -19,6 +53,11 @@ struct client_options {
     in_port_t cmd_port;
     std::string out_fldr;
     uint16_t timeout;
+    bool compression;
+    bool checksum;
+    bool inline_transfers;
+    uint16_t membership_ttl;
+    uint16_t upload_streams;
 
     /*
      * Fills fields in structure according to values passed as parameters.
@@ -26,15 +65,160 @@ struct client_options {
     void fill_from_arguments(int argc, const char* argv[]);
 };
 
+/*
+ * Ranges of a file that still have to be downloaded, shared by all streams of one download.
+ * A stream takes the next range when it finishes the previous one, so faster servers end up sending more.
+ */
+struct stripe_queue {
+
+    std::mutex mutex;
+    std::deque<std::pair<uint64_t, uint64_t>> ranges;
+    /*
+     * CRC32C of the whole file from the first server, or NO_CHECKSUM. Without it only ranges that matched their own
+     * checksum are kept, as nothing would catch a broken one later.
+     */
+    uint64_t file_checksum = NO_CHECKSUM;
+
+    bool take(std::pair<uint64_t, uint64_t> *range);
+    void give_back(uint64_t offset, uint64_t length);
+    /*
+     * Returns the offset up to which the whole file has been downloaded, assuming no stream is running anymore.
+     */
+    uint64_t downloaded_prefix(uint64_t file_size);
+};
+
+/*
+ * Connections to servers' data ports left open after complete transfers, so the next transfer to the same server
+ * skips the TCP handshake.
+ */
+struct connection_pool {
+
+    typedef std::pair<in_addr_t, in_port_t> endpoint;
+
+    std::mutex mutex;
+    std::multimap<endpoint, std::pair<int32_t, std::chrono::steady_clock::time_point>> connections;
+
+    connection_pool() = default;
+    ~connection_pool();
+
+    connection_pool(const connection_pool &) = delete;
+    connection_pool &operator=(const connection_pool &) = delete;
+
+    /*
+     * Returns an open connection to port of the server, or -1 if there is none. Connections that are too old or
+     * that the server has closed are dropped on the way.
+     */
+    int32_t take(sockaddr_in addr, in_port_t port);
+    void give_back(sockaddr_in addr, in_port_t port, int32_t fd);
+};
+
+/*
+ * Servers that answered HELLO with the free space they reported, so uploads don't have to wait for a discovery
+ * round. Only members that answered within the TTL are used, members that miss a whole round are dropped.
+ * At most one round started for the cache runs at a time, uploads that find no usable member wait for it.
+ */
+struct membership_cache {
+
+    typedef std::pair<in_addr_t, in_port_t> endpoint;
+
+    struct member {
+        sockaddr_in addr;
+        uint64_t free_space;
+        std::chrono::steady_clock::time_point seen;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<endpoint, member> members;
+    std::chrono::seconds ttl{DEFAULT_MEMBERSHIP_TTL};
+    bool refreshing = false;
+
+    std::set<endpoint> known();
+    void answered(sockaddr_in addr, uint64_t free_space);
+    /*
+     * Drops members that didn't answer a round which lasted the whole timeout.
+     */
+    void keep_only(const std::set<endpoint> &answered);
+    /*
+     * Returns members that answered within the TTL by their free space. If there are none and no round is running,
+     * sets *refresh and the caller has to run one and call refresh_finished. A running round is waited for until
+     * every known member answers it.
+     */
+    std::multimap<uint64_t, sockaddr_in> usable_servers(bool *refresh);
+    /*
+     * Returns true if no round is running, the caller then has to run one and call refresh_finished.
+     */
+    bool begin_refresh();
+    void refresh_finished();
+    /*
+     * Takes bytes of an accepted upload off the member's free space until it answers again.
+     */
+    void consume(sockaddr_in addr, uint64_t bytes);
+};
+
+/*
+ * Files of a bulk upload still to be sent and the free space of servers left after the files reserved on them,
+ * so the streams never send a server more than it said it could take.
+ */
+struct bulk_upload {
+
+    struct job {
+        boost::filesystem::path path;
+        std::string name;
+        uint64_t size;
+        bool inline_upload;
+        /*
+         * Server the file's space is reserved on if reserved is set, and servers that refused it or didn't answer.
+         * After a failed attempt server is the last one tried and failure tells what went wrong.
+         */
+        bool reserved;
+        sockaddr_in server;
+        std::set<membership_cache::endpoint> tried;
+        std::string failure;
+    };
+
+    std::mutex mutex;
+    std::deque<job> pending;
+    std::vector<std::pair<sockaddr_in, uint64_t>> servers;
+    uint64_t uploaded_files = 0;
+    uint64_t uploaded_bytes = 0;
+    uint64_t failed_files = 0;
+
+    /*
+     * Takes the next file and reserves its space on the server with the most space left that the file wasn't tried
+     * on, reserved isn't set if no such server has room for it. Returns false if there are no files left. With
+     * only_inline it also returns false if the next file goes over TCP or is bigger than inline_budget.
+     */
+    bool take(job *next, bool only_inline, uint64_t inline_budget);
+    /*
+     * Gives back the space of a file its server refused or didn't answer for and queues it for the next server.
+     */
+    void retry(job refused, const std::string &failure);
+    /*
+     * Counts a file as done, the space of a failed one is given back.
+     */
+    void finished(const job &done, bool success);
+};
+
 class Client {
 
 private:
 
     client_options options;
-    std::unordered_map<std::string, sockaddr_in> files_list;
+    std::unordered_map<std::string, std::vector<sockaddr_in>> files_list;
     UDP_socket multicast_socket;
     std::mutex output_mutex;
+    connection_pool connections;
+    membership_cache membership;
+    /*
+     * Receive buffers of the threads waiting for replies, reused instead of a fresh 64 KiB per reply.
+     */
+    Message_buffer_pool message_buffers;
 
+    /*
+     * Shared by all threads sending requests, guarded by generator_mutex.
+     */
+    std::mutex generator_mutex;
     std::mt19937_64 generator;
     std::uniform_int_distribution<uint64_t> uniform_distribution;
 
@@ -50,12 +234,29 @@ private:
     /*
      * Sends HELLO requests to all servers.
      */
-    bool send_discover_request(uint64_t *cmd_seq);
+    bool send_discover_request(UDP_socket &socket, uint64_t *cmd_seq);
+    /*
+     * Receives responses to the HELLO request from server and returns their info, recording them in the membership
+     * cache. If print is set to true it also prints the data of servers. With early_exit it returns as soon as every
+     * member known before the round has answered.
+     */
+    std::multimap<uint64_t, sockaddr_in> receive_discover_responses(UDP_socket &socket, uint64_t generated_cmd_seq,
+                                                                    bool print, bool early_exit);
     /*
-     * Receives responses to the HELLO request from server and returns their info.
-     * If print is set to true it also prints the data of servers.
+     * Sends HELLO and receives the responses on a socket of its own.
      */
-    std::multimap<uint64_t, sockaddr_in> receive_discover_responses(uint64_t generated_cmd_seq, bool print);
+    std::multimap<uint64_t, sockaddr_in> discover_servers(bool early_exit);
+    /*
+     * Runs a whole discovery round for the membership cache every third of the TTL, so new servers are found and
+     * uploads rarely find the cache expired.
+     */
+    void keep_membership_fresh();
+    /*
+     * Returns servers to upload to, from the membership cache if it's fresh, otherwise from a discovery round that
+     * ends once every known member has answered. With membership_ttl 0 there is no cache and the round lasts the
+     * whole timeout.
+     */
+    std::multimap<uint64_t, sockaddr_in> upload_candidates();
     /*
      * Sends HELLO request to all servers and prints data received from them.
      */
@@ -83,20 +284,46 @@ private:
      */
     void print_fetch_success(const std::string &file, const std::string &ip, in_port_t port);
     /*
-     * Sends a GET request to the server that currently stores requested file.
+     * Returns transfer flags to ask servers for.
+     */
+    uint64_t requested_flags();
+    /*
+     * Sends a GET_RANGE request for length bytes of the file from offset to a server storing it.
+     */
+    bool send_fetch_request(struct UDP_socket &socket, const std::string &file, uint64_t offset, uint64_t length,
+                            sockaddr_in addr, uint64_t *cmd_seq);
+    /*
+     * Receives a response to a GET_RANGE request from a server, stores the port to connect to in *port, the size of
+     * the whole file in *file_size and its checksum in *file_checksum (NO_CHECKSUM if there is none), transfer flags
+     * the server agreed to in *flags and the token of the transfer in *token (0 if there is none).
+     * With TRANSFER_FLAG_INLINE the range is stored in *contents instead, which is left empty if it doesn't match
+     * its checksum.
      */
-    bool send_fetch_request(struct UDP_socket &socket, const std::string &file, sockaddr_in addr, uint64_t *cmd_seq);
+    bool receive_fetch_response(struct UDP_socket &socket, const std::string &file, uint64_t cmd_seq,
+                                sockaddr_in addr, in_port_t *port, uint64_t *file_size, uint64_t *file_checksum,
+                                uint64_t *flags, uint64_t *token, std::string *contents);
     /*
-     * Receives a response to a GET request from a server.
+     * Returns a connection to port of the server for one transfer, or -1 on failure. A nonzero token is sent first,
+     * on a pooled connection if there is one and reuse is true. *reused tells which one it was.
      */
-    in_port_t receive_fetch_response(struct UDP_socket &socket, const std::string &file, uint64_t cmd_seq, sockaddr_in addr);
+    int32_t connect_for_transfer(sockaddr_in addr, in_port_t port, uint64_t token, bool reuse, bool *reused);
     /*
-     * Downloads specified file from server using TCP socket.
+     * Receives a range of the file from server using TCP socket and writes it at its offset in file_fd.
+     * Returns how many bytes were written, which is less than length if the transfer broke. A whole range that
+     * doesn't match its checksum counts as not written at all, and so does a broken one with a checksum unless
+     * keep_unverified is set. A connection of a complete transfer with a token is kept for the next one.
      */
-    void download_file(const std::string &file, in_port_t port, sockaddr_in addr);
+    uint64_t download_range(int32_t file_fd, in_port_t port, uint64_t token, sockaddr_in addr, uint64_t offset,
+                            uint64_t length, uint64_t flags, bool keep_unverified);
     /*
-     * Sends GET request to a server storing specified file.
-     * After getting confirmation that the server has requested file downloads the file from server.
+     * Downloads ranges from the queue using one server until the queue is empty or the server fails.
+     * A range that wasn't received completely is put back into the queue for other servers.
+     */
+    void download_stripes(const std::string &file, sockaddr_in addr, int32_t file_fd, stripe_queue *queue);
+    /*
+     * Downloads specified file from all servers that have it, continuing a previous download if there is one.
+     * The first request also tells the size of the file, the rest of it is split into ranges fetched in parallel.
+     * The file is downloaded under PARTIAL_DOWNLOAD_SUFFIX and renamed once complete.
      */
     void fetch(const std::string &file);
 
@@ -109,22 +336,44 @@ private:
      */
     void print_upload_success(const std::string &file, const std::string &ip, in_port_t port);
     /*
-     * Sends ADD request to a specified server.
+     * Sends ADD request to a specified server, with the file's contents inside it if contents isn't nullptr.
+     */
+    bool send_upload_request(UDP_socket &sock, uint64_t file_size, std::string &file, sockaddr_in &addr, uint64_t *cmd_seq,
+                             const std::string *contents);
+    /*
+     * Receives a response to an ADD request from a server, stores transfer flags the server agreed to in *flags
+     * and the token of the transfer in *token (0 if there is none). If the server refused the file or didn't answer,
+     * *failure tells which.
      */
-    bool send_upload_request(UDP_socket &sock, uint64_t file_size, std::string &file, sockaddr_in &addr, uint64_t *cmd_seq);
+    bool receive_upload_response(UDP_socket &sock, in_port_t *port, uint64_t *flags, uint64_t *token,
+                                 uint64_t cmd_seq, std::string &filename, std::string *failure);
     /*
-     * Receives a response to an ADD request from a server.
+     * Writes specified file to a connection. With compression the file is encoded into frames on a separate thread
+     * while this one writes them to the socket. The checksum is computed in the same pass.
+     * Returns an error message, empty on success.
      */
-    bool receive_upload_response(UDP_socket &sock, in_port_t *port, uint64_t cmd_seq, std::string &filename);
+    std::string write_file(int32_t connection, boost::filesystem::path &file, uint64_t file_size, uint64_t flags);
     /*
-     * Sends specified file to server using a TCP socket.
+     * Sends specified file to server using a TCP socket, returns true on success.
      */
-    void send_file(boost::filesystem::path &file, uint64_t file_size, in_port_t port, sockaddr_in addr);
+    bool send_file(boost::filesystem::path &file, uint64_t file_size, in_port_t port, uint64_t token, uint64_t flags,
+                   sockaddr_in addr);
     /*
      * Sends ADD request to server with most free space, if the request is denied continues with other servers.
-     * After getting accepted send the file to server.
+     * After getting accepted send the file to server. A directory or a glob pattern is uploaded with upload_many.
      */
     void upload(const std::string &file);
+    /*
+     * Uploads files of a bulk upload until there are none left. ADD requests of up to UPLOAD_PIPELINE_DEPTH files
+     * sent inside them go out before waiting for their answers, a file refused by its server is queued for the next
+     * one.
+     */
+    void upload_stream(bulk_upload *upload);
+    /*
+     * Uploads all regular files in a directory or matching a glob pattern over upload_streams streams, after a
+     * single discovery. Prints the throughput once all files are done.
+     */
+    void upload_many(const std::string &pattern);
 
     /*
      * Sends requests to all servers to remove specified file.
@@ -0,0 +1,197 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "communication.h"
+
+/*
+ * Registry of the protocol's commands shared by the client and the server, with the rules every received command
+ * is checked against. The 10 byte cmd field is read as a 64 bit and a 16 bit word, so telling which command it is
+ * takes a hash of those words, one table lookup and two compares, and all keys and the table are computed from the
+ * command names at compile time.
+ */
+enum class command_id : uint8_t {
+    HELLO,
+    GOOD_DAY,
+    LIST,
+    MY_LIST,
+    GET,
+    GET_RANGE,
+    CONNECT_ME,
+    DEL,
+    ADD,
+    NO_WAY,
+    CAN_ADD,
+    STATS,
+    MY_STATS,
+    UNKNOWN
+};
+
+constexpr size_t COMMAND_COUNT = (size_t)command_id::UNKNOWN;
+
+/*
+ * SIMPLE commands have data right after cmd_seq, COMPLEX ones after param.
+ */
+enum class command_layout : uint8_t {
+    SIMPLE,
+    COMPLEX
+};
+
+enum class data_rule : uint8_t {
+    ANY,
+    REQUIRED,
+    EMPTY
+};
+
+struct command_key {
+
+    uint64_t head;
+    uint16_t tail;
+
+    constexpr bool operator==(const command_key &other) const {
+        return head == other.head && tail == other.tail;
+    }
+};
+
+struct command_spec {
+
+    command_id id;
+    const char *name;
+    command_layout layout;
+    data_rule data;
+    /*
+     * Reported when the data breaks the rule.
+     */
+    const char *data_error;
+    command_key key;
+};
+
+/*
+ * Returns the words the cmd field of the command holds, in the order memcpy reads them on this host.
+ */
+constexpr command_key make_command_key(const char *name) {
+
+    uint8_t bytes[CMD_MAX_LENGTH] = {};
+    for (size_t i = 0; i < (size_t)CMD_MAX_LENGTH && name[i] != '\0'; i++) {
+        bytes[i] = name[i];
+    }
+    command_key key{0, 0};
+    for (size_t i = 0; i < sizeof(key.head); i++) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        key.head |= (uint64_t)bytes[i] << (8 * i);
+#else
+        key.head |= (uint64_t)bytes[i] << (8 * (sizeof(key.head) - 1 - i));
+#endif
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    key.tail = bytes[8] | (bytes[9] << 8);
+#else
+    key.tail = (bytes[8] << 8) | bytes[9];
+#endif
+    return key;
+}
+
+constexpr command_spec make_command_spec(command_id id, const char *name, command_layout layout, data_rule data,
+                                         const char *data_error) {
+    return {id, name, layout, data, data_error, make_command_key(name)};
+}
+
+/*
+ * Indexed by command_id.
+ */
+constexpr std::array<command_spec, COMMAND_COUNT> COMMANDS = {{
+        make_command_spec(command_id::HELLO, HELLO_REQUEST, command_layout::SIMPLE, data_rule::EMPTY,
+                          "hello command too long"),
+        make_command_spec(command_id::GOOD_DAY, HELLO_RESPONSE, command_layout::COMPLEX, data_rule::ANY, ""),
+        make_command_spec(command_id::LIST, LIST_REQUEST, command_layout::SIMPLE, data_rule::ANY, ""),
+        make_command_spec(command_id::MY_LIST, LIST_RESPONSE, command_layout::SIMPLE, data_rule::ANY, ""),
+        make_command_spec(command_id::GET, GET_REQUEST, command_layout::SIMPLE, data_rule::REQUIRED,
+                          "file to send not specified"),
+        make_command_spec(command_id::GET_RANGE, GET_RANGE_REQUEST, command_layout::COMPLEX, data_rule::REQUIRED,
+                          "file to send not specified"),
+        make_command_spec(command_id::CONNECT_ME, GET_RESPONSE, command_layout::COMPLEX, data_rule::ANY, ""),
+        make_command_spec(command_id::DEL, DELETE_REQUEST, command_layout::SIMPLE, data_rule::REQUIRED,
+                          "file to delete not specified"),
+        make_command_spec(command_id::ADD, ADD_REQUEST, command_layout::COMPLEX, data_rule::REQUIRED,
+                          "file to save on server not specified"),
+        make_command_spec(command_id::NO_WAY, ADD_DENIED_RESPONSE, command_layout::SIMPLE, data_rule::ANY, ""),
+        make_command_spec(command_id::CAN_ADD, ADD_ACCEPTED_RESPONSE, command_layout::COMPLEX, data_rule::ANY, ""),
+        make_command_spec(command_id::STATS, STATS_REQUEST, command_layout::SIMPLE, data_rule::EMPTY,
+                          "stats command too long"),
+        make_command_spec(command_id::MY_STATS, STATS_RESPONSE, command_layout::SIMPLE, data_rule::ANY, ""),
+}};
+
+constexpr size_t COMMAND_TABLE_BITS = 6;
+constexpr size_t COMMAND_TABLE_SIZE = (size_t)1 << COMMAND_TABLE_BITS;
+
+constexpr size_t command_slot(const command_key &key) {
+    return ((key.head ^ ((uint64_t)key.tail << 48)) * 0xFF51AFD7ED558CCDULL) >> (64 - COMMAND_TABLE_BITS);
+}
+
+constexpr std::array<command_id, COMMAND_TABLE_SIZE> make_command_table() {
+
+    std::array<command_id, COMMAND_TABLE_SIZE> table{};
+    for (command_id &id : table) {
+        id = command_id::UNKNOWN;
+    }
+    for (const command_spec &spec : COMMANDS) {
+        table[command_slot(spec.key)] = spec.id;
+    }
+    return table;
+}
+
+constexpr std::array<command_id, COMMAND_TABLE_SIZE> COMMAND_TABLE = make_command_table();
+
+constexpr bool is_command_registry_valid() {
+
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if ((size_t)COMMANDS[i].id != i || COMMAND_TABLE[command_slot(COMMANDS[i].key)] != COMMANDS[i].id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(is_command_registry_valid(), "commands are out of order or their slots in the table collide");
+
+constexpr size_t command_header_length(command_layout layout) {
+    return layout == command_layout::COMPLEX ? EMPTY_CMPLX_CMD_LENGTH : EMPTY_SIMPL_CMD_LENGTH;
+}
+
+/*
+ * Returns UNKNOWN for commands that aren't in the registry or are too short to hold a cmd field.
+ */
+inline command_id identify_command(const message_view &message) {
+
+    if (message.length < (size_t)CMD_MAX_LENGTH) {
+        return command_id::UNKNOWN;
+    }
+    command_key key{0, 0};
+    memcpy(&key.head, message.cmd(), sizeof(key.head));
+    memcpy(&key.tail, message.cmd() + sizeof(key.head), sizeof(key.tail));
+    command_id id = COMMAND_TABLE[command_slot(key)];
+    return (id != command_id::UNKNOWN && COMMANDS[(size_t)id].key == key) ? id : command_id::UNKNOWN;
+}
+
+/*
+ * Returns nullptr if the message is long enough for the command's layout and its data follows the command's rule,
+ * otherwise what is wrong with it.
+ */
+inline const char *check_command(command_id id, const message_view &message) {
+
+    const command_spec &spec = COMMANDS[(size_t)id];
+    size_t header = command_header_length(spec.layout);
+    if (message.length < header) {
+        return "command too short";
+    }
+    if ((spec.data == data_rule::REQUIRED && message.length == header) ||
+        (spec.data == data_rule::EMPTY && message.length > header)) {
+        return spec.data_error;
+    }
+    return nullptr;
+}
+
+#endif //COMMANDS_H
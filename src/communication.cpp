@@ -1,3 +1,4 @@
+#include <cerrno>
 #include <cstring>
 #include <unistd.h>
 #include <stdint.h>
@@ -8,29 +9,35 @@
 
 #include "communication.h"
 
-static void copy_cmd_and_fill(char *cmd, const std::string &str) {
+static void copy_cmd_and_fill(char *cmd, const char *name) {
 
-    for (uint16_t i = 0; i < CMD_MAX_LENGTH; i++) {
-        if (i < str.length()) {
-            cmd[i] = str[i];
-        } else {
-            cmd[i] = '\0';
-        }
-    }
+    size_t length = strnlen(name, CMD_MAX_LENGTH);
+    memcpy(cmd, name, length);
+    memset(cmd + length, '\0', CMD_MAX_LENGTH - length);
+}
+
+/*
+ * Copies data with its '\0' and nothing past it, unlike strncpy which pads the whole array.
+ */
+static void copy_data(char *destination, const char *data, size_t max_length) {
+
+    size_t length = strnlen(data, max_length);
+    memcpy(destination, data, length);
+    destination[length] = '\0';
 }
 
 simpl_cmd::simpl_cmd() {
 
     memset(&(this->cmd), '\0', CMD_MAX_LENGTH);
     this->cmd_seq = 0;
-    memset(&(this->data), '\0', SIMPL_CMD_MAX_DATA_LENGTH + 1);
+    this->data[0] = '\0';
 }
 
-simpl_cmd::simpl_cmd(const std::string &cmd, uint64_t cmd_seq, const char *data) {
+simpl_cmd::simpl_cmd(const char *cmd, uint64_t cmd_seq, const char *data) {
 
     copy_cmd_and_fill(this->cmd, cmd);
     this->cmd_seq = cmd_seq;
-    strncpy(this->data, data, SIMPL_CMD_MAX_DATA_LENGTH);
+    copy_data(this->data, data, SIMPL_CMD_MAX_DATA_LENGTH);
 }
 
 cmplx_cmd::cmplx_cmd() {
@@ -38,15 +45,37 @@ cmplx_cmd::cmplx_cmd() {
     memset(&(this->cmd), '\0', CMD_MAX_LENGTH);
     this->cmd_seq = 0;
     this->param = 0;
-    memset(&(this->data), '\0', CMPLX_CMD_MAX_DATA_LENGTH + 1);
+    this->data[0] = '\0';
 }
 
-cmplx_cmd::cmplx_cmd(const std::string &cmd, uint64_t cmd_seq, uint64_t param, const char *data) {
+cmplx_cmd::cmplx_cmd(const char *cmd, uint64_t cmd_seq, uint64_t param, const char *data) {
 
     copy_cmd_and_fill(this->cmd, cmd);
     this->cmd_seq = cmd_seq;
     this->param = param;
-    strncpy(this->data, data, CMPLX_CMD_MAX_DATA_LENGTH);
+    copy_data(this->data, data, CMPLX_CMD_MAX_DATA_LENGTH);
+}
+
+void Message_buffer_pool::release::operator()(message_buffer *buffer) const {
+
+    std::lock_guard<std::mutex> lock(this->pool->mutex);
+    this->pool->free_buffers.emplace_back(buffer);
+}
+
+Message_buffer_pool::buffer_ptr Message_buffer_pool::acquire() {
+
+    std::unique_ptr<message_buffer> buffer;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->free_buffers.empty()) {
+            buffer = std::move(this->free_buffers.back());
+            this->free_buffers.pop_back();
+        }
+    }
+    if (!buffer) {
+        buffer.reset(new message_buffer);
+    }
+    return buffer_ptr(buffer.release(), release{this});
 }
 
 bool UDP_socket::init_standard_socket() {
@@ -103,6 +132,39 @@ bool UDP_socket::send_simpl_cmd_by_ip(const simpl_cmd &command, const std::strin
                      sizeof(addr)) != EMPTY_SIMPL_CMD_LENGTH + data_len));
 }
 
+bool UDP_socket::send_simpl_cmds(const char *cmd, uint64_t cmd_seq, const std::vector<std::string> &data,
+                                 const sockaddr_in &addr) {
+
+    char header[EMPTY_SIMPL_CMD_LENGTH];
+    copy_cmd_and_fill(header, cmd);
+    memcpy(header + CMD_MAX_LENGTH, &cmd_seq, sizeof(cmd_seq));
+    std::vector<iovec> buffers(2 * data.size());
+    std::vector<mmsghdr> headers(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        buffers[2 * i].iov_base = header;
+        buffers[2 * i].iov_len = EMPTY_SIMPL_CMD_LENGTH;
+        buffers[2 * i + 1].iov_base = (void*)data[i].data();
+        buffers[2 * i + 1].iov_len = data[i].length();
+        memset(&headers[i], 0, sizeof(mmsghdr));
+        headers[i].msg_hdr.msg_iov = &buffers[2 * i];
+        headers[i].msg_hdr.msg_iovlen = 2;
+        headers[i].msg_hdr.msg_name = (void*)&addr;
+        headers[i].msg_hdr.msg_namelen = sizeof(addr);
+    }
+    size_t sent = 0;
+    while (sent < headers.size()) {
+        int res = sendmmsg(this->socket_number, headers.data() + sent, headers.size() - sent, 0);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += res;
+    }
+    return true;
+}
+
 bool UDP_socket::send_cmplx_cmd(const cmplx_cmd &command, const sockaddr_in &addr, uint16_t data_len) {
 
     return (sendto(this->socket_number, &command, EMPTY_CMPLX_CMD_LENGTH + data_len, 0, (sockaddr*)&addr,
@@ -119,33 +181,50 @@ bool UDP_socket::send_cmplx_cmd_by_ip(const cmplx_cmd& command, const std::strin
                      sizeof(addr)) != EMPTY_CMPLX_CMD_LENGTH + data_len));
 }
 
-bool UDP_socket::receive_cmplx_cmd(cmplx_cmd_wrapper *wrapper) {
+bool UDP_socket::receive_message(message_buffer *buffer, message_view *message) {
 
-    cmplx_cmd command;
     ssize_t len;
-    sockaddr_in addr{};
     socklen_t addr_len = sizeof(sockaddr_in);
-    if ((len = recvfrom(this->socket_number, &command, sizeof(command), MSG_WAITALL, (sockaddr*)&addr, &addr_len)) < 0) {
+    if ((len = recvfrom(this->socket_number, buffer->bytes, MAX_UDP_MESSAGE_SIZE, 0, (sockaddr*)&message->address,
+                        &addr_len)) < 0) {
         return false;
     }
-    wrapper->command = command;
-    wrapper->length = len;
-    wrapper->address = addr;
+    buffer->bytes[len] = '\0';
+    message->bytes = buffer->bytes;
+    message->length = len;
     return true;
 }
 
-bool UDP_socket::receive_simpl_cmd(simpl_cmd_wrapper *wrapper) {
+message_batch::message_batch(size_t slots) : messages(slots), addresses(slots), buffers(slots), headers(slots) {
 
-    simpl_cmd command;
-    ssize_t len;
-    sockaddr_in addr{};
-    socklen_t addr_len = sizeof(sockaddr_in);
-    if ((len = recvfrom(this->socket_number, &command, sizeof(command), MSG_WAITALL, (sockaddr*)&addr, &addr_len)) < 0) {
+    for (size_t i = 0; i < slots; i++) {
+        this->buffers[i].iov_base = this->messages[i].bytes;
+        this->buffers[i].iov_len = MAX_UDP_MESSAGE_SIZE;
+        memset(&(this->headers[i]), 0, sizeof(mmsghdr));
+        this->headers[i].msg_hdr.msg_iov = &(this->buffers[i]);
+        this->headers[i].msg_hdr.msg_iovlen = 1;
+        this->headers[i].msg_hdr.msg_name = &(this->addresses[i]);
+    }
+}
+
+message_view message_batch::view(size_t slot) const {
+    return {this->messages[slot].bytes, this->headers[slot].msg_len, this->addresses[slot]};
+}
+
+bool UDP_socket::receive_message_batch(message_batch *batch) {
+
+    for (auto &header : batch->headers) {
+        header.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+    int received = recvmmsg(this->socket_number, batch->headers.data(), batch->headers.size(), MSG_WAITFORONE, nullptr);
+    if (received <= 0) {
+        batch->count = 0;
         return false;
     }
-    wrapper->command = command;
-    wrapper->length = len;
-    wrapper->address = addr;
+    batch->count = received;
+    for (int i = 0; i < received; i++) {
+        batch->messages[i].bytes[batch->headers[i].msg_len] = '\0';
+    }
     return true;
 }
 
@@ -187,12 +266,21 @@ bool TCP_socket::init_socket() {
 }
 
 bool TCP_socket::bind_to_random_port() {
+    return this->bind_to_specific_port(0);
+}
+
+bool TCP_socket::bind_to_specific_port(in_port_t port) {
 
     sockaddr_in addr{};
     memset(&addr, 0, sizeof(addr));
     socklen_t len = sizeof(addr);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_family = AF_INET;
+    addr.sin_port = port;
+    int reuse = 1;
+    if (port != 0 && setsockopt(this->socket_number, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        return false;
+    }
     if (bind(this->socket_number, (sockaddr*)&addr, sizeof(addr)) < 0) {
         return false;
     }
@@ -227,10 +315,10 @@ int TCP_socket::select(uint64_t seconds) {
     timeval timeval{};
     timeval.tv_sec = seconds;
     timeval.tv_usec = 0;
-    fd_set fd_set;
-    FD_ZERO(&fd_set);
-    FD_SET(this->socket_number, &fd_set);
-    return ::select(this->socket_number + 1, &fd_set, nullptr, nullptr, &timeval);
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(this->socket_number, &read_set);
+    return ::select(this->socket_number + 1, &read_set, nullptr, nullptr, &timeval);
 }
 
 void TCP_socket::close_socket() {
@@ -239,6 +327,12 @@ void TCP_socket::close_socket() {
     this->closed = true;
 }
 
+int32_t TCP_socket::release() {
+
+    this->closed = true;
+    return this->socket_number;
+}
+
 TCP_socket::~TCP_socket() {
     if (!closed) {
         close(this->socket_number);
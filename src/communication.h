@@ -1,8 +1,14 @@
 #ifndef COMMUNICATION_H
 #define COMMUNICATION_H
 
+#include <mutex>
+#include <memory>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <endian.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 constexpr int CMD_MAX_LENGTH = 10;
 constexpr int MAX_UDP_MESSAGE_SIZE = 65507;
@@ -13,18 +19,76 @@ constexpr int CMPLX_CMD_MAX_DATA_LENGTH = MAX_UDP_MESSAGE_SIZE - EMPTY_CMPLX_CMD
 constexpr int BUFFER_SIZE = 65535;
 constexpr int TTL = 5;
 constexpr int QUEUE_LENGTH = 5;
-const std::string HELLO_REQUEST = "HELLO";
-const std::string HELLO_RESPONSE = "GOOD_DAY";
-const std::string LIST_REQUEST = "LIST";
-const std::string LIST_RESPONSE = "MY_LIST";
-const std::string GET_REQUEST = "GET";
-const std::string GET_RESPONSE = "CONNECT_ME";
-const std::string DELETE_REQUEST = "DEL";
-const std::string ADD_REQUEST = "ADD";
-const std::string ADD_DENIED_RESPONSE = "NO_WAY";
-const std::string ADD_ACCEPTED_RESPONSE = "CAN_ADD";
+constexpr int DATA_PORT_QUEUE_LENGTH = 1024;
+constexpr int RECEIVE_BATCH_SIZE = 32;
+constexpr char HELLO_REQUEST[] = "HELLO";
+constexpr char HELLO_RESPONSE[] = "GOOD_DAY";
+constexpr char LIST_REQUEST[] = "LIST";
+constexpr char LIST_RESPONSE[] = "MY_LIST";
+constexpr char GET_REQUEST[] = "GET";
+constexpr char GET_RESPONSE[] = "CONNECT_ME";
+/*
+ * Complex command with the starting offset in param and the file name in data, optionally followed by '\0',
+ * a big endian 64 bit number of bytes to send and big endian 64 bit transfer flags. It's answered with CONNECT_ME
+ * whose data is the file name followed by '\0' and the big endian 64 bit size of the whole file.
+ */
+constexpr char GET_RANGE_REQUEST[] = "GET_RANGE";
+/*
+ * Transfer flags ask for optional features of a transfer. ADD carries them after the file name and '\0'. A server
+ * answers with the flags it agreed to, shifted by TRANSFER_FLAGS_SHIFT, in param of CONNECT_ME or CAN_ADD. They
+ * sit above the port number, so clients reading only the port keep working.
+ * With TRANSFER_FLAG_COMPRESSION file data on the TCP connection is a stream of frames, see compression.h.
+ * With TRANSFER_FLAG_CHECKSUM the sender follows the data with its CRC32C, see checksum.h, carried in a CHECKSUM
+ * frame if the transfer is compressed.
+ * With TRANSFER_FLAG_SHARED_PORT the port is the server's data port, shared by all transfers, and the reply's data
+ * ends with a big endian 64 bit token (CAN_ADD data is then '\0' and the token). The client sends the token as the
+ * first 8 bytes on a new connection, or on one kept open after a complete transfer to the same port.
+ */
+constexpr uint64_t TRANSFER_FLAG_COMPRESSION = 1;
+constexpr uint64_t TRANSFER_FLAG_CHECKSUM = 2;
+constexpr uint64_t TRANSFER_FLAG_SHARED_PORT = 4;
+/*
+ * With TRANSFER_FLAG_INLINE data small enough for one datagram skips TCP. The server may answer GET_RANGE with
+ * CONNECT_ME with port 0 and only INLINE, CHECKSUM and FILE_CHECKSUM among the flags, its data is then the file
+ * name, '\0', the big endian 64 bit size of the whole file, its checksum if FILE_CHECKSUM is set, the requested bytes
+ * and their CRC32C if CHECKSUM is set.
+ * ADD asks for it with the file's bytes, and their CRC32C if it asks for CHECKSUM, right after the flags. A server
+ * that stored them answers CAN_ADD with port 0, INLINE among the flags and no data. Any other answer means they
+ * were ignored and the file is uploaded over TCP as usual.
+ */
+constexpr uint64_t TRANSFER_FLAG_INLINE = 8;
+/*
+ * With TRANSFER_FLAG_FILE_CHECKSUM, asked for along with CHECKSUM, the size of the whole file in a CONNECT_ME answer
+ * to GET_RANGE is followed by the big endian 64 bit CRC32C of the whole file, or NO_CHECKSUM if the server doesn't
+ * know it. It lets a client check a file put together from several ranges, servers or attempts.
+ */
+constexpr uint64_t TRANSFER_FLAG_FILE_CHECKSUM = 16;
+constexpr int TRANSFER_FLAGS_SHIFT = 16;
+constexpr uint64_t TRANSFER_PORT_MASK = (1 << TRANSFER_FLAGS_SHIFT) - 1;
+/*
+ * Returns how many bytes of a file fit in an inline GET_RANGE answer or ADD after its name, '\0', a 64 bit number
+ * and with room left for a checksum.
+ */
+constexpr uint64_t inline_capacity(size_t name_length) {
+    return (name_length + 1 + sizeof(uint64_t) + sizeof(uint32_t) < (size_t)CMPLX_CMD_MAX_DATA_LENGTH)
+           ? CMPLX_CMD_MAX_DATA_LENGTH - (name_length + 1 + sizeof(uint64_t) + sizeof(uint32_t)) : 0;
+}
+constexpr char DELETE_REQUEST[] = "DEL";
+constexpr char ADD_REQUEST[] = "ADD";
+constexpr char ADD_DENIED_RESPONSE[] = "NO_WAY";
+constexpr char ADD_ACCEPTED_RESPONSE[] = "CAN_ADD";
+/*
+ * Simple command without data, answered with MY_STATS simple commands whose data are consecutive parts of the
+ * server's metrics in the Prometheus text format, each ending with a whole line.
+ */
+constexpr char STATS_REQUEST[] = "STATS";
+constexpr char STATS_RESPONSE[] = "MY_STATS";
 
 
+/*
+ * Layouts of outgoing commands. Constructors write only the header and the data up to its '\0', so building a
+ * command costs as much as the bytes that are sent. Received commands are read through message_view instead.
+ */
 struct __attribute__((__packed__)) simpl_cmd {
 
     char cmd[CMD_MAX_LENGTH];
@@ -32,7 +96,7 @@ struct __attribute__((__packed__)) simpl_cmd {
     char data[SIMPL_CMD_MAX_DATA_LENGTH + 1];
 
     simpl_cmd();
-    simpl_cmd(const std::string &cmd, uint64_t cmd_seq, const char *data);
+    simpl_cmd(const char *cmd, uint64_t cmd_seq, const char *data);
 };
 
 struct __attribute__((__packed__)) cmplx_cmd {
@@ -43,21 +107,110 @@ struct __attribute__((__packed__)) cmplx_cmd {
     char data[CMPLX_CMD_MAX_DATA_LENGTH + 1];
 
     cmplx_cmd();
-    cmplx_cmd(const std::string &cmd, uint64_t cmd_seq, uint64_t param, const char *data);
+    cmplx_cmd(const char *cmd, uint64_t cmd_seq, uint64_t param, const char *data);
 };
 
-struct simpl_cmd_wrapper {
+/*
+ * Room for one datagram, with a byte to spare for the '\0' put right after the received bytes.
+ */
+struct message_buffer {
 
-    simpl_cmd command;
-    uint64_t length;
-    sockaddr_in address;
+    char bytes[MAX_UDP_MESSAGE_SIZE + 1];
 };
 
-struct cmplx_cmd_wrapper {
+/*
+ * A received command read in place, valid as long as the buffer it points to isn't reused. length is the number of
+ * bytes actually received. Whether data starts after cmd_seq or after param depends on the command, so there are
+ * accessors for both layouts; param and cmplx data are only meaningful if length is at least EMPTY_CMPLX_CMD_LENGTH.
+ * Numbers are returned in host byte order.
+ */
+struct message_view {
 
-    cmplx_cmd command;
-    uint64_t length;
-    sockaddr_in address;
+    const char *bytes = nullptr;
+    size_t length = 0;
+    sockaddr_in address{};
+
+    const char *cmd() const {
+        return bytes;
+    }
+    uint64_t cmd_seq() const {
+        return read_number(CMD_MAX_LENGTH);
+    }
+    uint64_t param() const {
+        return read_number(EMPTY_SIMPL_CMD_LENGTH);
+    }
+    const char *simpl_data() const {
+        return bytes + EMPTY_SIMPL_CMD_LENGTH;
+    }
+    size_t simpl_data_length() const {
+        return length - EMPTY_SIMPL_CMD_LENGTH;
+    }
+    const char *cmplx_data() const {
+        return bytes + EMPTY_CMPLX_CMD_LENGTH;
+    }
+    size_t cmplx_data_length() const {
+        return length > (size_t)EMPTY_CMPLX_CMD_LENGTH ? length - EMPTY_CMPLX_CMD_LENGTH : 0;
+    }
+
+private:
+
+    uint64_t read_number(size_t position) const {
+        uint64_t value;
+        memcpy(&value, bytes + position, sizeof(value));
+        return be64toh(value);
+    }
+};
+
+/*
+ * Receive buffers shared between threads. A buffer is allocated once and then reused, it's never cleared, as every
+ * receive terminates the data it got.
+ */
+class Message_buffer_pool {
+
+private:
+
+    struct release {
+
+        Message_buffer_pool *pool;
+
+        void operator()(message_buffer *buffer) const;
+    };
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<message_buffer>> free_buffers;
+
+public:
+
+    using buffer_ptr = std::unique_ptr<message_buffer, release>;
+
+    Message_buffer_pool() = default;
+    Message_buffer_pool(const Message_buffer_pool &) = delete;
+    Message_buffer_pool &operator=(const Message_buffer_pool &) = delete;
+
+    /*
+     * Returns a buffer that goes back to the pool when the pointer is destroyed, the pool has to outlive it.
+     */
+    buffer_ptr acquire();
+};
+
+/*
+ * Preallocated slots reused by every batched receive. Data of each received command is always '\0' terminated
+ * right after the last received byte.
+ */
+struct message_batch {
+
+    std::vector<message_buffer> messages;
+    std::vector<sockaddr_in> addresses;
+    std::vector<iovec> buffers;
+    std::vector<mmsghdr> headers;
+    size_t count = 0;
+
+    explicit message_batch(size_t slots);
+
+    message_batch(const message_batch &) = delete;
+    message_batch &operator=(const message_batch &) = delete;
+
+    message_view view(size_t slot) const;
 };
 
 struct UDP_socket {
@@ -82,6 +235,11 @@ struct UDP_socket {
      * Sends a simpl_cmd to specific ip address.
      */
     bool send_simpl_cmd_by_ip(const simpl_cmd& command, const std::string& ip, in_port_t port, uint16_t data_len);
+    /*
+     * Sends one simpl_cmd per element of data, all with the same cmd and cmd_seq, using batched sendmmsg calls.
+     */
+    bool send_simpl_cmds(const char *cmd, uint64_t cmd_seq, const std::vector<std::string> &data,
+                         const struct sockaddr_in &addr);
     /*
      * Sends a cmplx_cmd on multicast.
      */
@@ -91,13 +249,13 @@ struct UDP_socket {
      */
     bool send_cmplx_cmd_by_ip(const cmplx_cmd& command, const std::string& ip, in_port_t port, uint16_t data_len);
     /*
-     * Receives a single cmplx_cmd send to socket.
+     * Receives a single command into buffer, *message is set to view it.
      */
-    bool receive_cmplx_cmd(cmplx_cmd_wrapper *wrapper);
+    bool receive_message(message_buffer *buffer, message_view *message);
     /*
-     * Receives a single simpl_cmd send to socket.
+     * Waits for at least one command and receives as many already queued ones as fit in the batch.
      */
-    bool receive_simpl_cmd(simpl_cmd_wrapper *wrapper);
+    bool receive_message_batch(message_batch *batch);
 };
 
 struct TCP_socket {
@@ -111,10 +269,15 @@ struct TCP_socket {
 
     bool init_socket();
     bool bind_to_random_port();
+    bool bind_to_specific_port(in_port_t port);
     bool connect_to_socket(const std::string &ip, in_port_t port);
     int32_t accept_connection();
     int select(uint64_t seconds);
     void close_socket();
+    /*
+     * Gives up ownership of the descriptor, it won't be closed by this object anymore.
+     */
+    int32_t release();
 };
 
 #endif //COMMUNICATION_H
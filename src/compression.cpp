@@ -0,0 +1,222 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compression.h"
+
+constexpr unsigned MAX_INCOMPRESSIBLE_STREAK = 4;
+constexpr unsigned BLOCKS_SKIPPED_AFTER_STREAK = 32;
+constexpr size_t MAX_FRAME_LENGTH = FRAME_HEADER_LENGTH + 2 * COMPRESSION_BLOCK_SIZE;
+
+static void put_u32(char *out, uint32_t value) {
+
+    value = htobe32(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const char *in) {
+
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return be32toh(value);
+}
+
+static void store_raw(const char *data, size_t len, std::string *frame) {
+
+    frame->resize(FRAME_HEADER_LENGTH + len);
+    (*frame)[0] = (char)frame_kind::RAW;
+    put_u32(&(*frame)[1], len);
+    put_u32(&(*frame)[5], len);
+    memcpy(&(*frame)[FRAME_HEADER_LENGTH], data, len);
+}
+
+void Frame_encoder::encode(const char *data, size_t len, std::string *frame) {
+
+    if (this->blocks_to_skip > 0) {
+        this->blocks_to_skip--;
+        store_raw(data, len, frame);
+        return;
+    }
+    uLongf stored_len = compressBound(len);
+    frame->resize(FRAME_HEADER_LENGTH + stored_len);
+    if (compress2((Bytef*)&(*frame)[FRAME_HEADER_LENGTH], &stored_len, (const Bytef*)data, len,
+                  COMPRESSION_LEVEL) != Z_OK || stored_len >= len - len / 8) {
+        if (++this->incompressible_streak >= MAX_INCOMPRESSIBLE_STREAK) {
+            this->incompressible_streak = 0;
+            this->blocks_to_skip = BLOCKS_SKIPPED_AFTER_STREAK;
+        }
+        store_raw(data, len, frame);
+        return;
+    }
+    this->incompressible_streak = 0;
+    frame->resize(FRAME_HEADER_LENGTH + stored_len);
+    (*frame)[0] = (char)frame_kind::DEFLATE;
+    put_u32(&(*frame)[1], stored_len);
+    put_u32(&(*frame)[5], len);
+}
+
+void Frame_encoder::encode_checksum(uint32_t checksum, std::string *frame) {
+
+    frame->resize(FRAME_HEADER_LENGTH + CHECKSUM_LENGTH);
+    (*frame)[0] = (char)frame_kind::CHECKSUM;
+    put_u32(&(*frame)[1], CHECKSUM_LENGTH);
+    put_u32(&(*frame)[5], 0);
+    put_checksum(&(*frame)[FRAME_HEADER_LENGTH], checksum);
+}
+
+bool Frame_decoder::decode_frame(const char *frame, const std::function<bool(const char*, size_t)> &output) {
+
+    size_t stored_len = get_u32(frame + 1);
+    size_t original_len = get_u32(frame + 5);
+    const char *payload = frame + FRAME_HEADER_LENGTH;
+    if (original_len > COMPRESSION_BLOCK_SIZE || this->checksum_received) {
+        return false;
+    }
+    if (frame[0] == (char)frame_kind::CHECKSUM) {
+        if (stored_len != CHECKSUM_LENGTH || original_len != 0) {
+            return false;
+        }
+        this->checksum_received = true;
+        this->checksum_value = get_checksum(payload);
+        return true;
+    }
+    if (frame[0] == (char)frame_kind::RAW) {
+        return stored_len == original_len && output(payload, original_len);
+    }
+    if (frame[0] != (char)frame_kind::DEFLATE) {
+        return false;
+    }
+    this->block.resize(original_len);
+    uLongf decoded_len = original_len;
+    return uncompress((Bytef*)&this->block[0], &decoded_len, (const Bytef*)payload, stored_len) == Z_OK &&
+           decoded_len == original_len && output(this->block.data(), original_len);
+}
+
+size_t Frame_decoder::bytes_to_frame_end() const {
+
+    if (this->pending.length() < FRAME_HEADER_LENGTH) {
+        return FRAME_HEADER_LENGTH - this->pending.length();
+    }
+    return FRAME_HEADER_LENGTH + get_u32(&this->pending[1]) - this->pending.length();
+}
+
+bool Frame_decoder::feed(const char *data, size_t len, const std::function<bool(const char*, size_t)> &output) {
+
+    while (!this->pending.empty()) {
+        /* Finish the frame split between calls first. */
+        size_t needed = FRAME_HEADER_LENGTH;
+        if (this->pending.length() >= FRAME_HEADER_LENGTH) {
+            needed += get_u32(&this->pending[1]);
+        }
+        if (needed > MAX_FRAME_LENGTH) {
+            return false;
+        }
+        if (this->pending.length() < needed) {
+            if (len == 0) {
+                return true;
+            }
+            size_t taken = std::min(len, needed - this->pending.length());
+            this->pending.append(data, taken);
+            data += taken;
+            len -= taken;
+            continue;
+        }
+        if (!this->decode_frame(this->pending.data(), output)) {
+            return false;
+        }
+        this->pending.clear();
+    }
+    while (len > 0) {
+        /* Whole frames are decoded straight from data. */
+        size_t frame_len = (len >= FRAME_HEADER_LENGTH) ? FRAME_HEADER_LENGTH + get_u32(data + 1) : SIZE_MAX;
+        if (len >= FRAME_HEADER_LENGTH && frame_len > MAX_FRAME_LENGTH) {
+            return false;
+        }
+        if (len < frame_len) {
+            this->pending.assign(data, len);
+            return true;
+        }
+        if (!this->decode_frame(data, output)) {
+            return false;
+        }
+        data += frame_len;
+        len -= frame_len;
+    }
+    return true;
+}
+
+
+Compressing_reader::Compressing_reader(int32_t file_fd, uint64_t offset, uint64_t length, bool checksum) {
+    this->thread = std::thread(&Compressing_reader::produce, this, file_fd, offset, length, checksum);
+}
+
+Compressing_reader::~Compressing_reader() {
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->condition.notify_all();
+    this->thread.join();
+}
+
+void Compressing_reader::produce(int32_t file_fd, uint64_t offset, uint64_t length, bool checksum) {
+
+    Frame_encoder encoder;
+    Crc32c crc;
+    std::string block(COMPRESSION_BLOCK_SIZE, '\0');
+    while (length > 0) {
+        ssize_t len = pread(file_fd, &block[0], std::min<uint64_t>(length, COMPRESSION_BLOCK_SIZE), offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        std::string frame;
+        if (len > 0) {
+            if (checksum) {
+                crc.update(block.data(), len);
+            }
+            encoder.encode(block.data(), len, &frame);
+        }
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (len <= 0) {
+            this->failed = true;
+            break;
+        }
+        this->condition.wait(lock, [this] { return this->stopping || this->frames.size() < COMPRESSION_QUEUE_LENGTH; });
+        if (this->stopping) {
+            return;
+        }
+        this->frames.push_back(std::move(frame));
+        this->condition.notify_all();
+        offset += len;
+        length -= len;
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (checksum && !this->failed) {
+        /* The queue may go one frame over its limit here, the consumer is about to take everything anyway. */
+        this->frames.emplace_back();
+        Frame_encoder::encode_checksum(crc.value(), &this->frames.back());
+    }
+    this->finished = true;
+    this->condition.notify_all();
+}
+
+bool Compressing_reader::next(std::string *frame) {
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->condition.wait(lock, [this] { return this->finished || !this->frames.empty(); });
+    if (this->frames.empty() || this->failed) {
+        return false;
+    }
+    frame->swap(this->frames.front());
+    this->frames.pop_front();
+    this->condition.notify_all();
+    return true;
+}
+
+bool Compressing_reader::has_failed() {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->failed;
+}
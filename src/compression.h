@@ -0,0 +1,122 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "checksum.h"
+
+/*
+ * Compressed transfers send the file as a sequence of frames, each holding one block of at most
+ * COMPRESSION_BLOCK_SIZE bytes: a 1 byte kind, 4 bytes of stored length and 4 bytes of original length, all big
+ * endian, followed by the stored bytes. Blocks that don't get smaller are stored raw.
+ * A transfer with a checksum ends with a CHECKSUM frame holding CHECKSUM_LENGTH stored bytes and no original ones.
+ */
+constexpr size_t COMPRESSION_BLOCK_SIZE = 131072;
+constexpr size_t FRAME_HEADER_LENGTH = 9;
+constexpr size_t COMPRESSION_QUEUE_LENGTH = 8;
+constexpr int COMPRESSION_LEVEL = 1;
+
+enum class frame_kind : char {
+    RAW = 0,
+    DEFLATE = 1,
+    CHECKSUM = 2
+};
+
+/*
+ * Turns blocks into frames. After a few blocks in a row failed to compress it stops trying for a while, so
+ * incompressible files cost almost no CPU.
+ */
+class Frame_encoder {
+
+private:
+
+    unsigned incompressible_streak = 0;
+    unsigned blocks_to_skip = 0;
+
+public:
+
+    void encode(const char *data, size_t len, std::string *frame);
+    static void encode_checksum(uint32_t checksum, std::string *frame);
+};
+
+/*
+ * Turns a stream of frames received in pieces of any size back into the original bytes.
+ */
+class Frame_decoder {
+
+private:
+
+    std::string pending;
+    std::string block;
+    bool checksum_received = false;
+    uint32_t checksum_value = 0;
+
+    bool decode_frame(const char *frame, const std::function<bool(const char*, size_t)> &output);
+
+public:
+
+    /*
+     * Calls output with every decoded block. Returns false if the stream is damaged or output returns false.
+     */
+    bool feed(const char *data, size_t len, const std::function<bool(const char*, size_t)> &output);
+    /*
+     * Returns true if the stream fed so far ends on a frame boundary.
+     */
+    bool at_frame_boundary() const {
+        return pending.empty();
+    }
+    /*
+     * Returns how many bytes complete the current frame, or its header if that isn't known yet. Reading no more
+     * than that never takes bytes that follow the stream.
+     */
+    size_t bytes_to_frame_end() const;
+    /*
+     * Returns true once the CHECKSUM frame was decoded, no data frames are accepted after it.
+     */
+    bool has_checksum() const {
+        return checksum_received;
+    }
+    uint32_t checksum() const {
+        return checksum_value;
+    }
+};
+
+/*
+ * Reads a range of a file and encodes it into frames on its own thread, staying at most COMPRESSION_QUEUE_LENGTH
+ * frames ahead of the consumer. With checksum set the last frame is a CHECKSUM frame of the range.
+ */
+class Compressing_reader {
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::string> frames;
+    bool finished = false;
+    bool failed = false;
+    bool stopping = false;
+    std::thread thread;
+
+    void produce(int32_t file_fd, uint64_t offset, uint64_t length, bool checksum);
+
+public:
+
+    Compressing_reader(int32_t file_fd, uint64_t offset, uint64_t length, bool checksum = false);
+    ~Compressing_reader();
+
+    Compressing_reader(const Compressing_reader &) = delete;
+    Compressing_reader &operator=(const Compressing_reader &) = delete;
+
+    /*
+     * Waits for the next frame. Returns false once all frames were taken or if reading the file failed.
+     */
+    bool next(std::string *frame);
+    bool has_failed();
+};
+
+#endif //COMPRESSION_H
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <functional>
+
+#include "file_cache.h"
+
+static uint64_t hash_name(const std::string &name) {
+    return std::hash<std::string>{}(name);
+}
+
+Frequency_sketch::Frequency_sketch(size_t width) {
+
+    size_t rounded = 16;
+    while (rounded < width) {
+        rounded <<= 1;
+    }
+    this->counters.assign(ROWS * rounded, 0);
+    this->width_mask = rounded - 1;
+    this->sample_size = 10 * (uint64_t)rounded;
+}
+
+size_t Frequency_sketch::index(uint64_t hash, size_t row) const {
+
+    static const uint64_t seeds[ROWS] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+                                         0xD6E8FEB86659FD93ULL};
+    uint64_t mixed = (hash + row) * seeds[row];
+    mixed ^= mixed >> 31;
+    return row * (this->width_mask + 1) + (mixed & this->width_mask);
+}
+
+void Frequency_sketch::increment(uint64_t hash) {
+
+    for (size_t row = 0; row < ROWS; row++) {
+        uint8_t &counter = this->counters[this->index(hash, row)];
+        if (counter < MAX_COUNT) {
+            counter++;
+        }
+    }
+    if (++this->additions >= this->sample_size) {
+        for (uint8_t &counter : this->counters) {
+            counter >>= 1;
+        }
+        this->additions /= 2;
+    }
+}
+
+uint8_t Frequency_sketch::frequency(uint64_t hash) const {
+
+    uint8_t result = MAX_COUNT;
+    for (size_t row = 0; row < ROWS; row++) {
+        result = std::min(result, this->counters[this->index(hash, row)]);
+    }
+    return result;
+}
+
+File_cache::File_cache(uint64_t capacity, uint64_t max_file_size) :
+        capacity(capacity), max_file_size(max_file_size), window_capacity(capacity / 100),
+        protected_capacity((capacity - capacity / 100) / 10 * 8),
+        sketch(std::max<uint64_t>(1024, capacity / 1024)) {}
+
+std::list<std::string> &File_cache::list_of(segment place) {
+
+    switch (place) {
+        case segment::WINDOW:
+            return this->window;
+        case segment::PROBATION:
+            return this->probation;
+        default:
+            return this->protected_files;
+    }
+}
+
+uint64_t &File_cache::bytes_of(segment place) {
+
+    switch (place) {
+        case segment::WINDOW:
+            return this->window_bytes;
+        case segment::PROBATION:
+            return this->probation_bytes;
+        default:
+            return this->protected_bytes;
+    }
+}
+
+void File_cache::move_to(entry &cached, segment place) {
+
+    uint64_t size = cached.file.data->size();
+    std::list<std::string> &target = this->list_of(place);
+    target.splice(target.begin(), this->list_of(cached.place), cached.position);
+    this->bytes_of(cached.place) -= size;
+    this->bytes_of(place) += size;
+    cached.place = place;
+}
+
+void File_cache::remove(std::unordered_map<std::string, entry>::iterator cached) {
+
+    this->list_of(cached->second.place).erase(cached->second.position);
+    this->bytes_of(cached->second.place) -= cached->second.file.data->size();
+    this->entries.erase(cached);
+}
+
+void File_cache::leave_window() {
+
+    uint64_t main_capacity = this->capacity - this->window_capacity;
+    while (this->window_bytes > this->window_capacity && !this->window.empty()) {
+        auto candidate = this->entries.find(this->window.back());
+        uint64_t size = candidate->second.file.data->size();
+        uint8_t frequency = this->sketch.frequency(hash_name(candidate->first));
+        bool admitted = true;
+        while (this->probation_bytes + this->protected_bytes + size > main_capacity) {
+            std::list<std::string> &victims = this->probation.empty() ? this->protected_files : this->probation;
+            auto victim = this->entries.find(victims.back());
+            if (frequency <= this->sketch.frequency(hash_name(victim->first))) {
+                admitted = false;
+                break;
+            }
+            this->remove(victim);
+            this->stats.evictions++;
+        }
+        if (admitted) {
+            this->move_to(candidate->second, segment::PROBATION);
+        } else {
+            this->remove(candidate);
+            this->stats.rejections++;
+        }
+    }
+}
+
+void File_cache::demote_protected() {
+
+    while (this->protected_bytes > this->protected_capacity && this->protected_files.size() > 1) {
+        this->move_to(this->entries.find(this->protected_files.back())->second, segment::PROBATION);
+    }
+}
+
+bool File_cache::admits(uint64_t size) const {
+    return size <= this->max_file_size && size > 0 && size <= this->capacity - this->window_capacity;
+}
+
+bool File_cache::lookup(const std::string &name, cached_file *file, uint64_t *generation) {
+
+    if (this->capacity == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->sketch.increment(hash_name(name));
+    *generation = this->generation;
+    auto cached = this->entries.find(name);
+    if (cached == this->entries.end()) {
+        this->stats.misses++;
+        return false;
+    }
+    this->stats.hits++;
+    *file = cached->second.file;
+    if (cached->second.place == segment::PROBATION) {
+        this->move_to(cached->second, segment::PROTECTED);
+        this->demote_protected();
+    } else {
+        this->move_to(cached->second, cached->second.place);
+    }
+    return true;
+}
+
+void File_cache::insert(const std::string &name, const cached_file &file, uint64_t generation) {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (generation != this->generation || !this->admits(file.data->size()) || this->entries.count(name) > 0) {
+        return;
+    }
+    this->window.push_front(name);
+    this->entries.emplace(name, entry{file, segment::WINDOW, this->window.begin()});
+    this->window_bytes += file.data->size();
+    this->stats.insertions++;
+    this->leave_window();
+}
+
+void File_cache::invalidate(const std::string &name) {
+
+    if (this->capacity == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->generation++;
+    auto cached = this->entries.find(name);
+    if (cached != this->entries.end()) {
+        this->remove(cached);
+        this->stats.invalidations++;
+    }
+}
+
+cache_counters File_cache::counters() {
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    cache_counters result = this->stats;
+    result.bytes = this->window_bytes + this->probation_bytes + this->protected_bytes;
+    result.entries = this->entries.size();
+    return result;
+}
@@ -0,0 +1,156 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <sys/stat.h>
+
+constexpr uint64_t DEFAULT_CACHE_SIZE = 67108864;
+constexpr uint64_t DEFAULT_CACHE_MAX_FILE = 1048576;
+
+/*
+ * Approximate access counts of recently used keys, a count-min sketch of 4-bit counters. Every counter is halved
+ * once the sketch saw ten times as many accesses as it has counters per row, so old popularity fades away.
+ */
+class Frequency_sketch {
+
+private:
+
+    static constexpr size_t ROWS = 4;
+    static constexpr uint8_t MAX_COUNT = 15;
+
+    std::vector<uint8_t> counters;
+    size_t width_mask = 0;
+    uint64_t additions = 0;
+    uint64_t sample_size = 0;
+
+    size_t index(uint64_t hash, size_t row) const;
+
+public:
+
+    /*
+     * Sizes the sketch for about width distinct keys.
+     */
+    explicit Frequency_sketch(size_t width);
+
+    void increment(uint64_t hash);
+    uint8_t frequency(uint64_t hash) const;
+};
+
+/*
+ * Contents of a file with their CRC32C, and the inode and modification time they were read at, which tell if the
+ * file was changed by something else than the server since.
+ */
+struct cached_file {
+
+    std::shared_ptr<const std::string> data;
+    uint32_t checksum = 0;
+    ino_t inode = 0;
+    timespec modified{};
+};
+
+struct cache_counters {
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t rejections = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+    uint64_t bytes = 0;
+    uint64_t entries = 0;
+};
+
+/*
+ * Contents of small files, bounded by the sum of their sizes, with W-TinyLFU eviction. New files go through a small
+ * LRU window. A file leaving the window enters the main segmented LRU only if the sketch saw it more often than the
+ * file it would push out, so a scan of files read once can't flush the popular ones.
+ * The main part keeps files hit again in its protected segment, the rest in probation, which is evicted first.
+ * Thread safe. Entries are shared with sessions still sending them, so evicting one never waits for a transfer.
+ */
+class File_cache {
+
+private:
+
+    enum class segment {
+        WINDOW,
+        PROBATION,
+        PROTECTED
+    };
+
+    struct entry {
+
+        cached_file file;
+        segment place;
+        std::list<std::string>::iterator position;
+    };
+
+    uint64_t capacity;
+    uint64_t max_file_size;
+    uint64_t window_capacity;
+    uint64_t protected_capacity;
+    uint64_t window_bytes = 0;
+    uint64_t probation_bytes = 0;
+    uint64_t protected_bytes = 0;
+
+    std::mutex mutex;
+    Frequency_sketch sketch;
+    std::unordered_map<std::string, entry> entries;
+    /*
+     * Names in order of use, most recent first.
+     */
+    std::list<std::string> window;
+    std::list<std::string> probation;
+    std::list<std::string> protected_files;
+    /*
+     * Changed by every invalidation, so contents read before one can't be inserted after it.
+     */
+    uint64_t generation = 0;
+    cache_counters stats;
+
+    std::list<std::string> &list_of(segment place);
+    uint64_t &bytes_of(segment place);
+    void move_to(entry &cached, segment place);
+    void remove(std::unordered_map<std::string, entry>::iterator cached);
+    /*
+     * Moves files out of the window while it's over its size, each one either gets into probation or is dropped.
+     */
+    void leave_window();
+    void demote_protected();
+
+public:
+
+    /*
+     * A cache of capacity 0 is disabled and admits nothing.
+     */
+    File_cache(uint64_t capacity, uint64_t max_file_size);
+
+    File_cache(const File_cache &) = delete;
+    File_cache &operator=(const File_cache &) = delete;
+
+    /*
+     * Returns true if files of this size are worth reading into the cache.
+     */
+    bool admits(uint64_t size) const;
+    /*
+     * Records an access of the file and copies its entry to *file if it's cached. *generation has to be passed to
+     * insert along with contents read afterwards, when the file missed or its entry turned out to be stale.
+     */
+    bool lookup(const std::string &name, cached_file *file, uint64_t *generation);
+    /*
+     * Adds contents of a file read after a missed lookup, unless the file was invalidated meanwhile.
+     */
+    void insert(const std::string &name, const cached_file &file, uint64_t generation);
+    /*
+     * Forgets the file, called whenever it's removed or replaced.
+     */
+    void invalidate(const std::string &name);
+    cache_counters counters();
+};
+
+#endif //FILE_CACHE_H
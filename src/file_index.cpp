@@ -0,0 +1,312 @@
+#include <thread>
+#include <algorithm>
+#include <functional>
+
+#include "file_index.h"
+#include "communication.h"
+
+static size_t shard_of(const std::string &file) {
+    return std::hash<std::string>()(file) % FILE_INDEX_SHARDS;
+}
+
+static void append_to_list_responses(std::vector<std::string> &responses, const std::string &file) {
+
+    if (responses.empty() || responses.back().length() + 1 + file.length() > SIMPL_CMD_MAX_DATA_LENGTH) {
+        responses.emplace_back();
+        responses.back().reserve(SIMPL_CMD_MAX_DATA_LENGTH);
+    } else {
+        responses.back() += '\n';
+    }
+    responses.back() += file;
+}
+
+/*
+ * Returns distinct trigrams of the string, each packed into the lower 24 bits of an integer.
+ */
+static std::vector<uint32_t> trigrams_of(const std::string &str) {
+
+    std::vector<uint32_t> result;
+    if (str.length() < 3) {
+        return result;
+    }
+    result.reserve(str.length() - 2);
+    for (size_t i = 0; i + 2 < str.length(); i++) {
+        result.push_back(((uint32_t)(unsigned char)str[i] << 16) | ((uint32_t)(unsigned char)str[i + 1] << 8) |
+                         (uint32_t)(unsigned char)str[i + 2]);
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+static size_t hash_of(const std::string &file) {
+    return std::hash<std::string>()(file) / FILE_INDEX_SHARDS;
+}
+
+size_t file_index_shard::find_slot(const std::string &file) const {
+
+    size_t mask = this->slots.size() - 1;
+    size_t slot = hash_of(file) & mask;
+    while (this->slots[slot] != EMPTY_SLOT && this->files[this->slots[slot]] != file) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void file_index_shard::rehash(size_t number_of_slots) {
+
+    this->slots.assign(number_of_slots, EMPTY_SLOT);
+    for (uint32_t id = 0; id < this->files.size(); id++) {
+        this->slots[this->find_slot(this->files[id])] = id;
+    }
+}
+
+uint32_t file_index_shard::find(const std::string &file) const {
+    return this->slots.empty() ? EMPTY_SLOT : this->slots[this->find_slot(file)];
+}
+
+bool file_index_shard::contains(const std::string &file) const {
+    return this->find(file) != EMPTY_SLOT;
+}
+
+void file_index_shard::reserve(size_t number_of_files) {
+
+    this->files.reserve(number_of_files);
+    this->sizes.reserve(number_of_files);
+    this->checksums.reserve(number_of_files);
+    size_t number_of_slots = 16;
+    while (number_of_slots < 2 * number_of_files) {
+        number_of_slots *= 2;
+    }
+    if (number_of_slots > this->slots.size()) {
+        this->rehash(number_of_slots);
+    }
+}
+
+void file_index_shard::insert(const std::string &file, uint64_t size, uint64_t checksum) {
+
+    uint32_t id = this->files.size();
+    this->files.push_back(file);
+    this->sizes.push_back(size);
+    this->checksums.push_back(checksum);
+    if (2 * this->files.size() > this->slots.size()) {
+        this->rehash(std::max<size_t>(16, 2 * this->slots.size()));
+    } else {
+        this->slots[this->find_slot(file)] = id;
+    }
+    for (uint32_t trigram : trigrams_of(file)) {
+        this->trigrams[trigram].push_back(id);
+    }
+}
+
+void file_index_shard::erase(const std::string &file) {
+
+    size_t mask = this->slots.size() - 1;
+    size_t slot = this->find_slot(file);
+    uint32_t id = this->slots[slot];
+    uint32_t last = this->files.size() - 1;
+    /* Backward shift deletion keeps every probe sequence unbroken without tombstones. */
+    size_t next = slot;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (this->slots[next] == EMPTY_SLOT) {
+            break;
+        }
+        size_t home = hash_of(this->files[this->slots[next]]) & mask;
+        if ((slot <= next) ? (slot < home && home <= next) : (slot < home || home <= next)) {
+            continue;
+        }
+        this->slots[slot] = this->slots[next];
+        slot = next;
+    }
+    this->slots[slot] = EMPTY_SLOT;
+
+    for (uint32_t trigram : trigrams_of(file)) {
+        std::vector<uint32_t> &ids = this->trigrams[trigram];
+        ids.erase(std::lower_bound(ids.begin(), ids.end(), id));
+        if (ids.empty()) {
+            this->trigrams.erase(trigram);
+        }
+    }
+    if (id != last) {
+        for (uint32_t trigram : trigrams_of(this->files[last])) {
+            std::vector<uint32_t> &ids = this->trigrams[trigram];
+            ids.pop_back();
+            ids.insert(std::lower_bound(ids.begin(), ids.end(), id), id);
+        }
+        this->slots[this->find_slot(this->files[last])] = id;
+        this->files[id] = std::move(this->files[last]);
+        this->sizes[id] = this->sizes[last];
+        this->checksums[id] = this->checksums[last];
+    }
+    this->files.pop_back();
+    this->sizes.pop_back();
+    this->checksums.pop_back();
+}
+
+void file_index_shard::find_matching(const std::string &pattern, std::vector<const std::string*> &result) const {
+
+    std::vector<uint32_t> pattern_trigrams = trigrams_of(pattern);
+    if (pattern_trigrams.empty()) {
+        for (const std::string &file : this->files) {
+            if (file.find(pattern) != std::string::npos) {
+                result.push_back(&file);
+            }
+        }
+        return;
+    }
+    std::vector<const std::vector<uint32_t>*> lists;
+    for (uint32_t trigram : pattern_trigrams) {
+        auto entry = this->trigrams.find(trigram);
+        if (entry == this->trigrams.end()) {
+            return;
+        }
+        lists.push_back(&(entry->second));
+    }
+    std::sort(lists.begin(), lists.end(), [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {
+        return a->size() < b->size();
+    });
+    std::vector<uint32_t> candidates = *(lists[0]);
+    std::vector<uint32_t> intersection;
+    for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+        intersection.clear();
+        std::set_intersection(candidates.begin(), candidates.end(), lists[i]->begin(), lists[i]->end(),
+                              std::back_inserter(intersection));
+        candidates.swap(intersection);
+    }
+    for (uint32_t id : candidates) {
+        if (this->files[id].find(pattern) != std::string::npos) {
+            result.push_back(&(this->files[id]));
+        }
+    }
+}
+
+std::shared_ptr<const file_index_snapshot> file_index_snapshot::build(const std::vector<file_entry> &files) {
+
+    std::vector<std::vector<const file_entry*>> by_shard(FILE_INDEX_SHARDS);
+    for (const file_entry &file : files) {
+        by_shard[shard_of(file.name)].push_back(&file);
+    }
+    std::vector<std::shared_ptr<file_index_shard>> shards(FILE_INDEX_SHARDS);
+    std::vector<size_t> counts(FILE_INDEX_SHARDS, 0);
+    auto fill_shards = [&](size_t first, size_t step) {
+        for (size_t i = first; i < FILE_INDEX_SHARDS; i += step) {
+            shards[i] = std::make_shared<file_index_shard>();
+            shards[i]->reserve(by_shard[i].size());
+            for (const file_entry *file : by_shard[i]) {
+                if (!shards[i]->contains(file->name)) {
+                    shards[i]->insert(file->name, file->size, file->checksum);
+                    counts[i]++;
+                }
+            }
+        }
+    };
+    size_t number_of_threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), 16));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < number_of_threads; i++) {
+        threads.emplace_back(fill_shards, i, number_of_threads);
+    }
+    fill_shards(0, number_of_threads);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::shared_ptr<file_index_snapshot> snapshot = std::make_shared<file_index_snapshot>();
+    snapshot->shards.assign(shards.begin(), shards.end());
+    for (size_t count : counts) {
+        snapshot->files_count += count;
+    }
+    return snapshot;
+}
+
+bool file_index_snapshot::contains(const std::string &file) const {
+
+    return this->shards[shard_of(file)]->contains(file);
+}
+
+bool file_index_snapshot::find(const std::string &file, uint64_t *size, uint64_t *checksum) const {
+
+    const file_index_shard &shard = *(this->shards[shard_of(file)]);
+    uint32_t id = shard.find(file);
+    if (id == EMPTY_SLOT) {
+        return false;
+    }
+    *size = shard.sizes[id];
+    if (checksum != nullptr) {
+        *checksum = shard.checksums[id];
+    }
+    return true;
+}
+
+std::shared_ptr<const std::vector<std::string>> file_index_snapshot::list(const std::string &pattern) const {
+
+    if (pattern.empty()) {
+        std::shared_ptr<const std::vector<std::string>> cached = std::atomic_load(&(this->full_list));
+        if (cached) {
+            return cached;
+        }
+    }
+    std::shared_ptr<std::vector<std::string>> responses = std::make_shared<std::vector<std::string>>();
+    std::vector<const std::string*> matching;
+    for (const auto &shard : this->shards) {
+        matching.clear();
+        shard->find_matching(pattern, matching);
+        for (const std::string *file : matching) {
+            append_to_list_responses(*responses, *file);
+        }
+    }
+    for (std::string &response : *responses) {
+        response.shrink_to_fit();
+    }
+    if (pattern.empty()) {
+        std::atomic_store(&(this->full_list), std::shared_ptr<const std::vector<std::string>>(responses));
+    }
+    return responses;
+}
+
+std::shared_ptr<const file_index_snapshot> file_index_snapshot::with_file(const std::string &file, uint64_t size,
+                                                                         uint64_t checksum) const {
+
+    size_t shard = shard_of(file);
+    if (this->shards[shard]->contains(file)) {
+        return nullptr;
+    }
+    std::shared_ptr<file_index_shard> new_shard = std::make_shared<file_index_shard>(*(this->shards[shard]));
+    new_shard->insert(file, size, checksum);
+    std::shared_ptr<file_index_snapshot> snapshot = std::make_shared<file_index_snapshot>();
+    snapshot->shards = this->shards;
+    snapshot->files_count = this->files_count + 1;
+    snapshot->shards[shard] = new_shard;
+    return snapshot;
+}
+
+std::shared_ptr<const file_index_snapshot> file_index_snapshot::without_file(const std::string &file) const {
+
+    size_t shard = shard_of(file);
+    if (!this->shards[shard]->contains(file)) {
+        return nullptr;
+    }
+    std::shared_ptr<file_index_shard> new_shard = std::make_shared<file_index_shard>(*(this->shards[shard]));
+    new_shard->erase(file);
+    std::shared_ptr<file_index_snapshot> snapshot = std::make_shared<file_index_snapshot>();
+    snapshot->shards = this->shards;
+    snapshot->files_count = this->files_count - 1;
+    snapshot->shards[shard] = new_shard;
+    return snapshot;
+}
+
+std::shared_ptr<const file_index_snapshot> file_index_snapshot::with_checksum(const std::string &file,
+                                                                             uint64_t checksum) const {
+
+    size_t shard = shard_of(file);
+    uint32_t id = this->shards[shard]->find(file);
+    if (id == EMPTY_SLOT || this->shards[shard]->checksums[id] == checksum) {
+        return nullptr;
+    }
+    std::shared_ptr<file_index_shard> new_shard = std::make_shared<file_index_shard>(*(this->shards[shard]));
+    new_shard->checksums[id] = checksum;
+    std::shared_ptr<file_index_snapshot> snapshot = std::make_shared<file_index_snapshot>();
+    snapshot->shards = this->shards;
+    snapshot->files_count = this->files_count;
+    snapshot->shards[shard] = new_shard;
+    return snapshot;
+}
@@ -0,0 +1,107 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include "checksum.h"
+
+constexpr size_t FILE_INDEX_SHARDS = 256;
+constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+
+struct file_entry {
+
+    std::string name;
+    uint64_t size;
+    uint64_t checksum = NO_CHECKSUM;
+};
+
+/*
+ * Part of the index holding names that hash to one shard. Never modified after it was published.
+ * Every name has a dense id (its position in files) found through an open addressing table of ids, and every
+ * trigram of a name lists the ids of names containing it in increasing order, so substring search only has to look
+ * at names that contain all trigrams of the pattern.
+ */
+struct file_index_shard {
+
+    std::vector<std::string> files;
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> checksums;
+    std::vector<uint32_t> slots;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+
+    bool contains(const std::string &file) const;
+    /*
+     * Returns id of the file or EMPTY_SLOT if it isn't in the shard.
+     */
+    uint32_t find(const std::string &file) const;
+    /*
+     * Prepares the shard for holding number_of_files files without growing.
+     */
+    void reserve(size_t number_of_files);
+    /*
+     * Adds a file that isn't in the shard yet.
+     */
+    void insert(const std::string &file, uint64_t size, uint64_t checksum);
+    /*
+     * Removes a file that is in the shard, the last file takes over its id.
+     */
+    void erase(const std::string &file);
+    /*
+     * Appends to result all files which names contain the pattern.
+     */
+    void find_matching(const std::string &pattern, std::vector<const std::string*> &result) const;
+
+private:
+
+    /*
+     * Returns the slot holding the file's id, or the empty slot where it would be placed.
+     */
+    size_t find_slot(const std::string &file) const;
+    void rehash(size_t number_of_slots);
+};
+
+/*
+ * Immutable version of the whole index. Readers keep a version alive for as long as they use it without taking
+ * any lock, writers build a new version sharing all untouched shards with the old one and publish it.
+ */
+struct file_index_snapshot {
+
+    std::vector<std::shared_ptr<const file_index_shard>> shards;
+    size_t files_count = 0;
+    /*
+     * Data of MY_LIST responses listing all files, built by the first reader that needs it.
+     * Accessed with std::atomic_load / std::atomic_store.
+     */
+    mutable std::shared_ptr<const std::vector<std::string>> full_list;
+
+    /*
+     * Builds a version of the index containing the given files, filling shards on all cores.
+     */
+    static std::shared_ptr<const file_index_snapshot> build(const std::vector<file_entry> &files);
+
+    bool contains(const std::string &file) const;
+    /*
+     * Returns false if there is no such file, otherwise stores its size in *size and its CRC32C, or NO_CHECKSUM if
+     * it isn't known, in *checksum.
+     */
+    bool find(const std::string &file, uint64_t *size, uint64_t *checksum = nullptr) const;
+    /*
+     * Returns data of MY_LIST responses listing all files which names contain the pattern.
+     */
+    std::shared_ptr<const std::vector<std::string>> list(const std::string &pattern) const;
+
+    /*
+     * Return a new version of the index with the file added or removed, or with the checksum of a file set, or nullptr
+     * if there is nothing to change.
+     */
+    std::shared_ptr<const file_index_snapshot> with_file(const std::string &file, uint64_t size,
+                                                         uint64_t checksum = NO_CHECKSUM) const;
+    std::shared_ptr<const file_index_snapshot> without_file(const std::string &file) const;
+    std::shared_ptr<const file_index_snapshot> with_checksum(const std::string &file, uint64_t checksum) const;
+};
+
+#endif //FILE_INDEX_H
@@ -0,0 +1,245 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "file_journal.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'N', 'S', 'I', 'D', 'X', '0', '0', '2'};
+static const char JOURNAL_MAGIC[8] = {'N', 'S', 'J', 'R', 'N', '0', '0', '2'};
+constexpr size_t RECORD_HEADER_LENGTH = sizeof(char) + sizeof(uint16_t) + 2 * sizeof(uint64_t);
+constexpr size_t FILE_HEADER_LENGTH = sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t);
+
+bool is_journal_file(const std::string &file) {
+    return file.compare(0, JOURNAL_FILES_PREFIX.length(), JOURNAL_FILES_PREFIX) == 0;
+}
+
+static void encode_record(std::string &out, const journal_record &record) {
+
+    uint16_t length = record.file.length();
+    out += (char)record.op;
+    out.append((const char*)&length, sizeof(length));
+    out.append((const char*)&(record.size), sizeof(record.size));
+    out.append((const char*)&(record.checksum), sizeof(record.checksum));
+    out += record.file;
+}
+
+/*
+ * Decodes records from data until it runs out. Returns number of bytes that made up complete records.
+ */
+static size_t decode_records(const std::string &data, size_t offset, std::vector<journal_record> *records) {
+
+    while (offset + RECORD_HEADER_LENGTH <= data.length()) {
+        journal_record record;
+        uint16_t length;
+        record.op = (journal_op)data[offset];
+        memcpy(&length, data.data() + offset + 1, sizeof(length));
+        memcpy(&(record.size), data.data() + offset + 1 + sizeof(length), sizeof(record.size));
+        memcpy(&(record.checksum), data.data() + offset + 1 + sizeof(length) + sizeof(record.size),
+               sizeof(record.checksum));
+        if (offset + RECORD_HEADER_LENGTH + length > data.length()) {
+            break;
+        }
+        record.file = data.substr(offset + RECORD_HEADER_LENGTH, length);
+        records->push_back(std::move(record));
+        offset += RECORD_HEADER_LENGTH + length;
+    }
+    return offset;
+}
+
+static bool read_whole_file(const std::string &path, std::string *data, struct stat *file_stat) {
+
+    int32_t fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, file_stat) < 0) {
+        close(fd);
+        return false;
+    }
+    data->resize(file_stat->st_size);
+    size_t done = 0;
+    while (done < data->length()) {
+        ssize_t len = read(fd, &((*data)[done]), data->length() - done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            close(fd);
+            return false;
+        }
+        done += len;
+    }
+    close(fd);
+    return true;
+}
+
+static bool write_all(int32_t fd, const std::string &data) {
+
+    size_t done = 0;
+    while (done < data.length()) {
+        ssize_t len = write(fd, data.data() + done, data.length() - done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return false;
+        }
+        done += len;
+    }
+    return true;
+}
+
+static bool is_not_later(const timespec &a, const timespec &b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+}
+
+File_journal::~File_journal() {
+    if (this->journal_fd >= 0) {
+        close(this->journal_fd);
+    }
+}
+
+void File_journal::init(const std::string &folder) {
+    this->folder = folder;
+}
+
+bool File_journal::load(journal_state *state) {
+
+    const std::string &folder = this->folder;
+    std::string snapshot_data, journal_data;
+    struct stat snapshot_stat{}, journal_stat{}, folder_stat{};
+    if (!read_whole_file(folder + INDEX_SNAPSHOT_FILE, &snapshot_data, &snapshot_stat) ||
+        !read_whole_file(folder + INDEX_JOURNAL_FILE, &journal_data, &journal_stat) ||
+        stat(folder.c_str(), &folder_stat) < 0) {
+        return false;
+    }
+    /* Every change of the folder is followed by a journal write or touch, so a later change was made by someone else. */
+    if (!is_not_later(folder_stat.st_mtim, journal_stat.st_mtim)) {
+        return false;
+    }
+    uint64_t snapshot_generation, journal_generation, count;
+    if (snapshot_data.length() < FILE_HEADER_LENGTH + sizeof(count) || journal_data.length() < FILE_HEADER_LENGTH ||
+        memcmp(snapshot_data.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        memcmp(journal_data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        return false;
+    }
+    memcpy(&snapshot_generation, snapshot_data.data() + sizeof(SNAPSHOT_MAGIC), sizeof(snapshot_generation));
+    memcpy(&journal_generation, journal_data.data() + sizeof(JOURNAL_MAGIC), sizeof(journal_generation));
+    memcpy(&count, snapshot_data.data() + FILE_HEADER_LENGTH, sizeof(count));
+    if (snapshot_generation != journal_generation) {
+        return false;
+    }
+    std::vector<journal_record> records;
+    records.reserve(count);
+    if (decode_records(snapshot_data, FILE_HEADER_LENGTH + sizeof(count), &records) != snapshot_data.length() ||
+        records.size() != count) {
+        return false;
+    }
+    snapshot_data.clear();
+    size_t journal_length = decode_records(journal_data, FILE_HEADER_LENGTH, &records);
+
+    /*
+     * Names in a snapshot are unique, so only names touched by the journal need a lookup table.
+     * For each of them it holds the last record, which tells whether the file exists after replaying everything.
+     */
+    std::unordered_map<std::string, const journal_record*> changes;
+    state->unfinished.clear();
+    for (size_t i = 0; i < records.size(); i++) {
+        journal_record &record = records[i];
+        if (i >= count) {
+            changes[record.file] = &record;
+        }
+        switch (record.op) {
+            case journal_op::BEGIN_ADD:
+            case journal_op::REMOVE:
+                state->unfinished.insert(record.file);
+                break;
+            case journal_op::ADD:
+            case journal_op::REMOVED:
+                if (i >= count) {
+                    state->unfinished.erase(record.file);
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    state->files.clear();
+    state->files.reserve(count + changes.size());
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].op == journal_op::ADD && changes.find(records[i].file) == changes.end()) {
+            state->files.push_back({std::move(records[i].file), records[i].size, records[i].checksum});
+        }
+    }
+    for (auto &change : changes) {
+        if (change.second->op == journal_op::ADD) {
+            state->files.push_back({change.first, change.second->size, change.second->checksum});
+        }
+    }
+    /* Drop a torn record at the end, so that new records are appended right after the last complete one. */
+    if ((this->journal_fd = open((folder + INDEX_JOURNAL_FILE).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC)) < 0 ||
+        ftruncate(this->journal_fd, journal_length) < 0) {
+        return false;
+    }
+    this->generation = snapshot_generation;
+    this->records_since_checkpoint = records.size() - count;
+    return true;
+}
+
+bool File_journal::checkpoint(const std::vector<journal_record> &records) {
+
+    const std::string &folder = this->folder;
+    uint64_t next_generation = this->generation + 1;
+    uint64_t count = records.size();
+    std::string data(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    data.append((const char*)&next_generation, sizeof(next_generation));
+    data.append((const char*)&count, sizeof(count));
+    for (const journal_record &record : records) {
+        encode_record(data, record);
+    }
+    int32_t fd = open((folder + INDEX_SNAPSHOT_TMP_FILE).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write_all(fd, data) && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename((folder + INDEX_SNAPSHOT_TMP_FILE).c_str(), (folder + INDEX_SNAPSHOT_FILE).c_str()) < 0) {
+        return false;
+    }
+
+    if (this->journal_fd < 0 &&
+        (this->journal_fd = open((folder + INDEX_JOURNAL_FILE).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                                 0644)) < 0) {
+        return false;
+    }
+    std::string header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header.append((const char*)&next_generation, sizeof(next_generation));
+    if (ftruncate(this->journal_fd, 0) < 0 || !write_all(this->journal_fd, header)) {
+        return false;
+    }
+    this->generation = next_generation;
+    this->records_since_checkpoint = 0;
+    return true;
+}
+
+bool File_journal::append(const journal_record &record) {
+
+    if (this->journal_fd < 0) {
+        return false;
+    }
+    std::string data;
+    encode_record(data, record);
+    this->records_since_checkpoint++;
+    return write_all(this->journal_fd, data);
+}
+
+bool File_journal::touch() {
+    return this->journal_fd >= 0 && futimens(this->journal_fd, nullptr) == 0;
+}
+
+bool File_journal::needs_checkpoint(size_t files_count) {
+    return this->records_since_checkpoint > std::max<uint64_t>(JOURNAL_MIN_RECORDS_BEFORE_CHECKPOINT, files_count);
+}
@@ -0,0 +1,99 @@
+#ifndef FILE_JOURNAL_H
+#define FILE_JOURNAL_H
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "file_index.h"
+
+/*
+ * Names of files kept by the journal in the shared folder. Every name starting with the prefix is reserved.
+ */
+const std::string JOURNAL_FILES_PREFIX = ".netstore-";
+const std::string INDEX_SNAPSHOT_FILE = ".netstore-index";
+const std::string INDEX_SNAPSHOT_TMP_FILE = ".netstore-index.tmp";
+const std::string INDEX_JOURNAL_FILE = ".netstore-journal";
+constexpr uint64_t JOURNAL_MIN_RECORDS_BEFORE_CHECKPOINT = 4096;
+
+/*
+ * Operations are recorded before the folder is modified (BEGIN_ADD, REMOVE) and after it was (ADD, REMOVED), so
+ * after a crash every file that might be incomplete or left behind is known. ADD is also recorded again for a stored
+ * file once its checksum becomes known.
+ */
+enum class journal_op : char {
+    BEGIN_ADD = 'B',
+    ADD = 'A',
+    REMOVE = 'R',
+    REMOVED = 'D'
+};
+
+struct journal_record {
+
+    journal_op op;
+    std::string file;
+    uint64_t size;
+    uint64_t checksum = NO_CHECKSUM;
+};
+
+/*
+ * Contents of the folder as described by the snapshot and the journal.
+ */
+struct journal_state {
+
+    std::vector<file_entry> files;
+    /*
+     * Uploads that started and never finished, and removals that may not have happened.
+     */
+    std::set<std::string> unfinished;
+};
+
+/*
+ * Persistent index of a folder: a snapshot of all files written on checkpoints and an append-only journal of
+ * changes made since then.
+ */
+class File_journal {
+
+private:
+
+    std::string folder;
+    int32_t journal_fd = -1;
+    uint64_t generation = 0;
+    uint64_t records_since_checkpoint = 0;
+
+public:
+
+    File_journal() = default;
+    ~File_journal();
+
+    File_journal(const File_journal &) = delete;
+    File_journal &operator=(const File_journal &) = delete;
+
+    void init(const std::string &folder);
+    /*
+     * Reads the snapshot and the journal of the folder with a sequential read each and opens the journal for
+     * appending. Returns false if they are missing or damaged, or if the folder was modified after the last journal
+     * record was written.
+     */
+    bool load(journal_state *state);
+    /*
+     * Writes records as a new snapshot and starts an empty journal after it.
+     */
+    bool checkpoint(const std::vector<journal_record> &records);
+    /*
+     * Appends a record to the journal. Not thread safe, callers serialize all writes to the journal.
+     */
+    bool append(const journal_record &record);
+    /*
+     * Moves the journal's modification time to now, for changes of the folder made after their record was written.
+     */
+    bool touch();
+    /*
+     * Returns true if the journal grew enough compared to the index to be worth folding into a new snapshot.
+     */
+    bool needs_checkpoint(size_t files_count);
+};
+
+bool is_journal_file(const std::string &file);
+
+#endif //FILE_JOURNAL_H
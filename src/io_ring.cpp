@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_ring.h"
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int32_t fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int32_t fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Io_ring::~Io_ring() {
+
+    if (this->sqes != nullptr) {
+        munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ring != nullptr && this->cq_ring != this->sq_ring) {
+        munmap(this->cq_ring, this->cq_ring_size);
+    }
+    if (this->sq_ring != nullptr) {
+        munmap(this->sq_ring, this->sq_ring_size);
+    }
+    if (this->ring_fd >= 0) {
+        close(this->ring_fd);
+    }
+}
+
+bool Io_ring::init(unsigned entries) {
+
+    io_uring_params params{};
+    if ((this->ring_fd = io_uring_setup(entries, &params)) < 0) {
+        return false;
+    }
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+    }
+    void *sq_ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         this->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return false;
+    }
+    this->sq_ring = sq_ring;
+    if (single_mmap) {
+        this->cq_ring = sq_ring;
+    } else {
+        void *cq_ring = mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             this->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return false;
+        }
+        this->cq_ring = cq_ring;
+    }
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      this->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    this->sqes = (io_uring_sqe*)sqes;
+
+    char *sq = (char*)this->sq_ring;
+    char *cq = (char*)this->cq_ring;
+    this->sq_head = (unsigned*)(sq + params.sq_off.head);
+    this->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    this->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    this->sq_entries = params.sq_entries;
+    this->cq_head = (unsigned*)(cq + params.cq_off.head);
+    this->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    this->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    /* Entry i of the submission array always points at sqes[i], so the tail alone says what to submit. */
+    unsigned *array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    this->local_tail = *this->sq_tail;
+    return true;
+}
+
+bool Io_ring::supports(const uint8_t *opcodes, size_t count) {
+
+    const unsigned probed = 256;
+    std::vector<char> memory(sizeof(io_uring_probe) + probed * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *probe = (io_uring_probe*)memory.data();
+    if (io_uring_register(this->ring_fd, IORING_REGISTER_PROBE, probe, probed) < 0) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Io_ring::register_buffers(const iovec *buffers, unsigned count) {
+    return io_uring_register(this->ring_fd, IORING_REGISTER_BUFFERS, buffers, count) >= 0;
+}
+
+bool Io_ring::register_eventfd(int32_t event_fd) {
+    return io_uring_register(this->ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) >= 0;
+}
+
+io_uring_sqe *Io_ring::get_sqe() {
+
+    if (this->local_tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->sq_entries &&
+        (!this->submit() || this->local_tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->sq_entries)) {
+        return nullptr;
+    }
+    io_uring_sqe *sqe = &this->sqes[this->local_tail & this->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    this->local_tail++;
+    this->to_submit++;
+    return sqe;
+}
+
+bool Io_ring::submit() {
+
+    if (this->to_submit == 0) {
+        return true;
+    }
+    __atomic_store_n(this->sq_tail, this->local_tail, __ATOMIC_RELEASE);
+    while (this->to_submit > 0) {
+        int submitted = io_uring_enter(this->ring_fd, this->to_submit, 0, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (submitted == 0) {
+            return false;
+        }
+        this->to_submit -= submitted;
+    }
+    return true;
+}
+
+bool Io_ring::next_completion(io_uring_cqe *cqe) {
+
+    unsigned head = *this->cq_head;
+    if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    (*cqe) = this->cqes[head & this->cq_mask];
+    __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
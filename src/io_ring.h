@@ -0,0 +1,77 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring instance driven through the raw system calls. Submission entries are queued with get_sqe and
+ * handed to the kernel in one batch by submit, completions are read without system calls by next_completion.
+ */
+class Io_ring {
+
+private:
+
+    int32_t ring_fd = -1;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    /*
+     * Tail of the submission queue including entries not handed to the kernel yet.
+     */
+    unsigned local_tail = 0;
+    unsigned to_submit = 0;
+
+public:
+
+    Io_ring() = default;
+    ~Io_ring();
+
+    Io_ring(const Io_ring &) = delete;
+    Io_ring &operator=(const Io_ring &) = delete;
+
+    /*
+     * Creates the ring, returns false if the kernel doesn't support io_uring or doesn't allow it.
+     */
+    bool init(unsigned entries);
+    /*
+     * Returns true if the kernel supports every operation in opcodes.
+     */
+    bool supports(const uint8_t *opcodes, size_t count);
+    /*
+     * Registers buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED, buf_index refers to their position.
+     */
+    bool register_buffers(const iovec *buffers, unsigned count);
+    /*
+     * Makes the kernel signal event_fd whenever a completion is posted.
+     */
+    bool register_eventfd(int32_t event_fd);
+    /*
+     * Returns a cleared submission entry, or nullptr if the queue is full even after submitting.
+     */
+    io_uring_sqe *get_sqe();
+    /*
+     * Hands all queued entries to the kernel in a single system call.
+     */
+    bool submit();
+    /*
+     * Copies the oldest unread completion to *cqe and consumes it. Returns false if there is none.
+     */
+    bool next_completion(io_uring_cqe *cqe);
+};
+
+#endif //IO_RING_H
@@ -0,0 +1,208 @@
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+
+#include "metrics.h"
+
+struct metric_description {
+
+    const char *family;
+    const char *labels;
+    const char *help;
+};
+
+static const metric_description COUNTER_DESCRIPTIONS[METRIC_COUNTERS] = {
+        {"netstore_commands_dropped_total", "", "Commands dropped because the queue of workers was full"},
+        {"netstore_commands_skipped_total", "", "Invalid commands and requests for files the server doesn't have"},
+        {"netstore_transfer_bytes_total", "direction=\"send\"",
+         "Bytes of file data in completed transfers, inline ones included"},
+        {"netstore_transfer_bytes_total", "direction=\"receive\"", ""},
+        {"netstore_transfers_total", "direction=\"send\",result=\"completed\"", "TCP transfers by their outcome"},
+        {"netstore_transfers_total", "direction=\"send\",result=\"failed\"", ""},
+        {"netstore_transfers_total", "direction=\"receive\",result=\"completed\"", ""},
+        {"netstore_transfers_total", "direction=\"receive\",result=\"failed\"", ""},
+        {"netstore_inline_transfers_total", "direction=\"send\"", "Files sent or stored inside UDP commands"},
+        {"netstore_inline_transfers_total", "direction=\"receive\"", ""},
+};
+
+static const metric_description HISTOGRAM_DESCRIPTIONS[METRIC_HISTOGRAMS] = {
+        {"netstore_command_duration_seconds", "command=\"HELLO\"",
+         "Time from the arrival of a command to the end of its handling"},
+        {"netstore_command_duration_seconds", "command=\"LIST\"", ""},
+        {"netstore_command_duration_seconds", "command=\"GET\"", ""},
+        {"netstore_command_duration_seconds", "command=\"GET_RANGE\"", ""},
+        {"netstore_command_duration_seconds", "command=\"DEL\"", ""},
+        {"netstore_command_duration_seconds", "command=\"ADD\"", ""},
+        {"netstore_command_duration_seconds", "command=\"STATS\"", ""},
+        {"netstore_transfer_duration_seconds", "direction=\"send\"", "Time from the setup of a TCP transfer to its end"},
+        {"netstore_transfer_duration_seconds", "direction=\"receive\"", ""},
+};
+
+static const double REPORTED_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static std::atomic<uint64_t> next_metrics_id{1};
+
+size_t histogram_bucket(uint64_t value) {
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    unsigned shift = exponent - HISTOGRAM_PRECISION_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+uint64_t histogram_bucket_limit(size_t bucket) {
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t histogram_snapshot::quantile(double fraction) const {
+
+    if (this->count == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(fraction * this->count));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += this->buckets[bucket];
+        if (seen >= rank) {
+            return histogram_bucket_limit(bucket);
+        }
+    }
+    return histogram_bucket_limit(HISTOGRAM_BUCKETS - 1);
+}
+
+Metrics::Metrics() : id(next_metrics_id++) {}
+
+Metrics::shard &Metrics::local_shard() {
+
+    thread_local uint64_t owner = 0;
+    thread_local shard *local = nullptr;
+    if (owner != this->id) {
+        std::lock_guard<std::mutex> lock(this->shards_mutex);
+        this->shards.emplace_back(new shard);
+        local = this->shards.back().get();
+        owner = this->id;
+    }
+    return *local;
+}
+
+/*
+ * Only the owning thread writes to a shard, so a plain load and store can't lose an update.
+ */
+static void increase(std::atomic<uint64_t> &value, uint64_t by) {
+    value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+void Metrics::add(metric_counter counter, uint64_t value) {
+    increase(this->local_shard().counters[(size_t)counter], value);
+}
+
+void Metrics::record(metric_histogram histogram, uint64_t nanoseconds) {
+
+    shard &local = this->local_shard();
+    increase(local.buckets[(size_t)histogram][histogram_bucket(nanoseconds)], 1);
+    increase(local.counts[(size_t)histogram], 1);
+    increase(local.sums[(size_t)histogram], nanoseconds);
+}
+
+void Metrics::record_since(metric_histogram histogram, std::chrono::steady_clock::time_point start) {
+    this->record(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+}
+
+metrics_snapshot Metrics::snapshot() {
+
+    metrics_snapshot result;
+    std::lock_guard<std::mutex> lock(this->shards_mutex);
+    for (const std::unique_ptr<shard> &part : this->shards) {
+        for (size_t i = 0; i < METRIC_COUNTERS; i++) {
+            result.counters[i] += part->counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < METRIC_HISTOGRAMS; i++) {
+            histogram_snapshot &histogram = result.histograms[i];
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+                histogram.buckets[bucket] += part->buckets[i][bucket].load(std::memory_order_relaxed);
+            }
+            histogram.count += part->counts[i].load(std::memory_order_relaxed);
+            histogram.sum += part->sums[i].load(std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+/*
+ * Returns the label set of a sample, extra labels are appended to the metric's own ones.
+ */
+static std::string label_set(const std::string &labels, const std::string &extra) {
+
+    std::string joined = labels;
+    if (!joined.empty() && !extra.empty()) {
+        joined += ',';
+    }
+    joined += extra;
+    return joined.empty() ? "" : "{" + joined + "}";
+}
+
+static std::string seconds(uint64_t nanoseconds) {
+
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", nanoseconds / 1e9);
+    return text;
+}
+
+/*
+ * Writes HELP and TYPE lines when the family differs from the previous one. Descriptions of a family are adjacent
+ * and only the first one has the help text.
+ */
+static void family_header(std::string *out, const metric_description *descriptions, size_t i, const char *type) {
+
+    if (i > 0 && std::string(descriptions[i - 1].family) == descriptions[i].family) {
+        return;
+    }
+    (*out) += std::string("# HELP ") + descriptions[i].family + " " + descriptions[i].help + "\n";
+    (*out) += std::string("# TYPE ") + descriptions[i].family + " " + type + "\n";
+}
+
+void Metrics::write_prometheus(std::string *out) {
+
+    metrics_snapshot current = this->snapshot();
+    for (size_t i = 0; i < METRIC_COUNTERS; i++) {
+        const metric_description &description = COUNTER_DESCRIPTIONS[i];
+        family_header(out, COUNTER_DESCRIPTIONS, i, "counter");
+        (*out) += description.family + label_set(description.labels, "") + " " +
+                  std::to_string(current.counters[i]) + "\n";
+    }
+    for (size_t i = 0; i < METRIC_HISTOGRAMS; i++) {
+        const metric_description &description = HISTOGRAM_DESCRIPTIONS[i];
+        const histogram_snapshot &histogram = current.histograms[i];
+        family_header(out, HISTOGRAM_DESCRIPTIONS, i, "summary");
+        for (double fraction : REPORTED_QUANTILES) {
+            char quantile[32];
+            snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", fraction);
+            (*out) += description.family + label_set(description.labels, quantile) + " " +
+                      seconds(histogram.quantile(fraction)) + "\n";
+        }
+        (*out) += std::string(description.family) + "_sum" + label_set(description.labels, "") + " " +
+                  seconds(histogram.sum) + "\n";
+        (*out) += std::string(description.family) + "_count" + label_set(description.labels, "") + " " +
+                  std::to_string(histogram.count) + "\n";
+    }
+}
+
+void append_metric(std::string *out, const std::string &name, const std::string &type, const std::string &help,
+                   uint64_t value) {
+
+    (*out) += "# HELP " + name + " " + help + "\n";
+    (*out) += "# TYPE " + name + " " + type + "\n";
+    (*out) += name + " " + std::to_string(value) + "\n";
+}
@@ -0,0 +1,132 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+constexpr std::chrono::seconds DEFAULT_METRICS_INTERVAL(10);
+
+/*
+ * Monotonic counters, grouped by the Prometheus family they're reported in.
+ */
+enum class metric_counter {
+    COMMANDS_DROPPED,
+    COMMANDS_SKIPPED,
+    BYTES_SENT,
+    BYTES_RECEIVED,
+    SENDS_COMPLETED,
+    SENDS_FAILED,
+    RECEIVES_COMPLETED,
+    RECEIVES_FAILED,
+    INLINE_SENDS,
+    INLINE_RECEIVES,
+    COUNT
+};
+
+/*
+ * Latency distributions. Commands are measured from their arrival to the end of their handler, which includes the
+ * time they waited for a worker. Transfers are measured from their setup to their end.
+ */
+enum class metric_histogram {
+    HELLO,
+    LIST,
+    GET,
+    GET_RANGE,
+    DEL,
+    ADD,
+    STATS,
+    SEND,
+    RECEIVE,
+    COUNT
+};
+
+constexpr size_t METRIC_COUNTERS = (size_t)metric_counter::COUNT;
+constexpr size_t METRIC_HISTOGRAMS = (size_t)metric_histogram::COUNT;
+
+/*
+ * Log-linear buckets of nanoseconds like in HdrHistogram. Values below 2^HISTOGRAM_PRECISION_BITS get a bucket of
+ * their own, above that every power of two is split into 2^HISTOGRAM_PRECISION_BITS buckets, so the relative error
+ * is below 3%. Values above 2^HISTOGRAM_MAX_BITS nanoseconds, about 18 minutes, fall into the last bucket.
+ */
+constexpr unsigned HISTOGRAM_PRECISION_BITS = 5;
+constexpr unsigned HISTOGRAM_MAX_BITS = 40;
+constexpr size_t HISTOGRAM_SUB_BUCKETS = (size_t)1 << HISTOGRAM_PRECISION_BITS;
+constexpr size_t HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_BITS - HISTOGRAM_PRECISION_BITS + 2) * HISTOGRAM_SUB_BUCKETS;
+
+size_t histogram_bucket(uint64_t value);
+/*
+ * Returns the highest value that falls into the bucket.
+ */
+uint64_t histogram_bucket_limit(size_t bucket);
+
+struct histogram_snapshot {
+
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(HISTOGRAM_BUCKETS, 0);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    /*
+     * Returns the value below which the given fraction of recorded values lies, within the bucket precision.
+     */
+    uint64_t quantile(double fraction) const;
+};
+
+struct metrics_snapshot {
+
+    std::array<uint64_t, METRIC_COUNTERS> counters{};
+    std::array<histogram_snapshot, METRIC_HISTOGRAMS> histograms;
+};
+
+/*
+ * Counters and histograms updated from many threads on hot paths. Every thread writes only to its own shard,
+ * with relaxed loads and stores and no locked instructions, and readers add all shards up. Shards stay after
+ * their thread exits, so nothing recorded is lost.
+ */
+class Metrics {
+
+private:
+
+    struct shard {
+
+        std::array<std::atomic<uint64_t>, METRIC_COUNTERS> counters{};
+        std::array<std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS>, METRIC_HISTOGRAMS> buckets{};
+        std::array<std::atomic<uint64_t>, METRIC_HISTOGRAMS> counts{};
+        std::array<std::atomic<uint64_t>, METRIC_HISTOGRAMS> sums{};
+    };
+
+    const uint64_t id;
+    std::mutex shards_mutex;
+    std::vector<std::unique_ptr<shard>> shards;
+
+    shard &local_shard();
+
+public:
+
+    Metrics();
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    void add(metric_counter counter, uint64_t value = 1);
+    void record(metric_histogram histogram, uint64_t nanoseconds);
+    void record_since(metric_histogram histogram, std::chrono::steady_clock::time_point start);
+    metrics_snapshot snapshot();
+    /*
+     * Appends all counters and histograms in the Prometheus text format, histograms as summaries in seconds.
+     */
+    void write_prometheus(std::string *out);
+};
+
+/*
+ * Appends a single metric without labels in the Prometheus text format, type is "gauge" or "counter".
+ */
+void append_metric(std::string *out, const std::string &name, const std::string &type, const std::string &help,
+                   uint64_t value);
+
+#endif //METRICS_H
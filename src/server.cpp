@@ -1,12 +1,18 @@
 #include <vector>
+#include <cstring>
+#include <algorithm>
 #include <thread>
 #include <csignal>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
 #include "server.h"
+#include "commands.h"
 #include "communication.h"
 
 namespace fs = boost::filesystem;
@@ -32,6 +38,38 @@ void server_options::fill_from_arguments(int argc, const char **argv) {
                     exit(1);
                 }
             }), "Client timeout")
+            ("journal", po::value<bool>(&(this->journal))->default_value(true),
+                    "Keep a persistent index of SHRD_FLDR to start without scanning it")
+            ("workers", po::value<uint32_t>(&(this->workers))->default_value(std::thread::hardware_concurrency()),
+                    "Number of threads handling commands")
+            ("io-threads", po::value<uint32_t>(&(this->io_threads))->default_value(DEFAULT_IO_THREADS),
+                    "Number of threads carrying out TCP file transfers")
+            ("zero-copy", po::value<bool>(&(this->zero_copy))->default_value(true),
+                    "Move file data with sendfile/splice instead of copying it through user space")
+            ("io-uring", po::value<bool>(&(this->io_uring))->default_value(false),
+                    "Copy file data that goes through user space with io_uring if the kernel allows it")
+            ("compression", po::value<bool>(&(this->compression))->default_value(true),
+                    "Compress transfers for clients that ask for it")
+            ("compression-threads", po::value<uint32_t>(&(this->compression_threads))->default_value(DEFAULT_COMPRESSION_THREADS),
+                    "Number of threads compressing data of transfers")
+            ("checksum", po::value<bool>(&(this->checksum))->default_value(true),
+                    "End transfers with a CRC32C of the data for clients that ask for it")
+            ("inline", po::value<bool>(&(this->inline_transfers))->default_value(true),
+                    "Send and receive files that fit in a single datagram inside the UDP commands")
+            ("data-port", po::value<in_port_t>(&(this->data_port))->default_value(0),
+                    "TCP port shared by transfers of clients that ask for it, random if 0")
+            ("cache-size", po::value<uint64_t>(&(this->cache_size))->default_value(DEFAULT_CACHE_SIZE),
+                    "Bytes of memory for contents of popular files, 0 disables the cache")
+            ("cache-max-file", po::value<uint64_t>(&(this->cache_max_file))->default_value(DEFAULT_CACHE_MAX_FILE),
+                    "Size of the largest file kept in the cache")
+            ("metrics-file", po::value<std::string>(&(this->metrics_file))->default_value(""),
+                    "File rewritten with metrics in the Prometheus text format, none if empty")
+            ("metrics-interval", po::value<uint32_t>(&(this->metrics_interval))->default_value(
+                    DEFAULT_METRICS_INTERVAL.count()), "Seconds between writes of the metrics file")
+            ("dedup", po::value<bool>(&(this->dedup))->default_value(false),
+                    "Store files with the same contents once, uploads are then received without splice")
+            ("task-queue", po::value<uint32_t>(&(this->task_queue_length))->default_value(DEFAULT_TASK_QUEUE_LENGTH),
+                    "Max number of commands waiting for a free thread")
             ;
     po::variables_map var_map;
     try {
@@ -45,52 +83,187 @@ void server_options::fill_from_arguments(int argc, const char **argv) {
 }
 
 
-bool file_set::add_file_to_set(const std::string& file) {
+std::shared_ptr<const file_index_snapshot> file_set::get_snapshot() {
+    return std::atomic_load(&files_list);
+}
+
+bool file_set::add_file_to_set(const std::string& file, uint64_t size) {
 
-    files_list_mutex.lock();
-    bool res = files_list.insert(file).second;
-    files_list_mutex.unlock();
-    return res;
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    /* A removed file stays in unfinished until it's gone from the disk, its name can't be reused before. */
+    if (unfinished.count(file) > 0) {
+        return false;
+    }
+    std::shared_ptr<const file_index_snapshot> next = get_snapshot()->with_file(file, size);
+    if (!next) {
+        return false;
+    }
+    std::atomic_store(&files_list, next);
+    unfinished.insert(file);
+    if (journal_enabled) {
+        journal.append({journal_op::BEGIN_ADD, file, size});
+    }
+    return true;
 }
 
-bool file_set::del_file_from_set(const std::string &file) {
+void file_set::file_created() {
 
-    files_list_mutex.lock();
-    int res = files_list.erase(file);
-    files_list_mutex.unlock();
-    return (res > 0);
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    if (journal_enabled) {
+        journal.touch();
+    }
 }
 
-bool file_set::is_file_in_set(const std::string &file) {
+bool file_set::commit_file(const std::string &file, const std::string &content_id, uint64_t checksum,
+                           bool *duplicate) {
 
-    files_list_mutex.lock();
-    bool res = files_list.find(file) != files_list.end();
-    files_list_mutex.unlock();
-    return res;
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    uint64_t size;
+    if (!get_snapshot()->find(file, &size) || unfinished.erase(file) == 0) {
+        return false;
+    }
+    *duplicate = dedup_enabled && !content_id.empty() && blobs.store(file, content_id);
+    std::shared_ptr<const file_index_snapshot> next = get_snapshot()->with_checksum(file, checksum);
+    if (next) {
+        std::atomic_store(&files_list, next);
+    }
+    if (journal_enabled) {
+        journal.append({journal_op::ADD, file, size, checksum});
+        if (journal.needs_checkpoint(get_snapshot()->files_count)) {
+            checkpoint();
+        }
+    }
+    return true;
 }
 
-uint64_t file_set::get_left_space() {
+void file_set::set_checksum(const std::string &file, uint64_t size, uint32_t checksum) {
 
-    uint64_t snapshot = this->space_taken;
-    return snapshot <= this->max_space ? this->max_space - snapshot : 0;
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    std::shared_ptr<const file_index_snapshot> current = get_snapshot();
+    uint64_t indexed_size, indexed_checksum;
+    if (!current->find(file, &indexed_size, &indexed_checksum) || indexed_size != size ||
+        indexed_checksum != NO_CHECKSUM || unfinished.count(file) > 0) {
+        return;
+    }
+    std::atomic_store(&files_list, current->with_checksum(file, checksum));
+    if (journal_enabled) {
+        journal.append({journal_op::ADD, file, size, checksum});
+        if (journal.needs_checkpoint(get_snapshot()->files_count)) {
+            checkpoint();
+        }
+    }
 }
 
-bool file_set::reserve_space(uint64_t number_of_bytes) {
+bool file_set::del_file_from_set(const std::string &file, uint64_t *size) {
+
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    std::shared_ptr<const file_index_snapshot> current = get_snapshot();
+    std::shared_ptr<const file_index_snapshot> next = current->without_file(file);
+    if (!next) {
+        return false;
+    }
+    current->find(file, size);
+    if (!unfinished.insert(file).second) {
+        *size = 0;
+    } else if (dedup_enabled) {
+        *size = blobs.release(file, *size);
+    }
+    std::atomic_store(&files_list, next);
+    if (journal_enabled) {
+        journal.append({journal_op::REMOVE, file, 0});
+    }
+    return true;
+}
 
-    space_taken_mutex.lock();
-    bool can_reserve = (this->max_space >= number_of_bytes && space_taken <= this->max_space - number_of_bytes);
-    if (can_reserve) {
-        space_taken += number_of_bytes;
+void file_set::file_removed(const std::string &file) {
+
+    std::lock_guard<std::mutex> lock(files_list_mutex);
+    if (unfinished.erase(file) > 0 && journal_enabled) {
+        journal.append({journal_op::REMOVED, file, 0});
+        if (journal.needs_checkpoint(get_snapshot()->files_count)) {
+            checkpoint();
+        }
+    }
+}
+
+bool file_set::checkpoint() {
+
+    std::shared_ptr<const file_index_snapshot> current = get_snapshot();
+    std::vector<journal_record> records;
+    records.reserve(current->files_count + unfinished.size());
+    for (const auto &shard : current->shards) {
+        for (size_t i = 0; i < shard->files.size(); i++) {
+            journal_op op = (unfinished.count(shard->files[i]) > 0) ? journal_op::BEGIN_ADD : journal_op::ADD;
+            records.push_back({op, shard->files[i], shard->sizes[i], shard->checksums[i]});
+        }
     }
-    space_taken_mutex.unlock();
-    return can_reserve;
+    for (const std::string &file : unfinished) {
+        if (!current->contains(file)) {
+            records.push_back({journal_op::REMOVE, file, 0});
+        }
+    }
+    return journal.checkpoint(records);
+}
+
+bool file_set::is_file_in_set(const std::string &file) {
+    return get_snapshot()->contains(file);
+}
+
+uint64_t file_set::get_left_space() {
+
+    uint64_t taken = this->space_taken.load(std::memory_order_relaxed);
+    return taken <= this->max_space ? this->max_space - taken : 0;
+}
+
+Space_reservation file_set::reserve_space(uint64_t number_of_bytes) {
+
+    uint64_t taken = this->space_taken.load(std::memory_order_relaxed);
+    do {
+        if (number_of_bytes > this->max_space || taken > this->max_space - number_of_bytes) {
+            return Space_reservation();
+        }
+    } while (!this->space_taken.compare_exchange_weak(taken, taken + number_of_bytes, std::memory_order_relaxed));
+    return Space_reservation(&this->space_taken, number_of_bytes);
 }
 
 void file_set::free_space(uint64_t number_of_bytes) {
+    this->space_taken.fetch_sub(number_of_bytes, std::memory_order_relaxed);
+}
+
+
+Space_reservation::Space_reservation(std::atomic<uint64_t> *space_taken, uint64_t number_of_bytes)
+        : space_taken(space_taken), number_of_bytes(number_of_bytes) {}
 
-    space_taken_mutex.lock();
-    space_taken -= number_of_bytes;
-    space_taken_mutex.unlock();
+Space_reservation::Space_reservation(Space_reservation &&other) noexcept
+        : space_taken(other.space_taken), number_of_bytes(other.number_of_bytes) {
+    other.space_taken = nullptr;
+}
+
+Space_reservation &Space_reservation::operator=(Space_reservation &&other) noexcept {
+
+    if (this != &other) {
+        this->release();
+        this->space_taken = other.space_taken;
+        this->number_of_bytes = other.number_of_bytes;
+        other.space_taken = nullptr;
+    }
+    return *this;
+}
+
+Space_reservation::~Space_reservation() {
+    this->release();
+}
+
+void Space_reservation::commit() {
+    this->space_taken = nullptr;
+}
+
+void Space_reservation::release() {
+
+    if (this->space_taken != nullptr) {
+        this->space_taken->fetch_sub(this->number_of_bytes, std::memory_order_relaxed);
+        this->space_taken = nullptr;
+    }
 }
 
 
@@ -103,255 +276,775 @@ void Server::handle_hello_request(const sockaddr_in addr, uint64_t cmd_seq) {
 
 void Server::handle_list_request(sockaddr_in addr, uint64_t cmd_seq, std::string pattern) {
 
-    this->server_file_set.files_list_mutex.lock();
-    simpl_cmd command(LIST_RESPONSE, htobe64(cmd_seq), "");
-    uint64_t data_len = 0;
-    std::set<std::string>::iterator it = this->server_file_set.files_list.begin();
-    while (it != this->server_file_set.files_list.end()) {
-        if ((*it).find(pattern) != std::string::npos) {
-            if ((*it).length() + data_len >= SIMPL_CMD_MAX_DATA_LENGTH) {
-                this->communication_socket.send_simpl_cmd(command, addr, data_len);
-                memset(&command.data, '\0', sizeof(command.data));
-                data_len = 0;
-            } else {
-                if (data_len > 0) {
-                    command.data[data_len] = '\n';
-                    data_len++;
-                }
-                strcpy(command.data + data_len, (*it).c_str());
-                data_len += (*it).length();
+    std::shared_ptr<const std::vector<std::string>> responses = this->server_file_set.get_snapshot()->list(pattern);
+    this->communication_socket.send_simpl_cmds(LIST_RESPONSE, htobe64(cmd_seq), *responses, addr);
+}
+
+std::string Server::metrics_text() {
+
+    std::string text;
+    this->metrics.write_prometheus(&text);
+    append_metric(&text, "netstore_active_transfers", "gauge", "TCP transfers set up and not finished yet",
+                  this->transfer_engine.active_sessions());
+    append_metric(&text, "netstore_awaiting_transfers", "gauge",
+                  "Transfers waiting for their connection to the shared data port",
+                  this->transfer_engine.awaiting_sessions());
+    append_metric(&text, "netstore_worker_queue_depth", "gauge", "Commands waiting for a free worker",
+                  this->worker_pool.queue_depth());
+    append_metric(&text, "netstore_compression_queue_depth", "gauge", "Compression tasks waiting for a free thread",
+                  this->transfer_engine.compression_queue_depth());
+    append_metric(&text, "netstore_files", "gauge", "Files in the shared folder",
+                  this->server_file_set.get_snapshot()->files_count);
+    append_metric(&text, "netstore_space_used_bytes", "gauge", "Bytes taken by stored files and running uploads",
+                  this->server_file_set.space_taken.load(std::memory_order_relaxed));
+    append_metric(&text, "netstore_space_max_bytes", "gauge", "Space limit of the shared folder",
+                  this->server_file_set.max_space);
+    cache_counters cache = this->file_cache.counters();
+    append_metric(&text, "netstore_cache_hits_total", "counter", "GETs served from the file cache", cache.hits);
+    append_metric(&text, "netstore_cache_misses_total", "counter", "GETs of files that weren't cached", cache.misses);
+    append_metric(&text, "netstore_cache_insertions_total", "counter", "Files read into the cache",
+                  cache.insertions);
+    append_metric(&text, "netstore_cache_rejections_total", "counter",
+                  "Files dropped from the cache window because they were less popular than the eviction victim",
+                  cache.rejections);
+    append_metric(&text, "netstore_cache_evictions_total", "counter", "Files evicted to make room for others",
+                  cache.evictions);
+    append_metric(&text, "netstore_cache_invalidations_total", "counter", "Cached files that were removed or changed",
+                  cache.invalidations);
+    append_metric(&text, "netstore_cache_bytes", "gauge", "Bytes of cached file contents", cache.bytes);
+    append_metric(&text, "netstore_cache_entries", "gauge", "Cached files", cache.entries);
+    return text;
+}
+
+void Server::handle_stats_request(sockaddr_in addr, uint64_t cmd_seq) {
+
+    std::string text = this->metrics_text();
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (begin < text.length()) {
+        size_t end = begin + std::min<size_t>(text.length() - begin, SIMPL_CMD_MAX_DATA_LENGTH);
+        if (end < text.length()) {
+            /* Parts end with whole lines, a line too long for a datagram is cut at the size limit. */
+            size_t line_end = text.rfind('\n', end - 1);
+            if (line_end != std::string::npos && line_end >= begin) {
+                end = line_end + 1;
             }
         }
-        it++;
+        parts.push_back(text.substr(begin, end - begin));
+        begin = end;
     }
-    if (data_len > 0) {
-        this->communication_socket.send_simpl_cmd(command, addr, data_len);
+    this->communication_socket.send_simpl_cmds(STATS_RESPONSE, htobe64(cmd_seq), parts, addr);
+}
+
+void Server::dump_metrics() {
+
+    std::string temporary = this->options.metrics_file + ".tmp";
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::seconds(this->options.metrics_interval));
+        std::string text = this->metrics_text();
+        FILE *file = fopen(temporary.c_str(), "w");
+        if (file == nullptr) {
+            continue;
+        }
+        bool written = fwrite(text.data(), 1, text.length(), file) == text.length();
+        if (fclose(file) == 0 && written) {
+            rename(temporary.c_str(), this->options.metrics_file.c_str());
+        }
     }
-    this->server_file_set.files_list_mutex.unlock();
 }
 
-void Server::send_file(TCP_socket &sock, const std::string &file) {
+uint64_t Server::accepted_flags(uint64_t requested) {
 
-    int32_t socket_number;
-    if (sock.select(this->options.timeout) != -1) {
-        if ((socket_number = sock.accept_connection()) < 0) {
-            return;
+    uint64_t supported = 0;
+    if (this->options.compression) {
+        supported |= TRANSFER_FLAG_COMPRESSION;
+    }
+    if (this->options.checksum) {
+        supported |= TRANSFER_FLAG_CHECKSUM;
+        if (requested & TRANSFER_FLAG_CHECKSUM) {
+            supported |= TRANSFER_FLAG_FILE_CHECKSUM;
         }
-        std::ifstream file_stream((this->options.shrd_fldr + file).c_str(), std::ios::binary);
-        if (file_stream.is_open()) {
-            char buffer[BUFFER_SIZE];
-            memset(buffer, '\0', BUFFER_SIZE);
-            ssize_t len;
-            while (file_stream) {
-                file_stream.read(buffer, BUFFER_SIZE);
-                len = file_stream.gcount();
-                if (write(socket_number, buffer, len) != len) {
-                    break;
+    }
+    if (this->data_port != 0) {
+        supported |= TRANSFER_FLAG_SHARED_PORT;
+    }
+    if (this->options.inline_transfers) {
+        supported |= TRANSFER_FLAG_INLINE;
+    }
+    return requested & supported;
+}
+
+bool Server::start_transfer(std::unique_ptr<transfer_session> session, uint64_t flags, in_port_t *port,
+                            uint64_t *token) {
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    bool sending = session->direction == transfer_direction::SEND;
+    uint64_t bytes = session->bytes_left;
+    std::function<void(bool)> on_finish = std::move(session->on_finish);
+    session->on_finish = [this, started, sending, bytes, on_finish](bool success) {
+        this->metrics.record_since(sending ? metric_histogram::SEND : metric_histogram::RECEIVE, started);
+        if (success) {
+            this->metrics.add(sending ? metric_counter::BYTES_SENT : metric_counter::BYTES_RECEIVED, bytes);
+            this->metrics.add(sending ? metric_counter::SENDS_COMPLETED : metric_counter::RECEIVES_COMPLETED);
+        } else {
+            this->metrics.add(sending ? metric_counter::SENDS_FAILED : metric_counter::RECEIVES_FAILED);
+        }
+        if (on_finish) {
+            on_finish(success);
+        }
+    };
+    if (flags & TRANSFER_FLAG_SHARED_PORT) {
+        *port = this->data_port;
+        *token = this->transfer_engine.expect_connection(std::move(session));
+        return true;
+    }
+    TCP_socket tcp_sock;
+    if (!tcp_sock.init_socket() || !tcp_sock.bind_to_random_port() || (listen(tcp_sock.socket_number, QUEUE_LENGTH) < 0)) {
+        close(session->file_fd);
+        session->on_finish(false);
+        return false;
+    }
+    *port = be16toh(tcp_sock.port_number);
+    *token = 0;
+    session->listen_fd = tcp_sock.release();
+    this->transfer_engine.add_session(std::move(session));
+    return true;
+}
+
+int32_t Server::open_file_to_send(const std::string &file, struct stat *file_stat, cached_file *cached) {
+
+    std::string path = this->options.shrd_fldr + file;
+    uint64_t generation = 0;
+    if (this->file_cache.lookup(file, cached, &generation)) {
+        struct stat current{};
+        if (stat(path.c_str(), &current) == 0 && current.st_ino == cached->inode &&
+            (uint64_t)current.st_size == cached->data->size() && current.st_mtim.tv_sec == cached->modified.tv_sec &&
+            current.st_mtim.tv_nsec == cached->modified.tv_nsec) {
+            file_stat->st_size = current.st_size;
+            return -1;
+        }
+        /* Changed behind the server's back, the contents read below aren't cached until the next miss. */
+        this->file_cache.invalidate(file);
+        (*cached) = cached_file();
+    }
+    int32_t file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return -1;
+    }
+    if (fstat(file_fd, file_stat) < 0) {
+        close(file_fd);
+        return -1;
+    }
+    if (!S_ISREG(file_stat->st_mode) || !this->file_cache.admits(file_stat->st_size)) {
+        return file_fd;
+    }
+    std::string contents(file_stat->st_size, '\0');
+    size_t position = 0;
+    while (position < contents.size()) {
+        ssize_t len = pread(file_fd, &contents[position], contents.size() - position, position);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            /* The file changed while it was read, send it from the disk like an uncached one. */
+            return file_fd;
+        }
+        position += len;
+    }
+    close(file_fd);
+    /* The checksum from the index still reveals a file that got corrupted on the disk. */
+    uint64_t indexed_size, checksum;
+    if (!this->server_file_set.get_snapshot()->find(file, &indexed_size, &checksum) ||
+        indexed_size != contents.size() || checksum == NO_CHECKSUM) {
+        Crc32c crc;
+        crc.update(contents.data(), contents.size());
+        checksum = crc.value();
+        this->server_file_set.set_checksum(file, contents.size(), checksum);
+    }
+    cached->data = std::make_shared<const std::string>(std::move(contents));
+    cached->checksum = checksum;
+    cached->inode = file_stat->st_ino;
+    cached->modified = file_stat->st_mtim;
+    this->file_cache.insert(file, *cached, generation);
+    return -1;
+}
+
+std::unique_ptr<transfer_session> Server::send_session(int32_t file_fd, const std::string &file,
+                                                       const struct stat &file_stat, uint64_t offset, uint64_t length,
+                                                       uint64_t flags) {
+
+    std::unique_ptr<transfer_session> session(new transfer_session);
+    session->direction = transfer_direction::SEND;
+    if (flags & TRANSFER_FLAG_COMPRESSION) {
+        session->mode = transfer_mode::FRAMED;
+    } else {
+        session->mode = this->options.zero_copy ? transfer_mode::SENDFILE : transfer_mode::COPY;
+    }
+    session->file_fd = file_fd;
+    session->file_offset = offset;
+    session->bytes_left = length;
+    session->timeout = std::chrono::seconds(this->options.timeout);
+    uint64_t file_size = file_stat.st_size;
+    if ((flags & TRANSFER_FLAG_CHECKSUM) && offset == 0 && length == file_size) {
+        uint64_t indexed_size, checksum;
+        if (this->server_file_set.get_snapshot()->find(file, &indexed_size, &checksum) && indexed_size == file_size) {
+            session->known_checksum = checksum;
+        }
+        if (session->known_checksum == NO_CHECKSUM) {
+            std::string path = this->options.shrd_fldr + file;
+            struct stat sent_stat = file_stat;
+            session->on_checksum = [this, file, path, sent_stat](uint32_t checksum) {
+                struct stat current{};
+                if (stat(path.c_str(), &current) == 0 && current.st_ino == sent_stat.st_ino &&
+                    current.st_size == sent_stat.st_size && current.st_mtim.tv_sec == sent_stat.st_mtim.tv_sec &&
+                    current.st_mtim.tv_nsec == sent_stat.st_mtim.tv_nsec) {
+                    this->server_file_set.set_checksum(file, current.st_size, checksum);
                 }
+            };
+        }
+    }
+    session->checksum = flags & TRANSFER_FLAG_CHECKSUM;
+    return session;
+}
+
+std::unique_ptr<transfer_session> Server::memory_session(const cached_file &cached, uint64_t offset,
+                                                         uint64_t length, uint64_t flags) {
+
+    std::unique_ptr<transfer_session> session(new transfer_session);
+    session->direction = transfer_direction::SEND;
+    session->mode = (flags & TRANSFER_FLAG_COMPRESSION) ? transfer_mode::FRAMED : transfer_mode::MEMORY;
+    session->memory = cached.data;
+    session->file_offset = offset;
+    session->bytes_left = length;
+    session->timeout = std::chrono::seconds(this->options.timeout);
+    session->checksum = flags & TRANSFER_FLAG_CHECKSUM;
+    if (session->checksum) {
+        if (offset == 0 && length == cached.data->size()) {
+            session->known_checksum = cached.checksum;
+        } else {
+            Crc32c crc;
+            crc.update(cached.data->data() + offset, length);
+            session->known_checksum = crc.value();
+        }
+    }
+    return session;
+}
+
+std::unique_ptr<transfer_session> Server::file_session(int32_t file_fd, const cached_file &cached,
+                                                       const std::string &file, const struct stat &file_stat,
+                                                       uint64_t offset, uint64_t length, uint64_t flags) {
+
+    if (cached.data) {
+        return this->memory_session(cached, offset, length, flags);
+    }
+    return this->send_session(file_fd, file, file_stat, offset, length, flags);
+}
+
+uint64_t Server::file_checksum(const std::string &file, const cached_file &cached, uint64_t file_size) {
+
+    uint64_t indexed_size, checksum;
+    if (cached.data) {
+        return cached.checksum;
+    }
+    if (!this->server_file_set.get_snapshot()->find(file, &indexed_size, &checksum) || indexed_size != file_size) {
+        return NO_CHECKSUM;
+    }
+    return checksum;
+}
+
+void Server::send_inline(sockaddr_in addr, uint64_t cmd_seq, const std::string &file, int32_t file_fd,
+                         const cached_file &cached, uint64_t offset, uint64_t length, uint64_t file_size,
+                         uint64_t flags) {
+
+    flags &= TRANSFER_FLAG_INLINE | TRANSFER_FLAG_CHECKSUM | TRANSFER_FLAG_FILE_CHECKSUM;
+    cmplx_cmd command(GET_RESPONSE, htobe64(cmd_seq), htobe64(flags << TRANSFER_FLAGS_SHIFT), file.c_str());
+    uint64_t header[2] = {htobe64(file_size), htobe64(this->file_checksum(file, cached, file_size))};
+    size_t header_length = (flags & TRANSFER_FLAG_FILE_CHECKSUM) ? sizeof(header) : sizeof(header[0]);
+    memcpy(command.data + file.length() + 1, header, header_length);
+    char *contents = command.data + file.length() + 1 + header_length;
+    if (cached.data) {
+        memcpy(contents, cached.data->data() + offset, length);
+    } else {
+        uint64_t position = 0;
+        while (position < length) {
+            ssize_t len = pread(file_fd, contents + position, length - position, offset + position);
+            if (len < 0 && errno == EINTR) {
+                continue;
             }
+            if (len <= 0) {
+                break;
+            }
+            position += len;
+        }
+        close(file_fd);
+        if (position < length) {
+            return;
+        }
+    }
+    size_t data_len = file.length() + 1 + header_length + length;
+    if (flags & TRANSFER_FLAG_CHECKSUM) {
+        uint64_t checksum = (offset == 0 && length == file_size) ? be64toh(header[1]) : NO_CHECKSUM;
+        if (checksum == NO_CHECKSUM) {
+            Crc32c crc;
+            crc.update(contents, length);
+            checksum = crc.value();
         }
-        close(socket_number);
+        put_checksum(contents + length, checksum);
+        data_len += CHECKSUM_LENGTH;
     }
+    communication_socket.send_cmplx_cmd(command, addr, data_len);
+    this->metrics.add(metric_counter::INLINE_SENDS);
+    this->metrics.add(metric_counter::BYTES_SENT, length);
 }
 
 void Server::handle_get_request(sockaddr_in addr, uint64_t cmd_seq, std::string file) {
 
-    TCP_socket tcp_sock;
-    if (!tcp_sock.init_socket() || !tcp_sock.bind_to_random_port() || (listen(tcp_sock.socket_number, QUEUE_LENGTH) < 0)) {
+    struct stat file_stat{};
+    cached_file cached;
+    int32_t file_fd = this->open_file_to_send(file, &file_stat, &cached);
+    in_port_t port;
+    uint64_t token;
+    if ((file_fd < 0 && !cached.data) ||
+        !this->start_transfer(this->file_session(file_fd, cached, file, file_stat, 0, file_stat.st_size, 0), 0,
+                              &port, &token)) {
         return;
     }
-    cmplx_cmd command(GET_RESPONSE, htobe64(cmd_seq), htobe64(be16toh(tcp_sock.port_number)), file.c_str());
-    if (!communication_socket.send_cmplx_cmd(command, addr, file.length())) {
+    cmplx_cmd command(GET_RESPONSE, htobe64(cmd_seq), htobe64(port), file.c_str());
+    communication_socket.send_cmplx_cmd(command, addr, file.length());
+}
+
+void Server::handle_get_range_request(sockaddr_in addr, uint64_t cmd_seq, std::string file, uint64_t offset,
+                                      uint64_t length, uint64_t flags) {
+
+    struct stat file_stat{};
+    cached_file cached;
+    int32_t file_fd = this->open_file_to_send(file, &file_stat, &cached);
+    if (file_fd < 0 && !cached.data) {
+        return;
+    }
+    flags = this->accepted_flags(flags);
+    uint64_t file_size = file_stat.st_size;
+    offset = std::min(offset, file_size);
+    length = std::min(length, file_size - offset);
+    /* The checksum of the whole file takes room in the datagram like a longer name would. */
+    size_t name_length = file.length() + ((flags & TRANSFER_FLAG_FILE_CHECKSUM) ? sizeof(uint64_t) : 0);
+    if ((flags & TRANSFER_FLAG_INLINE) && length <= inline_capacity(name_length)) {
+        this->send_inline(addr, cmd_seq, file, file_fd, cached, offset, length, file_size, flags);
+        return;
+    }
+    flags &= ~TRANSFER_FLAG_INLINE;
+    in_port_t port;
+    uint64_t token;
+    if (!this->start_transfer(this->file_session(file_fd, cached, file, file_stat, offset, length, flags), flags,
+                              &port, &token)) {
         return;
     }
-    send_file(tcp_sock, file);
+    uint64_t param = port | (flags << TRANSFER_FLAGS_SHIFT);
+    cmplx_cmd command(GET_RESPONSE, htobe64(cmd_seq), htobe64(param), file.c_str());
+    uint64_t trailer[3];
+    size_t trailer_length = 0;
+    trailer[trailer_length++] = htobe64(file_size);
+    if (flags & TRANSFER_FLAG_FILE_CHECKSUM) {
+        trailer[trailer_length++] = htobe64(this->file_checksum(file, cached, file_size));
+    }
+    if (flags & TRANSFER_FLAG_SHARED_PORT) {
+        trailer[trailer_length++] = htobe64(token);
+    }
+    trailer_length *= sizeof(trailer[0]);
+    memcpy(command.data + file.length() + 1, trailer, trailer_length);
+    communication_socket.send_cmplx_cmd(command, addr, file.length() + 1 + trailer_length);
 }
 
-void Server::download_file(TCP_socket &sock, const std::string &file, uint64_t bytes_to_download) {
+void Server::abort_upload(const std::string &file) {
 
-    int32_t socket_number;
-    uint64_t to_download = bytes_to_download;
-    ssize_t len = 0;
-    if (sock.select(this->options.timeout) == -1 || (socket_number = sock.accept_connection()) < 0) {
-        this->server_file_set.del_file_from_set(file);
-        this->server_file_set.free_space(bytes_to_download);
-        if (fs::exists(this->options.shrd_fldr + file)) {
-            fs::remove(this->options.shrd_fldr + file);
+    this->file_cache.invalidate(file);
+    uint64_t size;
+    if (this->server_file_set.del_file_from_set(file, &size)) {
+        boost::system::error_code error;
+        fs::remove(this->options.shrd_fldr + file, error);
+        this->server_file_set.file_removed(file);
+        this->server_file_set.free_space(size);
+    }
+}
+
+void Server::commit_upload(const std::string &file, Space_reservation &reservation, const std::string &content_id,
+                           uint64_t checksum) {
+
+    bool duplicate = false;
+    /* Reads of the partly uploaded file could have been cached meanwhile. */
+    this->file_cache.invalidate(file);
+    if (this->server_file_set.commit_file(file, content_id, checksum, &duplicate)) {
+        /* Contents that were already stored don't take any more space. */
+        if (duplicate) {
+            reservation.release();
+        } else {
+            reservation.commit();
         }
-        return;
+    }
+}
+
+/*
+ * Creates the file of an upload as a new inode. Whatever is left at the path is unlinked first, so the upload never
+ * writes into another file's contents, like a blob shared through hard links.
+ */
+static int32_t create_upload_file(const std::string &path) {
+
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        return -1;
+    }
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+}
+
+std::unique_ptr<transfer_session> Server::download_session(const std::string &file, Space_reservation reservation,
+                                                           uint64_t flags) {
+
+    uint64_t bytes_to_download = reservation.size();
+    int32_t file_fd = create_upload_file(this->options.shrd_fldr + file);
+    if (file_fd < 0) {
+        this->abort_upload(file);
+        return nullptr;
+    }
+    this->server_file_set.file_created();
+    if (bytes_to_download > 0 && fallocate(file_fd, 0, 0, bytes_to_download) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        close(file_fd);
+        this->abort_upload(file);
+        return nullptr;
+    }
+    std::unique_ptr<transfer_session> session(new transfer_session);
+    session->direction = transfer_direction::RECEIVE;
+    if (flags & TRANSFER_FLAG_COMPRESSION) {
+        session->mode = transfer_mode::FRAMED;
+    } else if (this->options.zero_copy && !this->server_file_set.dedup_enabled) {
+        session->mode = transfer_mode::SPLICE;
     } else {
-        bool open;
-        fs::ofstream file_stream(this->options.shrd_fldr + file, std::ofstream::binary);
-        if ((open = file_stream.is_open())) {
-            char buffer[BUFFER_SIZE];
-            while ((len = read(socket_number, buffer, std::min(to_download, sizeof(buffer)))) > 0) {
-                file_stream.write(buffer, len);
-                to_download -= len;
-            }
+        session->mode = transfer_mode::COPY;
+    }
+    session->file_fd = file_fd;
+    session->bytes_left = bytes_to_download;
+    session->timeout = std::chrono::seconds(this->options.timeout);
+    session->checksum = flags & TRANSFER_FLAG_CHECKSUM;
+    std::shared_ptr<uint64_t> checksum = std::make_shared<uint64_t>(NO_CHECKSUM);
+    session->on_checksum = [checksum](uint32_t received) { *checksum = received; };
+    std::shared_ptr<Content_hash> content_hash;
+    if (this->server_file_set.dedup_enabled) {
+        content_hash = std::make_shared<Content_hash>();
+        session->on_receive = [content_hash](const char *data, size_t len) { content_hash->update(data, len); };
+    }
+    std::shared_ptr<Space_reservation> held = std::make_shared<Space_reservation>(std::move(reservation));
+    session->on_finish = [this, file, held, content_hash, checksum](bool success) {
+        if (success) {
+            this->commit_upload(file, *held, content_hash ? content_hash->hex_digest() : "", *checksum);
+        } else {
+            this->abort_upload(file);
         }
-        if (!open || to_download != 0 || len < 0) {
-            this->server_file_set.del_file_from_set(file);
-            this->server_file_set.free_space(bytes_to_download);
-            if (fs::exists(this->options.shrd_fldr + file)) {
-                fs::remove(this->options.shrd_fldr + file);
-            }
+    };
+    return session;
+}
+
+bool Server::store_inline(const std::string &file, Space_reservation reservation, const std::string &contents,
+                          bool checksum) {
+
+    uint64_t size = reservation.size();
+    uint64_t received_checksum = NO_CHECKSUM;
+    if (checksum) {
+        Crc32c crc;
+        crc.update(contents.data(), size);
+        if (get_checksum(contents.data() + size) != crc.value()) {
+            this->abort_upload(file);
+            return false;
         }
+        received_checksum = crc.value();
     }
+    int32_t file_fd = create_upload_file(this->options.shrd_fldr + file);
+    if (file_fd < 0) {
+        this->abort_upload(file);
+        return false;
+    }
+    this->server_file_set.file_created();
+    uint64_t position = 0;
+    while (position < size) {
+        ssize_t len = write(file_fd, contents.data() + position, size - position);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        position += len;
+    }
+    if (close(file_fd) < 0 || position < size) {
+        this->abort_upload(file);
+        return false;
+    }
+    std::string content_id;
+    if (this->server_file_set.dedup_enabled) {
+        Content_hash content_hash;
+        content_hash.update(contents.data(), size);
+        content_id = content_hash.hex_digest();
+    }
+    this->commit_upload(file, reservation, content_id, received_checksum);
+    this->metrics.add(metric_counter::INLINE_RECEIVES);
+    this->metrics.add(metric_counter::BYTES_RECEIVED, size);
+    return true;
 }
 
-void Server::handle_add_request(sockaddr_in addr, uint64_t cmd_seq, uint64_t file_size, std::string file) {
+void Server::handle_add_request(sockaddr_in addr, uint64_t cmd_seq, uint64_t file_size, std::string file,
+                                uint64_t flags, const std::string &contents) {
 
-    if (!file.empty() && file.find('/') == std::string::npos) {
-        if (!this->server_file_set.reserve_space(file_size)) {
+    if (!file.empty() && file.find('/') == std::string::npos && !is_journal_file(file)) {
+        Space_reservation reservation = this->server_file_set.reserve_space(file_size);
+        if (!reservation || !this->server_file_set.add_file_to_set(file, file_size)) {
             simpl_cmd command(ADD_DENIED_RESPONSE, htobe64(cmd_seq), file.c_str());
             this->communication_socket.send_simpl_cmd(command, addr, file.length());
             return;
         }
-        if (!this->server_file_set.add_file_to_set(file)) {
-            this->server_file_set.free_space(file_size);
-            simpl_cmd command(ADD_DENIED_RESPONSE, htobe64(cmd_seq), file.c_str());
-            this->communication_socket.send_simpl_cmd(command, addr, file.length());
+        this->file_cache.invalidate(file);
+        bool checksum = flags & TRANSFER_FLAG_CHECKSUM;
+        flags = this->accepted_flags(flags);
+        if (flags & TRANSFER_FLAG_INLINE) {
+            if (!this->store_inline(file, std::move(reservation), contents, checksum)) {
+                simpl_cmd command(ADD_DENIED_RESPONSE, htobe64(cmd_seq), file.c_str());
+                this->communication_socket.send_simpl_cmd(command, addr, file.length());
+                return;
+            }
+            flags &= TRANSFER_FLAG_INLINE | TRANSFER_FLAG_CHECKSUM;
+            cmplx_cmd command(ADD_ACCEPTED_RESPONSE, htobe64(cmd_seq), htobe64(flags << TRANSFER_FLAGS_SHIFT), "");
+            this->communication_socket.send_cmplx_cmd(command, addr, 0);
             return;
         }
-        TCP_socket tcp_sock;
-        if (!tcp_sock.init_socket() || !tcp_sock.bind_to_random_port() || (listen(tcp_sock.socket_number, QUEUE_LENGTH) < 0)) {
-            this->server_file_set.free_space(file_size);
-            this->server_file_set.del_file_from_set(file);
+        std::unique_ptr<transfer_session> session = this->download_session(file, std::move(reservation), flags);
+        in_port_t port;
+        uint64_t token;
+        if (!session || !this->start_transfer(std::move(session), flags, &port, &token)) {
             return;
         }
-        cmplx_cmd command(ADD_ACCEPTED_RESPONSE, htobe64(cmd_seq), htobe64(be16toh(tcp_sock.port_number)), "");
-        if (!communication_socket.send_cmplx_cmd(command, addr, 0)) {
-            this->server_file_set.free_space(file_size);
-            this->server_file_set.del_file_from_set(file);
-            return;
+        uint64_t param = port | (flags << TRANSFER_FLAGS_SHIFT);
+        cmplx_cmd command(ADD_ACCEPTED_RESPONSE, htobe64(cmd_seq), htobe64(param), "");
+        size_t data_len = 0;
+        if (flags & TRANSFER_FLAG_SHARED_PORT) {
+            uint64_t token_be = htobe64(token);
+            memcpy(command.data + 1, &token_be, sizeof(token_be));
+            data_len = 1 + sizeof(token_be);
         }
-        download_file(tcp_sock, file, file_size);
+        /* If the reply is lost the transfer times out and aborts the upload. */
+        communication_socket.send_cmplx_cmd(command, addr, data_len);
     }
 }
 
 void Server::handle_delete_request(std::string file) {
 
-    if (this->server_file_set.del_file_from_set(file)) {
-        try {
-            this->server_file_set.free_space(fs::file_size(this->options.shrd_fldr + file));
-            fs::remove(this->options.shrd_fldr + file);
-        } catch(const boost::filesystem::filesystem_error &e) {}
+    this->file_cache.invalidate(file);
+    uint64_t size;
+    if (this->server_file_set.del_file_from_set(file, &size)) {
+        boost::system::error_code error;
+        fs::remove(this->options.shrd_fldr + file, error);
+        this->server_file_set.file_removed(file);
+        this->server_file_set.free_space(size);
     }
 }
 
 
-static bool compare_cmd(const char *cmd, const std::string &expected_cmd) {
+/*
+ * Reads a big endian 64 bit value placed in command data after the file name, or returns default_value if the
+ * data is too short to hold it.
+ */
+static uint64_t read_trailer(const char *data, size_t data_len, size_t position, uint64_t default_value) {
 
-    for (uint16_t i = 0; i < CMD_MAX_LENGTH; i++) {
-        if (i < expected_cmd.length()) {
-            if (cmd[i] != expected_cmd[i]) {
-                return false;
-            }
-        } else {
-            if (cmd[i] != '\0') {
-                return false;
-            }
-        }
+    uint64_t value;
+    if (data_len < position + sizeof(value)) {
+        return default_value;
+    }
+    memcpy(&value, data + position, sizeof(value));
+    return be64toh(value);
+}
+
+static void package_skipping(const sockaddr_in &addr, const std::string &message) {
+    std::cerr << "[PCKG ERROR] Skipping invalid package from "<< inet_ntoa(addr.sin_addr) <<":"<< be16toh(addr.sin_port)
+              <<". " << message << std::endl;
+}
+
+
+bool Server::submit_command(metric_histogram command, std::function<void()> handler) {
+
+    std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+    if (!this->worker_pool.try_submit([this, command, handler, received] {
+            handler();
+            this->metrics.record_since(command, received); })) {
+        this->metrics.add(metric_counter::COMMANDS_DROPPED);
+        return false;
     }
     return true;
 }
 
-static std::string is_valid_package(const cmplx_cmd& command, size_t len) {
+void Server::dispatch_command(const message_view &command) {
 
-    if (len < EMPTY_SIMPL_CMD_LENGTH) {
-        return "command too short";
+    const sockaddr_in &addr = command.address;
+    if (command.length < EMPTY_SIMPL_CMD_LENGTH) {
+        this->metrics.add(metric_counter::COMMANDS_SKIPPED);
+        package_skipping(addr, "command too short");
+        return;
     }
-    if (compare_cmd(command.cmd, HELLO_RESPONSE)) {
-        if (len != EMPTY_SIMPL_CMD_LENGTH) {
-            return "hello command too long";
-        }
+    command_id id = identify_command(command);
+    const char *problem;
+    if (id != command_id::UNKNOWN && (problem = check_command(id, command)) != nullptr) {
+        this->metrics.add(metric_counter::COMMANDS_SKIPPED);
+        package_skipping(addr, problem);
+        return;
     }
-    if (compare_cmd(command.cmd, DELETE_REQUEST)) {
-        if (len == EMPTY_SIMPL_CMD_LENGTH) {
-            return "file to delete not specified";
+
+    switch (id) {
+        case command_id::HELLO: {
+            uint64_t cmd_seq = command.cmd_seq();
+            if (!this->submit_command(metric_histogram::HELLO, [this, addr, cmd_seq] {
+                    this->handle_hello_request(addr, cmd_seq); })) {
+                package_skipping(addr, "server overloaded");
+            }
+            break;
         }
-    }
-    if (compare_cmd(command.cmd, DELETE_REQUEST)) {
-        if (len == EMPTY_SIMPL_CMD_LENGTH) {
-            return "file to delete not specified";
+        case command_id::LIST: {
+            uint64_t cmd_seq = command.cmd_seq();
+            std::string pattern(command.simpl_data());
+            if (!this->submit_command(metric_histogram::LIST, [this, addr, cmd_seq, pattern] {
+                    this->handle_list_request(addr, cmd_seq, pattern); })) {
+                package_skipping(addr, "server overloaded");
+            }
+            break;
         }
-    }
-    if (compare_cmd(command.cmd, GET_REQUEST)) {
-        if (len == EMPTY_SIMPL_CMD_LENGTH) {
-            return "file to send not specified";
+        case command_id::GET: {
+            std::string file(command.simpl_data());
+            if (!this->server_file_set.is_file_in_set(file)) {
+                this->metrics.add(metric_counter::COMMANDS_SKIPPED);
+                package_skipping(addr, "server does not have the requested file");
+                return;
+            }
+            uint64_t cmd_seq = command.cmd_seq();
+            if (!this->submit_command(metric_histogram::GET, [this, addr, cmd_seq, file] {
+                    this->handle_get_request(addr, cmd_seq, file); })) {
+                package_skipping(addr, "server overloaded");
+            }
+            break;
         }
-    }
-    if (compare_cmd(command.cmd, ADD_REQUEST)) {
-        if (len < EMPTY_CMPLX_CMD_LENGTH) {
-            return "command too short";
+        case command_id::GET_RANGE: {
+            std::string file(command.cmplx_data());
+            if (!this->server_file_set.is_file_in_set(file)) {
+                this->metrics.add(metric_counter::COMMANDS_SKIPPED);
+                package_skipping(addr, "server does not have the requested file");
+                return;
+            }
+            uint64_t cmd_seq = command.cmd_seq();
+            uint64_t offset = command.param();
+            size_t data_len = command.cmplx_data_length();
+            uint64_t length = read_trailer(command.cmplx_data(), data_len, file.length() + 1, UINT64_MAX);
+            uint64_t flags = read_trailer(command.cmplx_data(), data_len, file.length() + 1 + sizeof(length), 0);
+            if (!this->submit_command(metric_histogram::GET_RANGE, [this, addr, cmd_seq, file, offset, length, flags] {
+                    this->handle_get_range_request(addr, cmd_seq, file, offset, length, flags); })) {
+                package_skipping(addr, "server overloaded");
+            }
+            break;
+        }
+        case command_id::DEL: {
+            std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+            std::string file(command.simpl_data());
+            handle_delete_request(file);
+            this->metrics.record_since(metric_histogram::DEL, received);
+            break;
         }
-        if (len == EMPTY_CMPLX_CMD_LENGTH) {
-            return "file to save on server not specified";
+        case command_id::STATS: {
+            uint64_t cmd_seq = command.cmd_seq();
+            if (!this->submit_command(metric_histogram::STATS, [this, addr, cmd_seq] {
+                    this->handle_stats_request(addr, cmd_seq); })) {
+                package_skipping(addr, "server overloaded");
+            }
+            break;
         }
+        case command_id::ADD: {
+            uint64_t cmd_seq = command.cmd_seq();
+            uint64_t file_size = command.param();
+            std::string file(command.cmplx_data());
+            size_t data_len = command.cmplx_data_length();
+            uint64_t flags = read_trailer(command.cmplx_data(), data_len, file.length() + 1, 0);
+            /* Contents of an inline upload fill the rest of the datagram, otherwise it's an upload over TCP. */
+            std::string contents;
+            size_t contents_position = file.length() + 1 + sizeof(flags);
+            uint64_t contents_length = file_size + ((flags & TRANSFER_FLAG_CHECKSUM) ? CHECKSUM_LENGTH : 0);
+            if ((flags & TRANSFER_FLAG_INLINE) && file_size <= inline_capacity(file.length()) &&
+                data_len == contents_position + contents_length) {
+                contents.assign(command.cmplx_data() + contents_position, contents_length);
+            } else {
+                flags &= ~TRANSFER_FLAG_INLINE;
+            }
+            if (!this->submit_command(metric_histogram::ADD, [this, addr, cmd_seq, file_size, file, flags, contents] {
+                    this->handle_add_request(addr, cmd_seq, file_size, file, flags, contents); })) {
+                simpl_cmd response(ADD_DENIED_RESPONSE, htobe64(cmd_seq), file.c_str());
+                this->communication_socket.send_simpl_cmd(response, addr, file.length());
+            }
+            break;
+        }
+        default:
+            this->metrics.add(metric_counter::COMMANDS_SKIPPED);
+            break;
     }
-    return "ok";
 }
 
-static void package_skipping(const std::string &ip, in_port_t port, std::string &message) {
-    std::cerr << "[PCKG ERROR] Skipping invalid package from "<< ip <<":"<< port <<". " << message << std::endl;
-}
+void Server::load_files() {
 
+    file_set &files_set = this->server_file_set;
+    journal_state state;
+    files_set.journal.init(this->options.shrd_fldr);
+    if (this->options.journal && files_set.journal.load(&state)) {
+        files_set.journal_enabled = true;
+        for (const std::string &file : state.unfinished) {
+            boost::system::error_code error;
+            fs::remove(this->options.shrd_fldr + file, error);
+            files_set.journal.append({journal_op::REMOVED, file, 0});
+        }
+    } else {
+        for (auto& file: fs::directory_iterator(this->options.shrd_fldr)) {
+            std::string name = file.path().filename().string();
+            if (fs::is_regular_file(file) && !is_journal_file(name)) {
+                state.files.push_back({name, fs::file_size(file.path())});
+            }
+        }
+    }
+    for (const file_entry &file : state.files) {
+        files_set.space_taken += file.size;
+    }
+    if (this->options.dedup) {
+        if ((files_set.dedup_enabled = files_set.blobs.init(this->options.shrd_fldr))) {
+            files_set.space_taken -= std::min<uint64_t>(files_set.space_taken, files_set.blobs.duplicated_bytes());
+        } else {
+            std::cerr << "Failed to open blob store, continuing without deduplication" << std::endl;
+        }
+    }
+    files_set.files_list = file_index_snapshot::build(state.files);
+    if (this->options.journal && !files_set.journal_enabled) {
+        if (!(files_set.journal_enabled = files_set.checkpoint())) {
+            std::cerr << "Failed to write index journal, continuing without it" << std::endl;
+        }
+    }
+}
 
 void Server::run() {
 
-    std::string ip;
-    in_port_t port;
-    cmplx_cmd_wrapper wrapper;
+    message_batch batch(RECEIVE_BATCH_SIZE);
 
     for (;;) {
 
-        if (!communication_socket.receive_cmplx_cmd(&wrapper)) {
+        if (!communication_socket.receive_message_batch(&batch)) {
             continue;
         }
-        cmplx_cmd command = wrapper.command;
-        ssize_t len = wrapper.length;
-        sockaddr_in addr = wrapper.address;
-
-        ip = inet_ntoa(addr.sin_addr);
-        port = be16toh(addr.sin_port);
-        std::string message;
-        if ((message = is_valid_package(command, len)) != "ok") {
-            package_skipping(ip, port, message);
-            continue;
-        }
-
-        if (compare_cmd(command.cmd, HELLO_REQUEST)) {
-            simpl_cmd *simpl_command = (simpl_cmd*)&command;
-            std::thread t(&Server::handle_hello_request, this, std::ref(addr), be64toh(simpl_command->cmd_seq));
-            t.detach();
-        } else if (compare_cmd(command.cmd, LIST_REQUEST)) {
-            simpl_cmd *simpl_command = (simpl_cmd*)&command;
-            std::thread t(&Server::handle_list_request, this, std::ref(addr), be64toh(simpl_command->cmd_seq), simpl_command->data);
-            t.detach();
-        } else if (compare_cmd(command.cmd, GET_REQUEST)) {
-            simpl_cmd *simpl_command = (simpl_cmd*)&command;
-            if (!this->server_file_set.is_file_in_set(simpl_command->data)) {
-                message = "server does not have the requested file";
-                package_skipping(ip, port, message);
-                continue;
-            }
-            std::thread t(&Server::handle_get_request, this, std::ref(addr), be64toh(simpl_command->cmd_seq), simpl_command->data);
-            t.detach();
-        } else if (compare_cmd(command.cmd, DELETE_REQUEST)) {
-            simpl_cmd *simpl_command = (simpl_cmd*)&command;
-            std::string file(simpl_command->data);
-            handle_delete_request(file);
-        } else if (compare_cmd(command.cmd, ADD_REQUEST)) {
-            std::thread t(&Server::handle_add_request, this, std::ref(addr), be64toh(command.cmd_seq), be64toh(command.param), command.data);
-            t.detach();
+        for (size_t i = 0; i < batch.count; i++) {
+            this->dispatch_command(batch.view(i));
         }
     }
 }
 
-Server::Server(const server_options& options) : options(options) {
+Server::Server(const server_options& options) : options(options),
+                                                worker_pool(options.workers, options.task_queue_length),
+                                                file_cache(options.cache_size, options.cache_max_file) {
 
     this->server_file_set.max_space = options.max_space;
-    this->server_file_set.space_taken = 0;
     if ((*(options.shrd_fldr.rend())) != '/') {
         this->options.shrd_fldr += '/';
     }
@@ -362,13 +1055,24 @@ Server::Server(const server_options& options) : options(options) {
         std::cerr << "SHRD_FLDR directory doesn't exist" << std::endl;
         exit(1);
     }
-    for (auto& file: fs::directory_iterator(this->options.shrd_fldr)) {
-        if (fs::is_regular_file(file)) {
-            this->server_file_set.space_taken += fs::file_size(file.path());
-            this->server_file_set.files_list.insert(file.path().filename().string());
-        }
-    }
+    this->load_files();
     signal(SIGPIPE, SIG_IGN);
+    if (!this->transfer_engine.start(this->options.io_threads, this->options.compression_threads,
+                                     this->options.io_uring)) {
+        std::cout << "Error while starting transfer engine" << std::endl;
+        exit(1);
+    }
+    if (this->options.io_uring && !this->transfer_engine.uses_io_uring()) {
+        std::cerr << "io_uring isn't available, copying file data with read and write" << std::endl;
+    }
+    TCP_socket data_socket;
+    if (!data_socket.init_socket() || !data_socket.bind_to_specific_port(htobe16(this->options.data_port)) ||
+        listen(data_socket.socket_number, DATA_PORT_QUEUE_LENGTH) < 0 ||
+        !this->transfer_engine.listen_for_connections(data_socket.release())) {
+        std::cout << "Error while setting up data port" << std::endl;
+        exit(1);
+    }
+    this->data_port = be16toh(data_socket.port_number);
     if (!this->communication_socket.init_standard_socket()) {
         std::cout << "Error while creating communication socket" << std::endl;
         exit(1);
@@ -382,4 +1086,7 @@ Server::Server(const server_options& options) : options(options) {
         std::cout << "Error while setting up communication socket" << std::endl;
         exit(1);
     }
+    if (!this->options.metrics_file.empty()) {
+        std::thread(&Server::dump_metrics, this).detach();
+    }
 }
@@ -4,12 +4,24 @@
 #include <string>
 #include <set>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <sys/stat.h>
 
 #include "communication.h"
+#include "file_index.h"
+#include "file_journal.h"
+#include "blob_store.h"
+#include "file_cache.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "transfer_engine.h"
 
 constexpr uint64_t DEFAULT_MAX_SPACE = 52428800;
 constexpr uint16_t SERVER_DEFAULT_TIMEOUT_VALUE = 5;
 constexpr uint16_t SERVER_MAX_TIMEOUT_VALUE = 300;
+constexpr uint32_t DEFAULT_TASK_QUEUE_LENGTH = 1024;
 
 struct server_options {
 
@@ -18,6 +30,22 @@ struct server_options {
     uint64_t max_space;
     std::string shrd_fldr;
     uint16_t timeout;
+    bool journal;
+    uint32_t workers;
+    uint32_t io_threads;
+    bool zero_copy;
+    bool io_uring;
+    bool dedup;
+    bool compression;
+    uint32_t compression_threads;
+    bool checksum;
+    bool inline_transfers;
+    in_port_t data_port;
+    uint64_t cache_size;
+    uint64_t cache_max_file;
+    std::string metrics_file;
+    uint32_t metrics_interval;
+    uint32_t task_queue_length;
 
     /*
      * Fills fields in structure according to values passed as parameters.
@@ -25,26 +53,108 @@ struct server_options {
     void fill_from_arguments(int argc, const char* argv[]);
 };
 
+/*
+ * Bytes of the space limit held by a single upload. They are given back when the reservation is destroyed,
+ * unless commit is called first, after which they are accounted to a stored file.
+ */
+class Space_reservation {
+
+private:
+
+    std::atomic<uint64_t> *space_taken = nullptr;
+    uint64_t number_of_bytes = 0;
+
+public:
+
+    Space_reservation() = default;
+    Space_reservation(std::atomic<uint64_t> *space_taken, uint64_t number_of_bytes);
+    Space_reservation(Space_reservation &&other) noexcept;
+    Space_reservation &operator=(Space_reservation &&other) noexcept;
+    Space_reservation(const Space_reservation&) = delete;
+    Space_reservation &operator=(const Space_reservation&) = delete;
+    ~Space_reservation();
+
+    explicit operator bool() const {
+        return space_taken != nullptr;
+    }
+    uint64_t size() const {
+        return number_of_bytes;
+    }
+    void commit();
+    void release();
+};
+
 struct file_set {
 
-    std::set<std::string> files_list;
-    uint64_t space_taken;
+    /*
+     * Current version of the index, read with std::atomic_load and replaced with std::atomic_store.
+     * files_list_mutex only serializes writers, readers never take it.
+     */
+    std::shared_ptr<const file_index_snapshot> files_list;
+    /*
+     * Sum of sizes of stored files and of live reservations, never above max_space.
+     * Changed only with atomic operations, so HELLO never waits for uploads.
+     */
+    std::atomic<uint64_t> space_taken{0};
     std::uint64_t max_space;
     std::mutex files_list_mutex;
-    std::mutex space_taken_mutex;
+    /*
+     * unfinished holds names of files that are being uploaded or removed, guarded by files_list_mutex.
+     * When enabled every change of the set is also recorded in the journal.
+     */
+    File_journal journal;
+    bool journal_enabled = false;
+    std::set<std::string> unfinished;
+    /*
+     * When enabled files with the same contents share one blob and take space once, guarded by files_list_mutex.
+     */
+    Blob_store blobs;
+    bool dedup_enabled = false;
 
     /*
      * Operations for checking and changing what files are in file set.
      */
+    std::shared_ptr<const file_index_snapshot> get_snapshot();
     bool is_file_in_set(const std::string &file);
-    bool add_file_to_set(const std::string &file);
-    bool del_file_from_set(const std::string &file);
+    /*
+     * Adds a file which upload is about to start, commit_file has to be called once it's complete.
+     * Fails if the file is in the set or still being removed.
+     */
+    bool add_file_to_set(const std::string &file, uint64_t size);
+    /*
+     * Called once the file of an upload was created, so the journal stays newer than the folder.
+     */
+    void file_created();
+    /*
+     * Returns false if the file was deleted while it was being uploaded. With deduplication the file is stored
+     * under content_id and *duplicate tells if the same contents were already stored. The checksum is kept in the
+     * index unless it's NO_CHECKSUM.
+     */
+    bool commit_file(const std::string &file, const std::string &content_id, uint64_t checksum, bool *duplicate);
+    /*
+     * Records the checksum of a stored file that has none yet, if it still has the given size and isn't being
+     * uploaded or removed.
+     */
+    void set_checksum(const std::string &file, uint64_t size, uint32_t checksum);
+    /*
+     * Removes a file from the set and stores in *size how many bytes of space it held, file_removed has to be called
+     * once it's removed from the disk. That's 0 for a file still being uploaded, as its space belongs to the upload.
+     */
+    bool del_file_from_set(const std::string &file, uint64_t *size);
+    void file_removed(const std::string &file);
+    /*
+     * Writes the whole set as a new journal snapshot.
+     */
+    bool checkpoint();
 
     /*
      * Operations for checking and changing how much free space is in file set.
      */
     uint64_t get_left_space();
-    bool reserve_space(uint64_t number_of_bytes);
+    /*
+     * Returns an empty reservation if there is not enough free space.
+     */
+    Space_reservation reserve_space(uint64_t number_of_bytes);
     void free_space(uint64_t number_of_bytes);
 };
 
@@ -55,6 +165,18 @@ private:
     server_options options;
     file_set server_file_set;
     UDP_socket communication_socket;
+    Transfer_engine transfer_engine;
+    Thread_pool worker_pool;
+    /*
+     * Contents of small popular files, sent without touching the disk. Every removal or replacement of a file
+     * invalidates its entry.
+     */
+    File_cache file_cache;
+    Metrics metrics;
+    /*
+     * Port of the data listener shared by transfers with TRANSFER_FLAG_SHARED_PORT.
+     */
+    in_port_t data_port = 0;
 
     /*
      * Handles HELLO request send by client to servers UDP port according to communication protocol specification.
@@ -67,28 +189,120 @@ private:
     void handle_list_request(sockaddr_in addr, uint64_t cmd_seq, std::string pattern);
 
     /*
-     * Sends a specified file to client using a TCP socket.
+     * Returns all metrics of the server in the Prometheus text format.
+     */
+    std::string metrics_text();
+    /*
+     * Handles STATS request, the metrics are split into as many responses as needed.
+     */
+    void handle_stats_request(sockaddr_in addr, uint64_t cmd_seq);
+    /*
+     * Writes the metrics to the metrics file every metrics_interval seconds, replacing it atomically.
+     */
+    void dump_metrics();
+
+    /*
+     * Returns the transfer flags out of requested ones that this server supports and has enabled.
+     */
+    uint64_t accepted_flags(uint64_t requested);
+    /*
+     * Opens a file from the shared folder for sending, returns -1 on failure. A file that is or gets cached is
+     * stored in *cached instead, then -1 is returned too and only st_size of *file_stat is set.
+     */
+    int32_t open_file_to_send(const std::string &file, struct stat *file_stat, cached_file *cached);
+    /*
+     * Hands a transfer to the transfer engine and stores in *port and *token where the client has to connect.
+     * Without TRANSFER_FLAG_SHARED_PORT the transfer gets its own listening socket and the token is 0.
+     * On failure the session is finished as failed.
+     */
+    bool start_transfer(std::unique_ptr<transfer_session> session, uint64_t flags, in_port_t *port, uint64_t *token);
+    /*
+     * Prepares sending length bytes of an opened file starting at offset to client.
+     * A whole file is sent with the checksum from the index if there is one, so it can still use sendfile.
+     * Otherwise the checksum is computed while sending, and kept in the index if the file didn't change meanwhile.
+     */
+    std::unique_ptr<transfer_session> send_session(int32_t file_fd, const std::string &file,
+                                                   const struct stat &file_stat, uint64_t offset, uint64_t length,
+                                                   uint64_t flags);
+    /*
+     * Prepares sending length bytes of a cached file starting at offset, straight from memory.
+     */
+    std::unique_ptr<transfer_session> memory_session(const cached_file &cached, uint64_t offset, uint64_t length,
+                                                     uint64_t flags);
+    /*
+     * Returns a session sending the part of the file that open_file_to_send opened or found in the cache.
+     */
+    std::unique_ptr<transfer_session> file_session(int32_t file_fd, const cached_file &cached, const std::string &file,
+                                                   const struct stat &file_stat, uint64_t offset, uint64_t length,
+                                                   uint64_t flags);
+    /*
+     * Returns the CRC32C of the whole file if it's cached or in the index for this size, otherwise NO_CHECKSUM.
      */
-    void send_file(TCP_socket &sock, const std::string &file);
+    uint64_t file_checksum(const std::string &file, const cached_file &cached, uint64_t file_size);
+    /*
+     * Answers GET_RANGE with length bytes of the file from offset inside the reply, see TRANSFER_FLAG_INLINE.
+     * Takes ownership of file_fd.
+     */
+    void send_inline(sockaddr_in addr, uint64_t cmd_seq, const std::string &file, int32_t file_fd,
+                     const cached_file &cached, uint64_t offset, uint64_t length, uint64_t file_size, uint64_t flags);
     /*
      * Handles GET request send by client to servers UDP port according to the communication protocol specification.
      */
     void handle_get_request(sockaddr_in addr, uint64_t cmd_seq, std::string file);
+    /*
+     * Handles GET_RANGE request, which works like GET but sends only a part of the file and reports its whole size.
+     */
+    void handle_get_range_request(sockaddr_in addr, uint64_t cmd_seq, std::string file, uint64_t offset, uint64_t length,
+                                  uint64_t flags);
 
     /*
-     * Download a specific file from client using a TCP socket.
+     * Removes a file whose upload failed, the space reserved for it is given back by its reservation.
+     */
+    void abort_upload(const std::string &file);
+    /*
+     * Commits a completely received file, the reservation's space is kept unless its contents were already stored.
+     */
+    void commit_upload(const std::string &file, Space_reservation &reservation, const std::string &content_id,
+                       uint64_t checksum);
+    /*
+     * Prepares downloading a specific file from client, returns nullptr if the file can't be created.
+     * A checksum sent by the client is verified against the received data and kept in the index.
+     */
+    std::unique_ptr<transfer_session> download_session(const std::string &file, Space_reservation reservation,
+                                                       uint64_t flags);
+    /*
+     * Stores a file uploaded inside the ADD request, contents are followed by their checksum if checksum is set.
+     * Returns false if the file can't be written or doesn't match its checksum.
      */
-    void download_file(TCP_socket &sock, const std::string &file, uint64_t bytes_to_download);
+    bool store_inline(const std::string &file, Space_reservation reservation, const std::string &contents,
+                      bool checksum);
     /*
      * Handles ADD request send by client to servers UDP port according to the communication protocol specification.
+     * Contents are set only for an inline upload, see TRANSFER_FLAG_INLINE.
      */
-    void handle_add_request(sockaddr_in addr, uint64_t cmd_seq, uint64_t file_size, std::string file);
+    void handle_add_request(sockaddr_in addr, uint64_t cmd_seq, uint64_t file_size, std::string file, uint64_t flags,
+                            const std::string &contents);
 
     /*
      * Handles DEL request send by client to servers UDP port according to the communication protocol specification.
      */
     void handle_delete_request(std::string file);
 
+    /*
+     * Queues a command's handler for the workers, its latency is recorded in the command's histogram once it's
+     * done. Returns false if the queue is full.
+     */
+    bool submit_command(metric_histogram command, std::function<void()> handler);
+    /*
+     * Validates a single received command and hands it to the right handler.
+     */
+    void dispatch_command(const message_view &command);
+
+    /*
+     * Fills the file set from the folder's journal, or by scanning the folder if the journal can't be trusted.
+     */
+    void load_files();
+
 public:
 
     explicit Server(const server_options &options);
@@ -0,0 +1,59 @@
+#include "thread_pool.h"
+
+Thread_pool::Thread_pool(size_t number_of_threads, size_t max_queue_length) : max_queue_length(max_queue_length) {
+
+    if (number_of_threads == 0) {
+        number_of_threads = 1;
+    }
+    for (size_t i = 0; i < number_of_threads; i++) {
+        this->workers.emplace_back(&Thread_pool::work, this);
+    }
+}
+
+Thread_pool::~Thread_pool() {
+
+    {
+        std::lock_guard<std::mutex> lock(this->tasks_mutex);
+        this->stopping = true;
+    }
+    this->tasks_condition.notify_all();
+    for (auto &worker : this->workers) {
+        worker.join();
+    }
+}
+
+void Thread_pool::work() {
+
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(this->tasks_mutex);
+            this->tasks_condition.wait(lock, [this] { return this->stopping || !this->tasks.empty(); });
+            if (this->tasks.empty()) {
+                return;
+            }
+            task = std::move(this->tasks.front());
+            this->tasks.pop();
+        }
+        task();
+    }
+}
+
+bool Thread_pool::try_submit(std::function<void()> task) {
+
+    {
+        std::lock_guard<std::mutex> lock(this->tasks_mutex);
+        if (this->stopping || this->tasks.size() >= this->max_queue_length) {
+            return false;
+        }
+        this->tasks.push(std::move(task));
+    }
+    this->tasks_condition.notify_one();
+    return true;
+}
+
+size_t Thread_pool::queue_depth() {
+
+    std::lock_guard<std::mutex> lock(this->tasks_mutex);
+    return this->tasks.size();
+}
@@ -0,0 +1,48 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+class Thread_pool {
+
+private:
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    size_t max_queue_length;
+    bool stopping = false;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_condition;
+
+    /*
+     * Main loop of a single worker, takes tasks from the queue until the pool is stopped.
+     */
+    void work();
+
+public:
+
+    /*
+     * Starts number_of_threads workers sharing a queue that holds at most max_queue_length pending tasks.
+     */
+    Thread_pool(size_t number_of_threads, size_t max_queue_length);
+    ~Thread_pool();
+
+    Thread_pool(const Thread_pool &) = delete;
+    Thread_pool &operator=(const Thread_pool &) = delete;
+
+    /*
+     * Queues a task for execution. Returns false without queueing it if the queue is full.
+     */
+    bool try_submit(std::function<void()> task);
+    /*
+     * Returns number of tasks waiting for a free worker.
+     */
+    size_t queue_depth();
+};
+
+#endif //THREAD_POOL_H
@@ -0,0 +1,1274 @@
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "transfer_engine.h"
+
+static bool pwrite_all(int32_t fd, const char *data, size_t len, uint64_t offset) {
+
+    while (len > 0) {
+        ssize_t written = pwrite(fd, data, len, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/*
+ * Transfers end with small writes of trailers and frames, which shouldn't wait for the peer's delayed ACK.
+ */
+static void disable_nagle(int32_t fd) {
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * Sessions that have to compute a checksum need the data in user space.
+ */
+static void adjust_mode(transfer_session &session) {
+
+    if (session.checksum && (session.direction == transfer_direction::RECEIVE ||
+                             session.known_checksum == NO_CHECKSUM) &&
+        (session.mode == transfer_mode::SENDFILE || session.mode == transfer_mode::SPLICE)) {
+        session.mode = transfer_mode::COPY;
+    }
+}
+
+frame_queue::~frame_queue() {
+    if (this->file_fd >= 0) {
+        close(this->file_fd);
+    }
+}
+
+bool Transfer_engine::start(size_t number_of_threads, size_t compression_threads, bool io_uring) {
+
+    if (number_of_threads == 0) {
+        number_of_threads = 1;
+    }
+    this->compression_pool.reset(new Thread_pool(std::max<size_t>(compression_threads, 1),
+                                                 COMPRESSION_TASK_QUEUE_LENGTH));
+    for (size_t i = 0; i < number_of_threads; i++) {
+        std::unique_ptr<io_loop> loop(new io_loop);
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            return false;
+        }
+        if ((loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            close(loop->epoll_fd);
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event) < 0) {
+            close(loop->wakeup_fd);
+            close(loop->epoll_fd);
+            return false;
+        }
+        if (io_uring && !this->setup_ring(*loop)) {
+            this->teardown_ring(*loop);
+        }
+        this->loops.push_back(std::move(loop));
+    }
+    for (auto &loop : this->loops) {
+        io_loop *loop_ptr = loop.get();
+        loop->thread = std::thread([this, loop_ptr] { this->run_loop(*loop_ptr); });
+    }
+    return true;
+}
+
+bool Transfer_engine::setup_ring(io_loop &loop) {
+
+    static const uint8_t opcodes[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SEND, IORING_OP_RECV};
+    std::unique_ptr<Io_ring> ring(new Io_ring);
+    if (!ring->init(RING_ENTRIES) || !ring->supports(opcodes, sizeof(opcodes))) {
+        return false;
+    }
+    void *memory = mmap(nullptr, RING_BUFFERS * RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    loop.ring_memory = (char*)memory;
+    std::vector<iovec> buffers(RING_BUFFERS);
+    for (uint32_t i = 0; i < RING_BUFFERS; i++) {
+        buffers[i].iov_base = loop.ring_memory + i * RING_BUFFER_SIZE;
+        buffers[i].iov_len = RING_BUFFER_SIZE;
+    }
+    if (!ring->register_buffers(buffers.data(), RING_BUFFERS)) {
+        return false;
+    }
+    if ((loop.ring_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        !ring->register_eventfd(loop.ring_event_fd)) {
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = ring.get();
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.ring_event_fd, &event) < 0) {
+        return false;
+    }
+    loop.buffer_users.assign(RING_BUFFERS, 0);
+    for (uint32_t i = RING_BUFFERS; i > 0; i--) {
+        loop.free_buffers.push_back(i - 1);
+    }
+    loop.ring = std::move(ring);
+    return true;
+}
+
+void Transfer_engine::teardown_ring(io_loop &loop) {
+
+    /* Closing the ring cancels operations still in flight, the registered buffers stay pinned until they end. */
+    loop.ring.reset();
+    for (ring_operation *operation : loop.operations) {
+        delete operation;
+    }
+    loop.operations.clear();
+    if (loop.ring_event_fd >= 0) {
+        close(loop.ring_event_fd);
+        loop.ring_event_fd = -1;
+    }
+    if (loop.ring_memory != nullptr) {
+        munmap(loop.ring_memory, RING_BUFFERS * RING_BUFFER_SIZE);
+        loop.ring_memory = nullptr;
+    }
+    loop.free_buffers.clear();
+    loop.buffer_users.clear();
+}
+
+bool Transfer_engine::uses_io_uring() const {
+
+    for (auto &loop : this->loops) {
+        if (loop->ring) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Transfer_engine::listen_for_connections(int32_t listen_fd) {
+
+    this->data_listen_fd = listen_fd;
+    if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) < 0) {
+        return false;
+    }
+    for (auto &loop : this->loops) {
+        epoll_event event{};
+        /* Wake only one loop per connection, the others would find nothing to accept. */
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = &this->data_listen_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Transfer_engine::~Transfer_engine() {
+
+    this->compression_pool.reset();
+    this->stopping = true;
+    for (auto &loop : this->loops) {
+        uint64_t one = 1;
+        if (write(loop->wakeup_fd, &one, sizeof(one)) < 0) {}
+    }
+    for (auto &loop : this->loops) {
+        if (loop->thread.joinable()) {
+            loop->thread.join();
+        }
+        this->teardown_ring(*loop);
+        close(loop->wakeup_fd);
+        close(loop->epoll_fd);
+    }
+    if (this->data_listen_fd >= 0) {
+        close(this->data_listen_fd);
+    }
+}
+
+void Transfer_engine::add_session(std::unique_ptr<transfer_session> session) {
+
+    io_loop &loop = *(this->loops[this->next_loop++ % this->loops.size()]);
+    this->sessions_count++;
+    {
+        std::lock_guard<std::mutex> lock(loop.pending_mutex);
+        loop.pending.push_back(std::move(session));
+    }
+    uint64_t one = 1;
+    if (write(loop.wakeup_fd, &one, sizeof(one)) < 0) {}
+}
+
+/*
+ * Returns a token from the kernel's random source, so tokens seen by one client tell nothing about the others.
+ */
+static uint64_t random_token() {
+
+    uint64_t token;
+    ssize_t len;
+    while ((len = getrandom(&token, sizeof(token), 0)) < 0 && errno == EINTR) {}
+    if (len != (ssize_t)sizeof(token)) {
+        std::random_device device;
+        token = ((uint64_t)device() << 32) | device();
+    }
+    return token;
+}
+
+uint64_t Transfer_engine::expect_connection(std::unique_ptr<transfer_session> session) {
+
+    adjust_mode(*session);
+    session->deadline = std::chrono::steady_clock::now() + session->timeout;
+    this->sessions_count++;
+    std::lock_guard<std::mutex> lock(this->awaiting_mutex);
+    uint64_t token;
+    do {
+        token = random_token();
+    } while (token == 0 || this->awaiting.count(token) > 0);
+    session->token = token;
+    this->awaiting[token] = std::move(session);
+    return token;
+}
+
+size_t Transfer_engine::active_sessions() {
+    return this->sessions_count;
+}
+
+size_t Transfer_engine::awaiting_sessions() {
+
+    std::lock_guard<std::mutex> lock(this->awaiting_mutex);
+    return this->awaiting.size();
+}
+
+size_t Transfer_engine::compression_queue_depth() {
+    return this->compression_pool ? this->compression_pool->queue_depth() : 0;
+}
+
+void Transfer_engine::register_pending(io_loop &loop) {
+
+    uint64_t counter;
+    if (read(loop.wakeup_fd, &counter, sizeof(counter)) < 0) {}
+    std::vector<std::unique_ptr<transfer_session>> pending;
+    std::vector<std::pair<transfer_session*, frame_queue*>> resumed;
+    {
+        std::lock_guard<std::mutex> lock(loop.pending_mutex);
+        pending.swap(loop.pending);
+        resumed.swap(loop.resumed);
+    }
+    for (auto &entry : resumed) {
+        auto session = loop.sessions.find(entry.first);
+        if (session != loop.sessions.end() && session->second->frames.get() == entry.second &&
+            session->second->state == transfer_state::TRANSFERRING) {
+            epoll_event event{};
+            event.events = EPOLLOUT;
+            event.data.ptr = entry.first;
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, entry.first->connection_fd, &event);
+        }
+    }
+    for (auto &session : pending) {
+        transfer_session *session_ptr = session.get();
+        loop.sessions[session_ptr] = std::move(session);
+        session_ptr->deadline = std::chrono::steady_clock::now() + session_ptr->timeout;
+        adjust_mode(*session_ptr);
+        if (session_ptr->mode == transfer_mode::FRAMED && !this->prepare_frames(loop, *session_ptr)) {
+            this->finish(loop, session_ptr, false);
+            continue;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = session_ptr;
+        if (fcntl(session_ptr->listen_fd, F_SETFL, fcntl(session_ptr->listen_fd, F_GETFL) | O_NONBLOCK) < 0 ||
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, session_ptr->listen_fd, &event) < 0) {
+            this->finish(loop, session_ptr, false);
+        }
+    }
+}
+
+bool Transfer_engine::accept_connection(io_loop &loop, transfer_session &session) {
+
+    int32_t connection_fd = accept4(session.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connection_fd < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED;
+    }
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.listen_fd, nullptr);
+    close(session.listen_fd);
+    session.listen_fd = -1;
+    session.connection_fd = connection_fd;
+    session.state = transfer_state::TRANSFERRING;
+    disable_nagle(connection_fd);
+    return this->start_streaming(loop, session, false);
+}
+
+bool Transfer_engine::start_streaming(io_loop &loop, transfer_session &session, bool registered) {
+
+    if (loop.ring && session.mode == transfer_mode::COPY && session.bytes_left > 0 &&
+        loop.free_buffers.size() >= RING_BUFFERS_PER_SESSION) {
+        for (uint32_t i = 0; i < RING_BUFFERS_PER_SESSION; i++) {
+            session.ring_buffers.push_back(loop.free_buffers.back());
+            loop.free_buffers.pop_back();
+        }
+        session.mode = transfer_mode::URING;
+        /* The ring tells when the data moved, epoll is only used again for the trailer. */
+        if (registered) {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.connection_fd, nullptr);
+        }
+        return true;
+    }
+    epoll_event event{};
+    event.events = (session.direction == transfer_direction::SEND) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = &session;
+    return epoll_ctl(loop.epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, session.connection_fd, &event) >= 0;
+}
+
+void Transfer_engine::accept_data_connections(io_loop &loop) {
+
+    int32_t fd;
+    while ((fd = accept4(this->data_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        disable_nagle(fd);
+        this->watch_connection(loop, fd, false);
+    }
+}
+
+void Transfer_engine::watch_connection(io_loop &loop, int32_t fd, bool registered) {
+
+    std::unique_ptr<data_connection> connection(new data_connection);
+    connection->fd = fd;
+    connection->deadline = std::chrono::steady_clock::now() + IDLE_CONNECTION_TIMEOUT;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = connection.get();
+    if (epoll_ctl(loop.epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) < 0) {
+        if (registered) {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        close(fd);
+        return;
+    }
+    data_connection *connection_ptr = connection.get();
+    loop.connections[connection_ptr] = std::move(connection);
+}
+
+void Transfer_engine::close_connection(io_loop &loop, data_connection *connection) {
+
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+    close(connection->fd);
+    loop.connections.erase(connection);
+}
+
+void Transfer_engine::read_token(io_loop &loop, data_connection *connection) {
+
+    ssize_t len = read(connection->fd, connection->token + connection->token_position,
+                       sizeof(connection->token) - connection->token_position);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0) {
+        this->close_connection(loop, connection);
+        return;
+    }
+    connection->token_position += len;
+    if (connection->token_position < sizeof(connection->token)) {
+        return;
+    }
+    uint64_t token;
+    memcpy(&token, connection->token, sizeof(token));
+    token = be64toh(token);
+    std::unique_ptr<transfer_session> session;
+    {
+        std::lock_guard<std::mutex> lock(this->awaiting_mutex);
+        auto entry = this->awaiting.find(token);
+        if (entry != this->awaiting.end()) {
+            session = std::move(entry->second);
+            this->awaiting.erase(entry);
+        }
+    }
+    if (!session) {
+        this->close_connection(loop, connection);
+        return;
+    }
+    int32_t fd = connection->fd;
+    loop.connections.erase(connection);
+
+    transfer_session *session_ptr = session.get();
+    loop.sessions[session_ptr] = std::move(session);
+    session_ptr->connection_fd = fd;
+    session_ptr->state = transfer_state::TRANSFERRING;
+    session_ptr->deadline = std::chrono::steady_clock::now() + session_ptr->timeout;
+    if ((session_ptr->mode == transfer_mode::FRAMED && !this->prepare_frames(loop, *session_ptr)) ||
+        !this->start_streaming(loop, *session_ptr, true)) {
+        this->finish(loop, session_ptr, false);
+        return;
+    }
+    if (session_ptr->mode == transfer_mode::URING) {
+        this->handle_event(loop, *session_ptr);
+    }
+}
+
+static bool is_unsupported_error(int error) {
+    return error == EINVAL || error == ENOSYS || error == EOPNOTSUPP;
+}
+
+ssize_t Transfer_engine::sendfile_chunk(transfer_session &session) {
+
+    off_t offset = session.file_offset;
+    ssize_t len = sendfile(session.connection_fd, session.file_fd, &offset,
+                           std::min<uint64_t>(session.bytes_left, MAX_BYTES_PER_WAKEUP));
+    if (len < 0 && is_unsupported_error(errno)) {
+        session.mode = transfer_mode::SPLICE;
+        return this->splice_chunk(session);
+    }
+    if (len > 0) {
+        session.file_offset += len;
+        session.bytes_left -= len;
+    }
+    return len;
+}
+
+ssize_t Transfer_engine::splice_chunk(transfer_session &session) {
+
+    if (session.pipe_fds[0] < 0 && pipe2(session.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        session.mode = transfer_mode::COPY;
+        return this->copy_chunk(session);
+    }
+    if (session.bytes_in_pipe == 0) {
+        loff_t offset = session.file_offset;
+        ssize_t len = splice(session.file_fd, &offset, session.pipe_fds[1], nullptr,
+                             std::min<uint64_t>(session.bytes_left, BUFFER_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len < 0 && is_unsupported_error(errno)) {
+            session.mode = transfer_mode::COPY;
+            return this->copy_chunk(session);
+        }
+        if (len <= 0) {
+            return len;
+        }
+        session.file_offset += len;
+        session.bytes_left -= len;
+        session.bytes_in_pipe = len;
+    }
+    ssize_t len = splice(session.pipe_fds[0], nullptr, session.connection_fd, nullptr, session.bytes_in_pipe,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (len > 0) {
+        session.bytes_in_pipe -= len;
+    }
+    return len;
+}
+
+/*
+ * Returns the copy buffer of a session, allocating it on first use.
+ */
+static char *session_buffer(transfer_session &session) {
+
+    if (!session.buffer) {
+        session.buffer.reset(new char[BUFFER_SIZE]);
+    }
+    return session.buffer.get();
+}
+
+ssize_t Transfer_engine::copy_chunk(transfer_session &session) {
+
+    char *buffer = session_buffer(session);
+    if (session.buffer_begin == session.buffer_end) {
+        ssize_t len = pread(session.file_fd, buffer, std::min<uint64_t>(session.bytes_left, BUFFER_SIZE),
+                            session.file_offset);
+        if (len <= 0) {
+            return len;
+        }
+        if (session.checksum && session.known_checksum == NO_CHECKSUM) {
+            session.crc.update(buffer, len);
+        }
+        session.file_offset += len;
+        session.bytes_left -= len;
+        session.buffer_begin = 0;
+        session.buffer_end = len;
+    }
+    ssize_t len = write(session.connection_fd, buffer + session.buffer_begin,
+                        session.buffer_end - session.buffer_begin);
+    if (len > 0) {
+        session.buffer_begin += len;
+    }
+    return len;
+}
+
+ssize_t Transfer_engine::memory_chunk(transfer_session &session) {
+
+    if (session.file_offset >= session.memory->size()) {
+        return 0;
+    }
+    size_t len = std::min<uint64_t>(session.bytes_left, session.memory->size() - session.file_offset);
+    ssize_t written = write(session.connection_fd, session.memory->data() + session.file_offset, len);
+    if (written > 0) {
+        if (session.checksum && session.known_checksum == NO_CHECKSUM) {
+            session.crc.update(session.memory->data() + session.file_offset, written);
+        }
+        session.file_offset += written;
+        session.bytes_left -= written;
+    }
+    return written;
+}
+
+ssize_t Transfer_engine::send_trailer_chunk(transfer_session &session) {
+
+    if (session.trailer_position == 0) {
+        put_checksum(session.trailer, (session.known_checksum != NO_CHECKSUM) ? (uint32_t)session.known_checksum
+                                                                              : session.crc.value());
+    }
+    ssize_t len = write(session.connection_fd, session.trailer + session.trailer_position,
+                        CHECKSUM_LENGTH - session.trailer_position);
+    if (len > 0) {
+        session.trailer_position += len;
+    }
+    return len;
+}
+
+bool Transfer_engine::prepare_frames(io_loop &loop, transfer_session &session) {
+
+    if (session.direction == transfer_direction::RECEIVE) {
+        session.decoder.reset(new Frame_decoder);
+        return true;
+    }
+    std::shared_ptr<frame_queue> queue = std::make_shared<frame_queue>();
+    queue->file_fd = session.file_fd;
+    session.file_fd = -1;
+    queue->memory = std::move(session.memory);
+    queue->next_offset = session.file_offset;
+    queue->end_offset = session.file_offset + session.bytes_left;
+    queue->checksum = session.checksum;
+    queue->known_checksum = session.known_checksum;
+    if (queue->checksum && queue->next_offset == queue->end_offset) {
+        /* Nothing to encode, so no compression task would add the checksum. */
+        queue->checksum_value = (queue->known_checksum != NO_CHECKSUM) ? (uint32_t)queue->known_checksum : 0;
+        queue->frames.emplace_back();
+        Frame_encoder::encode_checksum(queue->checksum_value, &queue->frames.back());
+    }
+    io_loop *loop_ptr = &loop;
+    transfer_session *session_ptr = &session;
+    frame_queue *queue_ptr = queue.get();
+    queue->wake = [loop_ptr, session_ptr, queue_ptr] {
+        {
+            std::lock_guard<std::mutex> lock(loop_ptr->pending_mutex);
+            loop_ptr->resumed.emplace_back(session_ptr, queue_ptr);
+        }
+        uint64_t one = 1;
+        if (write(loop_ptr->wakeup_fd, &one, sizeof(one)) < 0) {}
+    };
+    session.frames = queue;
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    return this->schedule_frames(queue);
+}
+
+bool Transfer_engine::schedule_frames(const std::shared_ptr<frame_queue> &queue) {
+
+    if (queue->producing || queue->failed || queue->next_offset == queue->end_offset ||
+        queue->frames.size() >= COMPRESSION_QUEUE_LENGTH) {
+        return true;
+    }
+    queue->producing = true;
+    if (!this->compression_pool->try_submit([this, queue] { this->produce_frames(queue); })) {
+        queue->producing = false;
+        return false;
+    }
+    return true;
+}
+
+void Transfer_engine::produce_frames(std::shared_ptr<frame_queue> queue) {
+
+    std::string block(queue->memory ? 0 : COMPRESSION_BLOCK_SIZE, '\0');
+    bool wake = false;
+    while (true) {
+        uint64_t offset, length;
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->failed || queue->next_offset == queue->end_offset ||
+                queue->frames.size() >= COMPRESSION_QUEUE_LENGTH) {
+                queue->producing = false;
+                wake = queue->consumer_waiting;
+                queue->consumer_waiting = false;
+                break;
+            }
+            offset = queue->next_offset;
+            length = std::min<uint64_t>(queue->end_offset - offset, COMPRESSION_BLOCK_SIZE);
+        }
+        ssize_t len;
+        const char *data = block.data();
+        if (queue->memory) {
+            /* Sessions sent from memory never read past its end, there's nothing to copy. */
+            len = (offset < queue->memory->size()) ? std::min<uint64_t>(length, queue->memory->size() - offset) : 0;
+            data = queue->memory->data() + std::min<uint64_t>(offset, queue->memory->size());
+        } else {
+            do {
+                len = pread(queue->file_fd, &block[0], length, offset);
+            } while (len < 0 && errno == EINTR);
+        }
+        std::string frame;
+        if (len > 0) {
+            if (queue->checksum && queue->known_checksum == NO_CHECKSUM) {
+                queue->crc.update(data, len);
+            }
+            queue->encoder.encode(data, len, &frame);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (len <= 0) {
+                /* The promised number of bytes can't be sent anymore, end the session. */
+                queue->failed = true;
+                queue->producing = false;
+                wake = queue->consumer_waiting;
+                queue->consumer_waiting = false;
+                break;
+            }
+            queue->frames.push_back(std::move(frame));
+            queue->next_offset += len;
+            if (queue->checksum && queue->next_offset == queue->end_offset) {
+                queue->checksum_value = (queue->known_checksum != NO_CHECKSUM) ? (uint32_t)queue->known_checksum
+                                                                                : queue->crc.value();
+                queue->frames.emplace_back();
+                Frame_encoder::encode_checksum(queue->checksum_value, &queue->frames.back());
+            }
+            wake = queue->consumer_waiting;
+            queue->consumer_waiting = false;
+        }
+        if (wake) {
+            queue->wake();
+            wake = false;
+        }
+    }
+    if (wake) {
+        queue->wake();
+    }
+}
+
+bool Transfer_engine::send_frames_step(io_loop &loop, transfer_session &session, bool *finished) {
+
+    frame_queue &queue = *session.frames;
+    uint64_t sent = 0;
+    while (sent < MAX_BYTES_PER_WAKEUP) {
+        if (session.frame_position == session.frame.length()) {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.failed) {
+                return false;
+            }
+            if (queue.frames.empty()) {
+                if (!queue.producing && queue.next_offset == queue.end_offset) {
+                    if (queue.checksum) {
+                        put_checksum(session.trailer, queue.checksum_value);
+                        session.trailer_position = CHECKSUM_LENGTH;
+                    }
+                    session.complete = true;
+                    *finished = true;
+                    return true;
+                }
+                queue.consumer_waiting = true;
+                epoll_event event{};
+                event.events = 0;
+                event.data.ptr = &session;
+                return epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, session.connection_fd, &event) >= 0;
+            }
+            session.frame.swap(queue.frames.front());
+            queue.frames.pop_front();
+            session.frame_position = 0;
+            if (!this->schedule_frames(session.frames)) {
+                return false;
+            }
+        }
+        ssize_t len = write(session.connection_fd, session.frame.data() + session.frame_position,
+                            session.frame.length() - session.frame_position);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session.frame_position += len;
+        sent += len;
+    }
+    return true;
+}
+
+bool Transfer_engine::send_step(transfer_session &session, bool *finished) {
+
+    uint64_t sent = 0;
+    while (sent < MAX_BYTES_PER_WAKEUP) {
+        ssize_t len;
+        if (session.bytes_left == 0 && session.bytes_in_pipe == 0 && session.buffer_begin == session.buffer_end) {
+            if (!session.checksum || session.trailer_position == CHECKSUM_LENGTH) {
+                session.complete = true;
+                *finished = true;
+                return true;
+            }
+            len = this->send_trailer_chunk(session);
+        } else {
+            switch (session.mode) {
+                case transfer_mode::SENDFILE:
+                    len = this->sendfile_chunk(session);
+                    break;
+                case transfer_mode::SPLICE:
+                    len = this->splice_chunk(session);
+                    break;
+                case transfer_mode::MEMORY:
+                    len = this->memory_chunk(session);
+                    break;
+                default:
+                    len = this->copy_chunk(session);
+            }
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (len == 0) {
+            /* File got shorter since the transfer started, send what was there without a checksum. */
+            *finished = session.bytes_in_pipe == 0 && session.buffer_begin == session.buffer_end;
+            return *finished;
+        }
+        sent += len;
+    }
+    return true;
+}
+
+ssize_t Transfer_engine::receive_splice_chunk(transfer_session &session) {
+
+    if (session.pipe_fds[0] < 0 && pipe2(session.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        session.mode = transfer_mode::COPY;
+        return this->receive_copy_chunk(session);
+    }
+    ssize_t len = splice(session.connection_fd, nullptr, session.pipe_fds[1], nullptr,
+                         std::min<uint64_t>(session.bytes_left, BUFFER_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (len < 0 && is_unsupported_error(errno)) {
+        session.mode = transfer_mode::COPY;
+        return this->receive_copy_chunk(session);
+    }
+    if (len <= 0) {
+        return len;
+    }
+    session.bytes_left -= len;
+    session.bytes_in_pipe = len;
+    while (session.bytes_in_pipe > 0) {
+        loff_t offset = session.file_offset;
+        ssize_t written = splice(session.pipe_fds[0], nullptr, session.file_fd, &offset, session.bytes_in_pipe,
+                                 SPLICE_F_MOVE);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && is_unsupported_error(errno)) {
+            /* File system can't take spliced data, drain the pipe by hand and stop using it. */
+            session.mode = transfer_mode::COPY;
+            char *buffer = session_buffer(session);
+            while (session.bytes_in_pipe > 0) {
+                ssize_t drained = read(session.pipe_fds[0], buffer,
+                                       std::min<uint64_t>(session.bytes_in_pipe, BUFFER_SIZE));
+                if (drained <= 0 || !pwrite_all(session.file_fd, buffer, drained, session.file_offset)) {
+                    return -1;
+                }
+                session.file_offset += drained;
+                session.bytes_in_pipe -= drained;
+            }
+            break;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        session.file_offset += written;
+        session.bytes_in_pipe -= written;
+    }
+    return len;
+}
+
+ssize_t Transfer_engine::receive_copy_chunk(transfer_session &session) {
+
+    char *buffer = session_buffer(session);
+    ssize_t len = read(session.connection_fd, buffer, std::min<uint64_t>(session.bytes_left, BUFFER_SIZE));
+    if (len <= 0) {
+        return len;
+    }
+    if (!pwrite_all(session.file_fd, buffer, len, session.file_offset)) {
+        return -1;
+    }
+    if (session.checksum) {
+        session.crc.update(buffer, len);
+    }
+    if (session.on_receive) {
+        session.on_receive(buffer, len);
+    }
+    session.file_offset += len;
+    session.bytes_left -= len;
+    return len;
+}
+
+ssize_t Transfer_engine::receive_frames_chunk(transfer_session &session) {
+
+    char *buffer = session_buffer(session);
+    /* A data port connection may already hold the token of the next transfer right after the last frame. */
+    size_t limit = (session.token != 0) ? std::min<size_t>(session.decoder->bytes_to_frame_end(), BUFFER_SIZE)
+                                        : BUFFER_SIZE;
+    ssize_t len = read(session.connection_fd, buffer, limit);
+    if (len <= 0) {
+        return len;
+    }
+    bool decoded = session.decoder->feed(buffer, len, [&session](const char *data, size_t data_len) {
+        if (data_len > session.bytes_left || !pwrite_all(session.file_fd, data, data_len, session.file_offset)) {
+            return false;
+        }
+        if (session.checksum) {
+            session.crc.update(data, data_len);
+        }
+        if (session.on_receive) {
+            session.on_receive(data, data_len);
+        }
+        session.file_offset += data_len;
+        session.bytes_left -= data_len;
+        return true;
+    });
+    if (!decoded) {
+        errno = EPROTO;
+        return -1;
+    }
+    return len;
+}
+
+ssize_t Transfer_engine::receive_trailer_chunk(transfer_session &session) {
+
+    ssize_t len = read(session.connection_fd, session.trailer + session.trailer_position,
+                       CHECKSUM_LENGTH - session.trailer_position);
+    if (len > 0) {
+        session.trailer_position += len;
+    }
+    return len;
+}
+
+bool Transfer_engine::verify_checksum(transfer_session &session) {
+
+    if (!session.checksum) {
+        return true;
+    }
+    uint32_t expected = (session.mode == transfer_mode::FRAMED) ? session.decoder->checksum()
+                                                                : get_checksum(session.trailer);
+    if (expected != session.crc.value()) {
+        return false;
+    }
+    put_checksum(session.trailer, expected);
+    session.trailer_position = CHECKSUM_LENGTH;
+    return true;
+}
+
+bool Transfer_engine::receive_step(transfer_session &session, bool *finished) {
+
+    uint64_t received = 0;
+    while (received < MAX_BYTES_PER_WAKEUP) {
+        bool framed = session.mode == transfer_mode::FRAMED;
+        if (session.bytes_left == 0 && (!session.checksum || (framed ? session.decoder->has_checksum()
+                                                                     : session.trailer_position == CHECKSUM_LENGTH))) {
+            *finished = true;
+            session.complete = this->verify_checksum(session);
+            return session.complete;
+        }
+        ssize_t len;
+        if (framed) {
+            len = this->receive_frames_chunk(session);
+        } else if (session.bytes_left == 0) {
+            len = this->receive_trailer_chunk(session);
+        } else if (session.mode == transfer_mode::SPLICE) {
+            len = this->receive_splice_chunk(session);
+        } else {
+            len = this->receive_copy_chunk(session);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (len == 0) {
+            return false;
+        }
+        received += len;
+    }
+    return true;
+}
+
+bool Transfer_engine::queue_operation(io_loop &loop, transfer_session &session, uint8_t opcode, uint32_t buffer,
+                                      uint32_t buffer_offset, uint32_t length, uint64_t file_offset, bool linked) {
+
+    io_uring_sqe *sqe = loop.ring->get_sqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    ring_operation *operation = new ring_operation;
+    operation->session = &session;
+    operation->opcode = opcode;
+    operation->buffer = buffer;
+    operation->buffer_offset = buffer_offset;
+    operation->length = length;
+    operation->file_offset = file_offset;
+
+    sqe->opcode = opcode;
+    sqe->addr = (uint64_t)(loop.ring_memory + buffer * RING_BUFFER_SIZE + buffer_offset);
+    sqe->len = length;
+    sqe->user_data = (uint64_t)operation;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->fd = session.file_fd;
+        sqe->off = file_offset;
+        sqe->buf_index = buffer;
+    } else {
+        sqe->fd = session.connection_fd;
+        /* With MSG_WAITALL a short send breaks the chain instead of letting later data overtake the rest. */
+        sqe->msg_flags = (opcode == IORING_OP_SEND) ? MSG_WAITALL | MSG_NOSIGNAL : 0;
+    }
+    if (linked) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    loop.operations.insert(operation);
+    loop.buffer_users[buffer]++;
+    session.ring_operations++;
+    return true;
+}
+
+bool Transfer_engine::ring_step(io_loop &loop, transfer_session &session, bool *finished) {
+
+    if (session.ring_failed) {
+        return false;
+    }
+    if (session.direction == transfer_direction::SEND) {
+        if (session.ring_operations > 0) {
+            return true;
+        }
+        if (session.ring_end_of_file) {
+            /* File got shorter since the transfer started, like in send_step. */
+            *finished = true;
+            return true;
+        }
+        if (session.bytes_left > 0 && !session.ring_waiting) {
+            uint64_t offset = session.file_offset;
+            uint64_t left = session.bytes_left;
+            for (size_t i = 0; i < session.ring_buffers.size() && left > 0; i++) {
+                uint32_t length = std::min<uint64_t>(left, RING_BUFFER_SIZE);
+                bool last = i + 1 == session.ring_buffers.size() || left == length;
+                if (!this->queue_operation(loop, session, IORING_OP_READ_FIXED, session.ring_buffers[i], 0, length,
+                                           offset, true) ||
+                    !this->queue_operation(loop, session, IORING_OP_SEND, session.ring_buffers[i], 0, length,
+                                           offset, !last)) {
+                    return false;
+                }
+                offset += length;
+                left -= length;
+            }
+        }
+    } else if (!session.ring_receiving && session.bytes_left > 0 && !session.ring_waiting) {
+        /* Only one read of the socket is in flight, so data arrives in order and never past this transfer. */
+        for (uint32_t buffer : session.ring_buffers) {
+            if (loop.buffer_users[buffer] == 0) {
+                if (!this->queue_operation(loop, session, IORING_OP_RECV, buffer, 0,
+                                           std::min<uint64_t>(session.bytes_left, RING_BUFFER_SIZE),
+                                           session.file_offset, false)) {
+                    return false;
+                }
+                session.ring_receiving = true;
+                break;
+            }
+        }
+    }
+    if (session.bytes_left > 0 || session.ring_operations > 0) {
+        return true;
+    }
+    epoll_event event{};
+    event.events = (session.direction == transfer_direction::SEND) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = &session;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, session.connection_fd, &event) < 0) {
+        return false;
+    }
+    if (!session.checksum) {
+        session.complete = true;
+        *finished = true;
+    }
+    return true;
+}
+
+void Transfer_engine::complete_operation(io_loop &loop, ring_operation *operation, int32_t result) {
+
+    loop.operations.erase(operation);
+    std::unique_ptr<ring_operation> owned(operation);
+    uint32_t buffer = operation->buffer;
+    loop.buffer_users[buffer]--;
+    transfer_session *session = operation->session;
+    if (session == nullptr) {
+        if (loop.buffer_users[buffer] == 0) {
+            loop.free_buffers.push_back(buffer);
+        }
+        return;
+    }
+    session->ring_operations--;
+    session->deadline = std::chrono::steady_clock::now() + session->timeout;
+    const char *data = loop.ring_memory + buffer * RING_BUFFER_SIZE + operation->buffer_offset;
+    uint32_t wait_events = 0;
+    switch (operation->opcode) {
+        case IORING_OP_READ_FIXED:
+            if (result >= 0 && (uint32_t)result < operation->length) {
+                session->ring_end_of_file = true;
+            } else if (result < 0 && result != -ECANCELED) {
+                session->ring_failed = true;
+            }
+            break;
+        case IORING_OP_SEND:
+            if (result > 0 && operation->file_offset == session->file_offset) {
+                if (session->checksum && session->known_checksum == NO_CHECKSUM) {
+                    session->crc.update(data, result);
+                }
+                session->file_offset += result;
+                session->bytes_left -= result;
+            } else if (result == -EAGAIN) {
+                wait_events = EPOLLOUT;
+            } else if (result != -ECANCELED) {
+                session->ring_failed = true;
+            }
+            break;
+        case IORING_OP_RECV:
+            session->ring_receiving = false;
+            if (result > 0) {
+                if (session->checksum) {
+                    session->crc.update(data, result);
+                }
+                if (session->on_receive) {
+                    session->on_receive(data, result);
+                }
+                if (!this->queue_operation(loop, *session, IORING_OP_WRITE_FIXED, buffer, 0, result,
+                                           session->file_offset, false)) {
+                    session->ring_failed = true;
+                }
+                session->file_offset += result;
+                session->bytes_left -= result;
+            } else if (result == -EAGAIN) {
+                wait_events = EPOLLIN;
+            } else {
+                /* 0 means the peer closed the connection early. */
+                session->ring_failed = true;
+            }
+            break;
+        case IORING_OP_WRITE_FIXED:
+            if (result <= 0) {
+                session->ring_failed = true;
+            } else if ((uint32_t)result < operation->length &&
+                       !this->queue_operation(loop, *session, IORING_OP_WRITE_FIXED, buffer,
+                                              operation->buffer_offset + result, operation->length - result,
+                                              operation->file_offset + result, false)) {
+                session->ring_failed = true;
+            }
+            break;
+    }
+    if (wait_events != 0 && !session->ring_failed && !session->ring_waiting) {
+        epoll_event event{};
+        event.events = wait_events;
+        event.data.ptr = session;
+        session->ring_waiting = epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, session->connection_fd, &event) >= 0;
+        session->ring_failed = !session->ring_waiting;
+    }
+    bool finished = false;
+    bool ok = this->ring_step(loop, *session, &finished);
+    if (!ok || finished) {
+        this->finish(loop, session, ok);
+    }
+}
+
+void Transfer_engine::reap_completions(io_loop &loop) {
+
+    uint64_t counter;
+    if (read(loop.ring_event_fd, &counter, sizeof(counter)) < 0) {}
+    io_uring_cqe cqe;
+    while (loop.ring->next_completion(&cqe)) {
+        this->complete_operation(loop, (ring_operation*)cqe.user_data, cqe.res);
+    }
+    loop.ring->submit();
+}
+
+bool Transfer_engine::handle_event(io_loop &loop, transfer_session &session) {
+
+    if (session.state == transfer_state::ACCEPTING) {
+        if (!this->accept_connection(loop, session)) {
+            this->finish(loop, &session, false);
+            return false;
+        }
+        if (session.state == transfer_state::ACCEPTING) {
+            return true;
+        }
+    }
+    bool finished = false;
+    bool ok;
+    if (session.mode == transfer_mode::URING && session.bytes_left > 0) {
+        if (session.ring_waiting) {
+            session.ring_waiting = false;
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, session.connection_fd, nullptr);
+        }
+        ok = this->ring_step(loop, session, &finished) && loop.ring->submit();
+    } else if (session.direction == transfer_direction::RECEIVE) {
+        ok = this->receive_step(session, &finished);
+    } else if (session.mode == transfer_mode::FRAMED) {
+        ok = this->send_frames_step(loop, session, &finished);
+    } else {
+        ok = this->send_step(session, &finished);
+    }
+    if (!ok || finished) {
+        this->finish(loop, &session, ok);
+        return false;
+    }
+    session.deadline = std::chrono::steady_clock::now() + session.timeout;
+    return true;
+}
+
+void Transfer_engine::finish(io_loop &loop, transfer_session *session, bool success) {
+
+    if (session->ring_operations > 0) {
+        /* Operations still in flight give their buffers back once they complete, shutdown makes socket ones end. */
+        for (ring_operation *operation : loop.operations) {
+            if (operation->session == session) {
+                operation->session = nullptr;
+            }
+        }
+        if (session->connection_fd >= 0) {
+            shutdown(session->connection_fd, SHUT_RDWR);
+        }
+    }
+    for (uint32_t buffer : session->ring_buffers) {
+        if (loop.buffer_users[buffer] == 0) {
+            loop.free_buffers.push_back(buffer);
+        }
+    }
+
+    if (success && session->complete && session->token != 0 && session->connection_fd >= 0 && !this->stopping) {
+        this->watch_connection(loop, session->connection_fd, true);
+        session->connection_fd = -1;
+    }
+
+    for (int32_t fd : {session->listen_fd, session->connection_fd}) {
+        if (fd >= 0) {
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+        }
+    }
+    for (int32_t fd : {session->file_fd, session->pipe_fds[0], session->pipe_fds[1]}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (session->frames) {
+        std::lock_guard<std::mutex> lock(session->frames->mutex);
+        session->frames->failed = true;
+    }
+    if (success && session->checksum && session->trailer_position == CHECKSUM_LENGTH && session->on_checksum) {
+        session->on_checksum(get_checksum(session->trailer));
+    }
+    if (session->on_finish) {
+        session->on_finish(success);
+    }
+    loop.sessions.erase(session);
+    this->sessions_count--;
+}
+
+void Transfer_engine::expire_sessions(io_loop &loop) {
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<transfer_session*> expired;
+    for (auto &entry : loop.sessions) {
+        if (entry.first->deadline <= now) {
+            expired.push_back(entry.first);
+        }
+    }
+    for (transfer_session *session : expired) {
+        this->finish(loop, session, false);
+    }
+    std::vector<data_connection*> idle;
+    for (auto &entry : loop.connections) {
+        if (entry.first->deadline <= now) {
+            idle.push_back(entry.first);
+        }
+    }
+    for (data_connection *connection : idle) {
+        this->close_connection(loop, connection);
+    }
+}
+
+void Transfer_engine::expire_awaiting(io_loop &loop) {
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<transfer_session>> expired;
+    {
+        std::lock_guard<std::mutex> lock(this->awaiting_mutex);
+        for (auto entry = this->awaiting.begin(); entry != this->awaiting.end();) {
+            if (this->stopping || entry->second->deadline <= now) {
+                expired.push_back(std::move(entry->second));
+                entry = this->awaiting.erase(entry);
+            } else {
+                entry++;
+            }
+        }
+    }
+    for (auto &session : expired) {
+        transfer_session *session_ptr = session.get();
+        loop.sessions[session_ptr] = std::move(session);
+        this->finish(loop, session_ptr, false);
+    }
+}
+
+void Transfer_engine::run_loop(io_loop &loop) {
+
+    epoll_event events[MAX_EPOLL_EVENTS];
+    std::chrono::steady_clock::time_point last_expiry_check = std::chrono::steady_clock::now();
+    while (!this->stopping) {
+        int ready = epoll_wait(loop.epoll_fd, events, MAX_EPOLL_EVENTS, 100);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == nullptr) {
+                this->register_pending(loop);
+                continue;
+            }
+            if (events[i].data.ptr == &this->data_listen_fd) {
+                this->accept_data_connections(loop);
+                continue;
+            }
+            if (loop.ring && events[i].data.ptr == loop.ring.get()) {
+                this->reap_completions(loop);
+                continue;
+            }
+            transfer_session *session = (transfer_session*)events[i].data.ptr;
+            if (loop.sessions.find(session) != loop.sessions.end()) {
+                this->handle_event(loop, *session);
+                continue;
+            }
+            auto connection = loop.connections.find((data_connection*)events[i].data.ptr);
+            if (connection != loop.connections.end()) {
+                this->read_token(loop, connection->first);
+            }
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - last_expiry_check >= std::chrono::milliseconds(100)) {
+            this->expire_sessions(loop);
+            if (&loop == this->loops[0].get()) {
+                this->expire_awaiting(loop);
+            }
+            last_expiry_check = now;
+        }
+    }
+    this->register_pending(loop);
+    if (&loop == this->loops[0].get()) {
+        this->expire_awaiting(loop);
+    }
+    while (!loop.sessions.empty()) {
+        this->finish(loop, loop.sessions.begin()->first, false);
+    }
+    while (!loop.connections.empty()) {
+        this->close_connection(loop, loop.connections.begin()->first);
+    }
+}
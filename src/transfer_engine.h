@@ -0,0 +1,402 @@
+#ifndef TRANSFER_ENGINE_H
+#define TRANSFER_ENGINE_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "checksum.h"
+#include "communication.h"
+#include "compression.h"
+#include "io_ring.h"
+#include "thread_pool.h"
+
+constexpr uint32_t DEFAULT_IO_THREADS = 2;
+constexpr int MAX_EPOLL_EVENTS = 64;
+constexpr uint64_t MAX_BYTES_PER_WAKEUP = 1048576;
+constexpr uint32_t DEFAULT_COMPRESSION_THREADS = 2;
+constexpr size_t COMPRESSION_TASK_QUEUE_LENGTH = 4096;
+constexpr std::chrono::seconds IDLE_CONNECTION_TIMEOUT(60);
+/*
+ * Registered buffers of each I/O thread's io_uring instance, lent to URING sessions RING_BUFFERS_PER_SESSION at
+ * a time. The ring has room for two operations on every buffer, so a chain is never split between submissions.
+ */
+constexpr uint32_t RING_BUFFERS = 64;
+constexpr uint32_t RING_BUFFERS_PER_SESSION = 4;
+constexpr size_t RING_BUFFER_SIZE = 65536;
+constexpr unsigned RING_ENTRIES = 256;
+
+enum class transfer_direction {
+    SEND,
+    RECEIVE
+};
+
+/*
+ * Way of moving bytes between the file and the socket. Zero-copy modes fall back to the next one when the kernel
+ * or the file system doesn't support them. SENDFILE only works for sending.
+ * FRAMED moves a compressed stream of frames described in compression.h. Frames sent are encoded on the engine's
+ * compression threads, so I/O threads only write them out. Frames received are decoded on the I/O thread.
+ * URING replaces COPY when the engine runs with io_uring and the session got registered buffers. Sending submits
+ * a linked chain of file read and socket send pairs, receiving keeps one socket read in flight while the previous
+ * chunks are written to the file. Trailers are still moved by the COPY code.
+ * MEMORY sends contents already held in memory, like the server's cached files, so the session has no file.
+ */
+enum class transfer_mode {
+    SENDFILE,
+    SPLICE,
+    COPY,
+    FRAMED,
+    URING,
+    MEMORY
+};
+
+enum class transfer_state {
+    ACCEPTING,
+    TRANSFERRING
+};
+
+/*
+ * Frames of a FRAMED send session. A compression task encodes blocks of the file until COMPRESSION_QUEUE_LENGTH
+ * frames are ready, the I/O thread takes them and starts a new task when there is room again. Shared by both, so
+ * a task still running after the session finished doesn't touch freed memory.
+ */
+struct frame_queue {
+
+    std::mutex mutex;
+    std::deque<std::string> frames;
+    int32_t file_fd = -1;
+    /*
+     * Blocks are copied from memory instead of read from file_fd when it's set.
+     */
+    std::shared_ptr<const std::string> memory;
+    uint64_t next_offset = 0;
+    uint64_t end_offset = 0;
+    bool producing = false;
+    bool failed = false;
+    /*
+     * Set by the I/O thread when it ran out of frames and stopped waiting for the socket, wake has to be called
+     * after the next frame is ready.
+     */
+    bool consumer_waiting = false;
+    Frame_encoder encoder;
+    /*
+     * With checksum set a CHECKSUM frame of checksum_value follows the last data frame. It's known_checksum if that
+     * is set, otherwise it's computed by the compression tasks.
+     */
+    bool checksum = false;
+    uint64_t known_checksum = NO_CHECKSUM;
+    Crc32c crc;
+    uint32_t checksum_value = 0;
+    std::function<void()> wake;
+
+    ~frame_queue();
+};
+
+/*
+ * Operation submitted to an io_uring instance, its address is the user_data of the submission. An operation of
+ * a session that finished meanwhile has no session and only gives its buffer back once it completes.
+ */
+struct ring_operation {
+
+    struct transfer_session *session = nullptr;
+    uint8_t opcode = 0;
+    uint32_t buffer = 0;
+    uint32_t buffer_offset = 0;
+    uint32_t length = 0;
+    uint64_t file_offset = 0;
+};
+
+/*
+ * Connection to the shared data port that didn't name its transfer yet. It's either new or kept open after the
+ * previous transfer on it completed, and it's closed if it stays idle for IDLE_CONNECTION_TIMEOUT.
+ */
+struct data_connection {
+
+    int32_t fd = -1;
+    char token[sizeof(uint64_t)];
+    size_t token_position = 0;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/*
+ * Single file transfer handled by the engine. A session starts with a listening socket, waits for exactly one
+ * connection on it and then streams bytes between the connection and file_fd.
+ * A session given to expect_connection has no listening socket, instead it gets the connection to the shared data
+ * port that sends its token as 8 big endian bytes.
+ */
+struct transfer_session {
+
+    transfer_direction direction;
+    transfer_state state = transfer_state::ACCEPTING;
+    int32_t listen_fd = -1;
+    int32_t connection_fd = -1;
+    int32_t file_fd = -1;
+    int32_t pipe_fds[2] = {-1, -1};
+    transfer_mode mode = transfer_mode::COPY;
+    /*
+     * Contents sent by MEMORY sessions, and by FRAMED ones without a file. Offsets are positions in it.
+     */
+    std::shared_ptr<const std::string> memory;
+    uint64_t file_offset = 0;
+    uint64_t bytes_left = 0;
+    uint64_t bytes_in_pipe = 0;
+    std::chrono::seconds timeout;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t token = 0;
+    /*
+     * Set once the whole stream was sent or received, after which a data port connection can carry another transfer.
+     */
+    bool complete = false;
+    /*
+     * Called exactly once from an I/O thread after all descriptors of the session were closed.
+     */
+    std::function<void(bool)> on_finish;
+    /*
+     * Optional, called from an I/O thread with every received chunk in file order. Needs COPY mode, as spliced data
+     * never passes through user space.
+     */
+    std::function<void(const char*, size_t)> on_receive;
+    /*
+     * With checksum set the data is followed by its CRC32C in the stream, see TRANSFER_FLAG_CHECKSUM. A send session
+     * sends known_checksum if it's set, otherwise the checksum is computed in the copy loop, so sessions that have to
+     * compute it don't use SENDFILE or SPLICE.
+     */
+    bool checksum = false;
+    uint64_t known_checksum = NO_CHECKSUM;
+    /*
+     * Optional, called from an I/O thread right before on_finish with the checksum of the data once all of it was
+     * sent, or received and matched the sender's checksum.
+     */
+    std::function<void(uint32_t)> on_checksum;
+    Crc32c crc;
+    char trailer[CHECKSUM_LENGTH];
+    size_t trailer_position = 0;
+
+    /*
+     * State of FRAMED sessions, created by the engine.
+     */
+    std::shared_ptr<frame_queue> frames;
+    std::string frame;
+    size_t frame_position = 0;
+    std::unique_ptr<Frame_decoder> decoder;
+
+    /*
+     * State of URING sessions. File offset and bytes left only count data that reached the socket or left it, so
+     * a broken chain is resubmitted from there.
+     */
+    std::vector<uint32_t> ring_buffers;
+    uint32_t ring_operations = 0;
+    bool ring_receiving = false;
+    bool ring_failed = false;
+    bool ring_end_of_file = false;
+    /*
+     * Set when the socket wasn't ready for an operation, the session waits for it in epoll before continuing.
+     */
+    bool ring_waiting = false;
+
+    /*
+     * Allocated by the first chunk that copies through user space, so sessions that splice, send files or still wait
+     * for their connection don't hold BUFFER_SIZE bytes each.
+     */
+    std::unique_ptr<char[]> buffer;
+    size_t buffer_begin = 0;
+    size_t buffer_end = 0;
+};
+
+class Transfer_engine {
+
+private:
+
+    struct io_loop {
+
+        int32_t epoll_fd = -1;
+        int32_t wakeup_fd = -1;
+        std::thread thread;
+        std::mutex pending_mutex;
+        std::vector<std::unique_ptr<transfer_session>> pending;
+        std::vector<std::pair<transfer_session*, frame_queue*>> resumed;
+        std::unordered_map<transfer_session*, std::unique_ptr<transfer_session>> sessions;
+        std::unordered_map<data_connection*, std::unique_ptr<data_connection>> connections;
+        /*
+         * Present if the engine runs with io_uring. Completions are signalled on ring_event_fd, tagged in epoll
+         * by the ring's address.
+         */
+        std::unique_ptr<Io_ring> ring;
+        int32_t ring_event_fd = -1;
+        char *ring_memory = nullptr;
+        std::vector<uint32_t> free_buffers;
+        std::vector<uint32_t> buffer_users;
+        std::unordered_set<ring_operation*> operations;
+    };
+
+    std::vector<std::unique_ptr<io_loop>> loops;
+    /*
+     * Shared data port, watched by all loops. Its address also tags its epoll events.
+     */
+    int32_t data_listen_fd = -1;
+    /*
+     * Sessions waiting for a data port connection with their token, expired by the first loop.
+     */
+    std::mutex awaiting_mutex;
+    std::unordered_map<uint64_t, std::unique_ptr<transfer_session>> awaiting;
+    std::unique_ptr<Thread_pool> compression_pool;
+    std::atomic<size_t> next_loop {0};
+    std::atomic<size_t> sessions_count {0};
+    std::atomic<bool> stopping {false};
+
+    /*
+     * Main loop of a single I/O thread.
+     */
+    void run_loop(io_loop &loop);
+    /*
+     * Registers sessions queued by add_session in the loop's epoll instance and resumes FRAMED sessions whose next
+     * frame became ready.
+     */
+    void register_pending(io_loop &loop);
+    /*
+     * Advances the session after its descriptor became ready. Returns false if the session is finished.
+     */
+    bool handle_event(io_loop &loop, transfer_session &session);
+    bool accept_connection(io_loop &loop, transfer_session &session);
+    /*
+     * Accepts all pending connections to the data port.
+     */
+    void accept_data_connections(io_loop &loop);
+    /*
+     * Starts watching a data port connection for the token of its next transfer. The descriptor is already in the
+     * loop's epoll instance if registered is set.
+     */
+    void watch_connection(io_loop &loop, int32_t fd, bool registered);
+    /*
+     * Reads the token of a data port connection and hands the connection to the session waiting for it.
+     */
+    void read_token(io_loop &loop, data_connection *connection);
+    void close_connection(io_loop &loop, data_connection *connection);
+    /*
+     * Starts moving data of a session that just got its connection, registered tells if the connection is already
+     * in the loop's epoll instance.
+     */
+    bool start_streaming(io_loop &loop, transfer_session &session, bool registered);
+    /*
+     * Creates the loop's io_uring instance with its registered buffers, returns false if io_uring can't be used.
+     */
+    bool setup_ring(io_loop &loop);
+    void teardown_ring(io_loop &loop);
+    /*
+     * Queues an operation on a buffer of the session, it's submitted with the rest of the batch.
+     */
+    bool queue_operation(io_loop &loop, transfer_session &session, uint8_t opcode, uint32_t buffer,
+                         uint32_t buffer_offset, uint32_t length, uint64_t file_offset, bool linked);
+    /*
+     * Submits the next operations of a URING session once the previous ones allow it. Hands the session back to
+     * epoll for the trailer when all data was moved. Same conventions as send_step.
+     */
+    bool ring_step(io_loop &loop, transfer_session &session, bool *finished);
+    /*
+     * Processes all posted completions and submits the operations they started.
+     */
+    void reap_completions(io_loop &loop);
+    void complete_operation(io_loop &loop, ring_operation *operation, int32_t result);
+    bool send_step(transfer_session &session, bool *finished);
+    /*
+     * Single attempt of moving file data to the socket in the session's mode, switching to the next mode if the
+     * current one isn't supported. Return number of bytes written to the socket, 0 on end of file, -1 and errno on
+     * error.
+     */
+    ssize_t sendfile_chunk(transfer_session &session);
+    ssize_t splice_chunk(transfer_session &session);
+    ssize_t copy_chunk(transfer_session &session);
+    ssize_t memory_chunk(transfer_session &session);
+    ssize_t send_trailer_chunk(transfer_session &session);
+    /*
+     * Single attempt of moving data from the socket to the file, same conventions as above except that 0 means the
+     * peer closed the connection.
+     */
+    ssize_t receive_splice_chunk(transfer_session &session);
+    ssize_t receive_copy_chunk(transfer_session &session);
+    ssize_t receive_frames_chunk(transfer_session &session);
+    ssize_t receive_trailer_chunk(transfer_session &session);
+    /*
+     * Returns true if the session didn't ask for a checksum or if the sender's one matches the received data.
+     */
+    bool verify_checksum(transfer_session &session);
+    bool receive_step(transfer_session &session, bool *finished);
+    /*
+     * Writes ready frames of a FRAMED session to the socket. When there are none it stops watching the socket until
+     * the compression task wakes the session up.
+     */
+    bool send_frames_step(io_loop &loop, transfer_session &session, bool *finished);
+    /*
+     * Sets up the frame queue or the decoder of a new FRAMED session, the first frames are encoded while the session
+     * waits for its connection.
+     */
+    bool prepare_frames(io_loop &loop, transfer_session &session);
+    /*
+     * Starts a compression task for the queue if it has room for more frames and no task is running.
+     * Has to be called with the queue's mutex held.
+     */
+    bool schedule_frames(const std::shared_ptr<frame_queue> &queue);
+    /*
+     * Body of a compression task, encodes blocks until the queue is full or the file is done.
+     */
+    void produce_frames(std::shared_ptr<frame_queue> queue);
+    /*
+     * Closes all descriptors of the session, calls its callback and forgets it.
+     */
+    void finish(io_loop &loop, transfer_session *session, bool success);
+    void expire_sessions(io_loop &loop);
+    void expire_awaiting(io_loop &loop);
+
+public:
+
+    Transfer_engine() = default;
+    ~Transfer_engine();
+
+    Transfer_engine(const Transfer_engine &) = delete;
+    Transfer_engine &operator=(const Transfer_engine &) = delete;
+
+    /*
+     * Creates epoll instances and starts the I/O threads and the threads encoding frames of FRAMED sessions.
+     * With io_uring set each I/O thread also tries to create an io_uring instance for URING sessions.
+     */
+    bool start(size_t number_of_threads, size_t compression_threads = DEFAULT_COMPRESSION_THREADS,
+               bool io_uring = false);
+    /*
+     * Returns true if at least one I/O thread got an io_uring instance.
+     */
+    bool uses_io_uring() const;
+    /*
+     * Starts accepting connections to the shared data port on listen_fd, the engine takes ownership of it.
+     */
+    bool listen_for_connections(int32_t listen_fd);
+    /*
+     * Hands the session to one of the I/O threads. The engine takes ownership of all its descriptors.
+     */
+    void add_session(std::unique_ptr<transfer_session> session);
+    /*
+     * Keeps a session without a listening socket until a data port connection sends the returned token, or until
+     * it times out. The engine takes ownership of all its descriptors.
+     */
+    uint64_t expect_connection(std::unique_ptr<transfer_session> session);
+    /*
+     * Returns number of sessions that were added and didn't finish yet.
+     */
+    size_t active_sessions();
+    /*
+     * Returns number of sessions waiting for their data port connection.
+     */
+    size_t awaiting_sessions();
+    /*
+     * Returns number of compression tasks waiting for a free thread.
+     */
+    size_t compression_queue_depth();
+};
+
+#endif //TRANSFER_ENGINE_H